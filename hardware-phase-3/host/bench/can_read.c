@@ -0,0 +1,151 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Feeds the J2534 CAN channel's ReadMsgs path a 500 kbit/s bus at full load
+// and counts the frames the 256 frame ring loses, for ReadMsgs that poll
+// every tick for a fixed 16 frames and for ReadMsgs that block for as many
+// frames as fit the MTU. The client keeps a number of ReadMsgs in flight
+// and sends the next one as each response comes in. Responses go out over
+// a link of fixed throughput, from the next connection event on. Times are
+// simulated, not measured.
+
+#define SIM_US 10000000
+#define RING 256
+// back to back 11-bit frames of 8 bytes, without stuff bits, 2 µs a bit
+#define FRAME_US 222
+// a response's id, call and code fields, and one such frame as a message
+#define RESPONSE_HEADER 10
+#define RESPONSE_MESSAGE 24
+// FreeRTOS at its default 100 Hz
+#define TICK_US 10000
+#define READ_TIMEOUT_US 100000
+#define MAX_IN_FLIGHT 8
+
+struct config {
+    bool poll;
+    int mtu;
+    int interval_us; // connection interval
+    int link_bytes_per_ms;
+    int in_flight;
+};
+
+static struct {
+    int64_t clock;
+    int ring;
+    uint64_t lost;
+    uint64_t read;
+    // requests the worker has yet to start, by when they got there
+    int64_t requests[MAX_IN_FLIGHT];
+    int pending;
+    bool busy;
+    size_t want;
+    int64_t deadline;
+    int64_t next_check;
+    int64_t link_free;
+    // when each response in flight reaches the client
+    int64_t delivered[MAX_IN_FLIGHT];
+    int on_link;
+} sim;
+
+// as read_can sizes its batches in j2534.c
+static size_t read_batch(int mtu) {
+    size_t room = mtu - 3;
+    if (room < 10 + 27) {
+        return 1;
+    }
+    size_t batch = (room - 10) / 27;
+    return (batch < RING) ? batch : RING;
+}
+
+static int64_t next_event(int64_t t, int interval) {
+    return (t / interval + 1) * interval;
+}
+
+static void respond(const struct config* c) {
+    size_t count = ((size_t)sim.ring < sim.want) ? (size_t)sim.ring : sim.want;
+    sim.ring -= count;
+    sim.read += count;
+    sim.busy = false;
+    int64_t start = next_event(sim.clock, c->interval_us);
+    start = (start > sim.link_free) ? start : sim.link_free;
+    sim.link_free = start + (RESPONSE_HEADER + RESPONSE_MESSAGE * (int64_t)count) * 1000 / c->link_bytes_per_ms;
+    sim.delivered[sim.on_link++] = sim.link_free;
+}
+
+static void run(const struct config* c) {
+    memset(&sim, 0, sizeof(sim));
+    size_t batch = c->poll ? 16 : read_batch(c->mtu);
+    for (int i = 0; i < c->in_flight; i++) {
+        sim.requests[sim.pending++] = 0;
+    }
+    for (sim.clock = 0; sim.clock < SIM_US; sim.clock++) {
+        if (sim.clock % FRAME_US == 0) {
+            if (sim.ring < RING) {
+                sim.ring++;
+            } else {
+                sim.lost++;
+            }
+        }
+        // the client sends the next ReadMsgs as a response comes in
+        for (int i = 0; i < sim.on_link; i++) {
+            if (sim.delivered[i] <= sim.clock) {
+                sim.requests[sim.pending++] = next_event(sim.delivered[i], c->interval_us);
+                sim.delivered[i--] = sim.delivered[--sim.on_link];
+            }
+        }
+        if (!sim.busy && sim.pending && sim.requests[0] <= sim.clock) {
+            memmove(sim.requests, sim.requests + 1, --sim.pending * sizeof(sim.requests[0]));
+            sim.busy = true;
+            sim.want = batch;
+            sim.deadline = sim.clock + READ_TIMEOUT_US;
+            sim.next_check = sim.clock;
+        }
+        if (!sim.busy) {
+            continue;
+        }
+        if (c->poll) {
+            // sees the ring only as the tick wakes it
+            if (sim.clock >= sim.next_check) {
+                if ((size_t)sim.ring >= sim.want || sim.clock >= sim.deadline) {
+                    respond(c);
+                } else {
+                    sim.next_check = (sim.clock / TICK_US + 1) * TICK_US;
+                }
+            }
+        } else if ((size_t)sim.ring >= sim.want || sim.clock >= sim.deadline) {
+            respond(c);
+        }
+    }
+}
+
+int main(void) {
+    static const int mtus[] = { 247, 512, 65535 };
+    static const int intervals[] = { 7500, 30000 };
+    // about what 1M and 2M PHYs carry with data length extension
+    static const int links[] = { 87, 162 };
+    static const int in_flight[] = { 1, 4 };
+    printf("bus: %d frames/s, ring %d, tick %d ms\n", 1000000 / FRAME_US, RING, TICK_US / 1000);
+    for (int m = -1; m < (int)(sizeof(mtus) / sizeof(mtus[0])); m++) {
+        for (size_t i = 0; i < sizeof(intervals) / sizeof(intervals[0]); i++) {
+            for (size_t l = 0; l < sizeof(links) / sizeof(links[0]); l++) {
+                for (size_t f = 0; f < sizeof(in_flight) / sizeof(in_flight[0]); f++) {
+                    struct config c = {
+                        .poll = m < 0,
+                        .mtu = (m < 0) ? 512 : mtus[m],
+                        .interval_us = intervals[i],
+                        .link_bytes_per_ms = links[l],
+                        .in_flight = in_flight[f],
+                    };
+                    run(&c);
+                    uint64_t frames = sim.read + sim.lost + sim.ring;
+                    printf("%s MTU %5d (%3zu frames), interval %4.1f ms, link %3d kB/s, %d in flight: %6.0f frames/s read, %5.1f%% lost\n",
+                        c.poll ? "poll " : "block", c.mtu, c.poll ? (size_t)16 : read_batch(c.mtu), c.interval_us / 1e3, c.link_bytes_per_ms, c.in_flight,
+                        sim.read * 1e6 / SIM_US, 100.0 * sim.lost / frames);
+                }
+            }
+        }
+    }
+    return 0;
+}
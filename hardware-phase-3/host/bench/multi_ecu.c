@@ -0,0 +1,302 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "isotp.h"
+#include "isotp_pool.h"
+
+// Runs isotp_event_loop against simulated ECUs on a simulated 500 kbit/s
+// bus, and compares N transfers one after the other with N at once: reading
+// a 4095 byte response from each ECU, and writing a 4095 byte message to
+// each. Times are simulated, not measured.
+
+#define MAX_ECUS 8
+#define MESSAGE 4095
+// before an ECU answers a request, or a first frame with flow control
+#define ECU_P2_US 2000
+#define ECU_FC_US 200
+// the least an ECU leaves between its own consecutive frames
+#define ECU_CF_GAP_US 500
+// what an ECU asks for when it is written to
+#define ECU_BS 8
+#define ECU_STMIN 1
+
+enum ecu_state {
+    ECU_IDLE,
+    ECU_SEND_FF,
+    ECU_WAIT_FC,
+    ECU_SEND_CF,
+    ECU_SEND_FC,
+    ECU_RECEIVE,
+};
+
+static struct ecu {
+    enum ecu_state state;
+    int64_t due; // when it wants the bus next, INT64_MAX if it does not
+    size_t size;
+    size_t offset;
+    uint8_t sn;
+    uint8_t bs;
+    uint8_t bs_count;
+    uint8_t stmin;
+} ecus[MAX_ECUS];
+
+static struct {
+    int ecus;
+    bool write;
+    bool concurrent;
+    int started;
+    int done;
+    int64_t clock;
+    int64_t bus_free;
+    int64_t timer;
+    uint32_t frames;
+} sim;
+
+static int64_t frame_time_us(uint8_t dlc) {
+    // 11-bit data frame plus interframe space, with worst case stuffing, 2 µs a bit
+    int bits = 47 + 8 * dlc + (34 + 8 * dlc - 1) / 4;
+    return bits * 2;
+}
+
+// claims the bus for a frame that is ready at time, returns when it is done
+static int64_t bus_send(int64_t time, uint8_t dlc) {
+    int64_t start = (time > sim.bus_free) ? time : sim.bus_free;
+    sim.bus_free = start + frame_time_us(dlc);
+    sim.frames++;
+    return sim.bus_free;
+}
+
+static uint32_t stmin_us(uint8_t stmin) {
+    return (stmin <= 0x7F) ? stmin * 1000 : (stmin >= 0xF1 && stmin <= 0xF9) ? (stmin - 0xF0) * 100 : 0x7F * 1000;
+}
+
+// a frame from the tester reaches ECU i at time
+static void ecu_receive(int i, const uint8_t* data, int64_t time) {
+    struct ecu* ecu = &ecus[i];
+    switch (data[0] >> 4) {
+    case 0:
+        ecu->state = ECU_SEND_FF;
+        ecu->size = MESSAGE;
+        ecu->due = time + ECU_P2_US;
+        break;
+    case 1:
+        ecu->state = ECU_SEND_FC;
+        ecu->size = ((data[0] & 0xF) << 8) | data[1];
+        ecu->offset = 6;
+        ecu->bs_count = 0;
+        ecu->due = time + ECU_FC_US;
+        break;
+    case 2:
+        ecu->offset += 7;
+        if (ecu->offset >= ecu->size) {
+            ecu->state = ECU_IDLE;
+        } else if (++ecu->bs_count == ECU_BS) {
+            ecu->bs_count = 0;
+            ecu->state = ECU_SEND_FC;
+            ecu->due = time + ECU_FC_US;
+        }
+        break;
+    case 3:
+        if (ecu->state == ECU_WAIT_FC && (data[0] & 0xF) == 0) {
+            ecu->state = ECU_SEND_CF;
+            ecu->bs = data[1];
+            ecu->bs_count = 0;
+            ecu->stmin = data[2];
+            ecu->due = time;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// the frame ECU i has to send, and what it does next once it is on the bus
+static void ecu_send(int i, uint8_t* data, int64_t* time) {
+    struct ecu* ecu = &ecus[i];
+    memset(data, 0xCC, 8);
+    *time = bus_send(ecu->due, 8);
+    ecu->due = INT64_MAX;
+    switch (ecu->state) {
+    case ECU_SEND_FF:
+        data[0] = 0x10 | (ecu->size >> 8);
+        data[1] = ecu->size;
+        ecu->offset = 6;
+        ecu->sn = 1;
+        ecu->state = ECU_WAIT_FC;
+        break;
+    case ECU_SEND_CF: {
+        data[0] = 0x20 | ecu->sn;
+        ecu->sn = (ecu->sn + 1) & 0xF;
+        ecu->offset += 7;
+        uint32_t gap = stmin_us(ecu->stmin);
+        if (ecu->offset >= ecu->size) {
+            ecu->state = ECU_IDLE;
+        } else if (ecu->bs && ++ecu->bs_count == ecu->bs) {
+            ecu->state = ECU_WAIT_FC;
+        } else {
+            ecu->due = *time + ((gap > ECU_CF_GAP_US) ? gap : ECU_CF_GAP_US);
+        }
+        break;
+    }
+    case ECU_SEND_FC:
+        data[0] = 0x30;
+        data[1] = ECU_BS;
+        data[2] = ECU_STMIN;
+        ecu->state = ECU_RECEIVE;
+        break;
+    default:
+        break;
+    }
+}
+
+static int64_t write_frame(uint32_t id, uint8_t dlc, const uint8_t* data) {
+    int64_t time = bus_send(sim.clock, dlc);
+    if (id >= 0x7E0 && id < 0x7E0 + MAX_ECUS) {
+        ecu_receive(id - 0x7E0, data, time);
+    }
+    return time;
+}
+
+static bool read_message_cb(const uint8_t* data, size_t size, const struct isotp_msg_info* info) {
+    (void)data;
+    if ((!sim.write && !info->flags && size == 4 + MESSAGE) || (sim.write && info->flags == ISOTP_MSG_TX_DONE && size == 4 + 0)) {
+        sim.done++;
+        sim.clock = info->time;
+    } else if (info->flags && !(info->flags & ISOTP_MSG_TX_DONE)) {
+        printf("transfer aborted\n");
+    }
+    return true;
+}
+
+static size_t rx_room(uint32_t channel) {
+    (void)channel;
+    return MAX_ECUS;
+}
+
+static void set_timer(int64_t deadline) {
+    sim.timer = deadline;
+}
+
+static void unmatched_frame(uint32_t id, uint8_t dlc, const uint8_t* data, int64_t time) {
+    (void)dlc;
+    (void)data;
+    (void)time;
+    printf("unmatched frame %03x\n", (unsigned)id);
+}
+
+static struct isotp_event* get_next_event(void) {
+    struct isotp_event* evt = isotp_event_alloc();
+    memset(evt, 0, sizeof(*evt));
+    static bool configured = false;
+    if (!configured) {
+        // V2 records: 0x7E0 + i to ECU i, 0x7E8 + i back, BS 0, STmin 0
+        static uint8_t records[1 + MAX_ECUS * ISOTP_PAIRS_V2_RECORD_SIZE];
+        records[0] = ISOTP_PAIRS_V2;
+        for (int i = 0; i < sim.ecus; i++) {
+            uint8_t* r = records + 1 + i * ISOTP_PAIRS_V2_RECORD_SIZE;
+            memset(r, 0, ISOTP_PAIRS_V2_RECORD_SIZE);
+            r[2] = (0x7E0 + i) >> 8;
+            r[3] = 0x7E0 + i;
+            r[8] = (0x7E8 + i) >> 8;
+            r[9] = 0x7E8 + i;
+        }
+        size_t size = 1 + sim.ecus * ISOTP_PAIRS_V2_RECORD_SIZE;
+        evt->type = EVENT_RECONFIGURE_PAIRS;
+        evt->pairs.size = size;
+        evt->pairs.data = isotp_pool_alloc(size);
+        memcpy(evt->pairs.data, records, size);
+        configured = true;
+        return evt;
+    }
+    if (sim.done == sim.ecus) {
+        configured = false;
+        evt->type = EVENT_SHUTDOWN;
+        return evt;
+    }
+    // a ReadDataByIdentifier, or the whole message for a write; with no
+    // large block left, a write waits for an earlier one to finish, like
+    // PassThruWriteMsgs on the device
+    size_t size = sim.write ? 4 + MESSAGE : 7;
+    uint8_t* data = NULL;
+    if (sim.started < sim.ecus && (sim.concurrent || sim.started == sim.done) && (data = isotp_pool_alloc(size))) {
+        uint32_t id = 0x7E0 + sim.started++;
+        memset(data, 0x55, size);
+        data[0] = 0;
+        data[1] = 0;
+        data[2] = id >> 8;
+        data[3] = id;
+        if (!sim.write) {
+            memcpy(data + 4, (const uint8_t[]) { 0x22, 0xF1, 0x90 }, 3);
+        }
+        evt->type = EVENT_WRITE_MSG;
+        evt->msg.size = size;
+        evt->msg.data = data;
+        evt->msg.time = sim.clock;
+        return evt;
+    }
+    // whichever comes first: an ECU getting the bus, or the timer
+    int next = -1;
+    int64_t start = INT64_MAX;
+    for (int i = 0; i < sim.ecus; i++) {
+        int64_t t = (ecus[i].due > sim.bus_free) ? ecus[i].due : sim.bus_free;
+        if (ecus[i].due != INT64_MAX && t < start) {
+            start = t;
+            next = i;
+        }
+    }
+    if (next < 0 || sim.timer <= start) {
+        if (sim.timer == INT64_MAX) {
+            printf("stuck\n");
+            evt->type = EVENT_SHUTDOWN;
+            return evt;
+        }
+        if (sim.timer > sim.clock) {
+            sim.clock = sim.timer;
+        }
+        sim.timer = INT64_MAX;
+        evt->type = EVENT_TIMER;
+        evt->timer.time = sim.clock;
+        return evt;
+    }
+    evt->type = EVENT_INCOMING_CAN;
+    evt->can.id = 0x7E8 + next;
+    evt->can.dlc = 8;
+    ecu_send(next, evt->can.data, &evt->can.time);
+    sim.clock = evt->can.time;
+    return evt;
+}
+
+static int64_t run(int count, bool write, bool concurrent) {
+    memset(ecus, 0, sizeof(ecus));
+    for (int i = 0; i < MAX_ECUS; i++) {
+        ecus[i].due = INT64_MAX;
+    }
+    memset(&sim, 0, sizeof(sim));
+    sim.ecus = count;
+    sim.write = write;
+    sim.concurrent = concurrent;
+    sim.timer = INT64_MAX;
+    isotp_event_loop(get_next_event, unmatched_frame, write_frame, read_message_cb, rx_room, set_timer);
+    return sim.clock;
+}
+
+static void bench(int count, bool write) {
+    int64_t serial = run(count, write, false);
+    int64_t parallel = run(count, write, true);
+    double bytes = (double)count * MESSAGE;
+    printf("%s %d ECU%s: one at a time %7.1f ms %6.1f kB/s, at once %7.1f ms %6.1f kB/s, %.1fx\n", write ? "write" : "read ", count, (count > 1) ? "s" : " ",
+        serial / 1e3, bytes / serial * 1e3, parallel / 1e3, bytes / parallel * 1e3, (double)serial / parallel);
+}
+
+int main(void) {
+    static const int counts[] = { 1, 4, 8 };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        bench(counts[i], false);
+    }
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        bench(counts[i], true);
+    }
+    return 0;
+}
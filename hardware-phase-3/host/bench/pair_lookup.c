@@ -0,0 +1,81 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "isotp.h"
+
+#define LOOKUPS 10000000
+
+// the scan isotp_event_loop did before the index, for comparison
+static int scan_rx(uint32_t id, const uint8_t* data) {
+    for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
+        bool is_active = isotp_addr_pairs[i].active;
+        bool id_match = is_active && (id & 0x9FFFFFFF) == (isotp_addr_pairs[i].rxid & 0x9FFFFFFF);
+        bool id_ext_match = id_match && (!(isotp_addr_pairs[i].rxid & 0x40000000) || (isotp_addr_pairs[i].rxext == data[0]));
+        if (id_ext_match) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// pairs 0x700/0x708 upwards, every fourth one with extended addressing
+static void setup(int count) {
+    for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
+        if (isotp_addr_pairs[i].active) {
+            isotp_addr_pairs[i].active = false;
+            isotp_pair_removed(i);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        bool ext = (i % 4) == 3;
+        isotp_addr_pairs[i].txid = (0x700 + i) | (ext ? 0x40000000 : 0);
+        isotp_addr_pairs[i].rxid = (0x708 + i + (i / 8) * 8) | (ext ? 0x40000000 : 0);
+        isotp_addr_pairs[i].txext = ext ? 0xF1 : 0;
+        isotp_addr_pairs[i].rxext = ext ? 0xF1 : 0;
+        isotp_addr_pairs[i].active = true;
+        isotp_pair_added(i);
+    }
+}
+
+// the last configured pair, worst case for the scan, plus a frame nobody wants
+static void bench(int count) {
+    setup(count);
+    uint32_t hit = isotp_addr_pairs[count - 1].rxid & 0x9FFFFFFF;
+    uint32_t miss = 0x123;
+    uint8_t data[8] = { 0xF1 };
+    volatile int sink = 0;
+
+    double start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        sink += scan_rx((i & 1) ? hit : miss, data);
+    }
+    double scan = now() - start;
+
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        sink += isotp_pair_find_rx((i & 1) ? hit : miss, data, 8);
+    }
+    double index = now() - start;
+
+    if (scan_rx(hit, data) != isotp_pair_find_rx(hit, data, 8) || isotp_pair_find_rx(miss, data, 8) != -1) {
+        printf("lookup mismatch at %d pairs\n", count);
+    }
+    printf("%2d pairs: scan %6.1f ns, index %6.1f ns per lookup\n", count, scan * 1e9 / LOOKUPS, index * 1e9 / LOOKUPS);
+}
+
+int main(void) {
+    memset(isotp_addr_pairs, 0, sizeof(isotp_addr_pairs));
+    bench(1);
+    bench(8);
+    bench(80);
+    return 0;
+}
@@ -0,0 +1,303 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "isotp.h"
+#include "isotp_pool.h"
+
+// Replays CAN frames through isotp_event_loop as fast as it takes them, and
+// reports frames and messages per second and how long each event kept the
+// loop busy. Frames come from a candump log (candump -l), or without one from
+// a synthetic mix: ECUs answering with interleaved multi-frame responses,
+// among broadcast traffic for no pair.
+//
+//   bench_replay [-p txid:rxid]... [candump.log]
+//
+// Without -p, pairs 0x7E0/0x7E8 to 0x7E7/0x7EF are configured; IDs of more
+// than three hex digits are extended.
+
+#define MAX_FRAMES 4000000
+#define SYNTHETIC_ECUS 8
+#define SYNTHETIC_FRAMES 1000000
+// frame spacing of the synthetic stream, a busy 500 kbit/s bus
+#define SYNTHETIC_GAP_US 250
+// events timed, frames plus the timers between them
+#define MAX_EVENTS (2 * MAX_FRAMES)
+
+struct frame {
+    int64_t time;
+    uint32_t id;
+    uint8_t dlc;
+    uint8_t data[8];
+};
+
+static struct frame* frames;
+static size_t frame_count;
+static uint8_t pairs[1 + ISOTP_MAX_PAIRS * ISOTP_PAIRS_V3_RECORD_SIZE] = { ISOTP_PAIRS_V3 };
+static size_t pair_count;
+
+static struct {
+    size_t next;
+    bool configured;
+    int64_t clock;
+    int64_t timer;
+    uint64_t start; // ns, when the event being handled was returned
+    uint32_t* latency; // ns, per event
+    size_t events;
+    uint32_t messages;
+    uint32_t aborted;
+    uint32_t unmatched;
+    uint32_t written;
+} replay;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static bool parse_id(const char* s, char** end, uint32_t* id) {
+    const char* start = s;
+    unsigned long value = strtoul(s, end, 16);
+    if (*end == start || value > 0x1FFFFFFF) {
+        return false;
+    }
+    *id = (uint32_t)value | ((*end - start > 3) ? 0x80000000 : 0);
+    return true;
+}
+
+static bool add_pair(uint32_t txid, uint32_t rxid) {
+    if (pair_count == ISOTP_MAX_PAIRS) {
+        return false;
+    }
+    uint8_t* r = pairs + 1 + pair_count++ * ISOTP_PAIRS_V3_RECORD_SIZE;
+    memset(r, 0, ISOTP_PAIRS_V3_RECORD_SIZE);
+    r[0] = txid >> 24;
+    r[1] = txid >> 16;
+    r[2] = txid >> 8;
+    r[3] = txid;
+    r[6] = rxid >> 24;
+    r[7] = rxid >> 16;
+    r[8] = rxid >> 8;
+    r[9] = rxid;
+    return true;
+}
+
+// "(1697040000.123456) can0 7E8#1014620102030405", skipping remote and FD frames
+static bool parse_candump(const char* line, struct frame* frame) {
+    unsigned long long sec, usec;
+    char id_data[64];
+    if (sscanf(line, " (%llu.%llu) %*s %63s", &sec, &usec, id_data) != 3) {
+        return false;
+    }
+    char* p;
+    if (!parse_id(id_data, &p, &frame->id) || *p++ != '#' || *p == '#' || *p == 'R') {
+        return false;
+    }
+    frame->time = (int64_t)(sec * 1000000 + usec);
+    frame->dlc = 0;
+    memset(frame->data, 0, sizeof(frame->data));
+    while (p[0] && p[1] && frame->dlc < 8) {
+        char byte[3] = { p[0], p[1], 0 };
+        frame->data[frame->dlc++] = (uint8_t)strtoul(byte, NULL, 16);
+        p += 2;
+        if (*p == '.') {
+            p++;
+        }
+    }
+    return true;
+}
+
+static size_t load_candump(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    char line[256];
+    size_t n = 0;
+    while (n < MAX_FRAMES && fgets(line, sizeof(line), f)) {
+        if (parse_candump(line, frames + n)) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+// every ECU answers one response after another, sizes cycling through a
+// single frame, a short and a long multi-frame message, frames interleaved
+// with the other ECUs; every fourth frame is broadcast traffic
+static size_t synthesize(void) {
+    static const size_t sizes[] = { 7, 62, 4095 };
+    struct {
+        size_t message;
+        size_t left;
+        uint8_t sn;
+    } ecus[SYNTHETIC_ECUS] = { 0 };
+    size_t n = 0;
+    for (int64_t time = 0; n < SYNTHETIC_FRAMES; time += SYNTHETIC_GAP_US) {
+        struct frame* frame = frames + n;
+        memset(frame, 0xCC, sizeof(*frame));
+        frame->time = time;
+        frame->dlc = 8;
+        if (n % 4 == 3) {
+            frame->id = 0x100 + (n / 4) % 64;
+            n++;
+            continue;
+        }
+        int i = (n - n / 4) % SYNTHETIC_ECUS;
+        frame->id = 0x7E8 + i;
+        if (!ecus[i].left) {
+            size_t size = sizes[ecus[i].message++ % 3];
+            if (size <= 7) {
+                frame->data[0] = size;
+                ecus[i].left = 0;
+            } else {
+                frame->data[0] = 0x10 | (size >> 8);
+                frame->data[1] = size;
+                ecus[i].left = size - 6;
+                ecus[i].sn = 1;
+            }
+        } else {
+            frame->data[0] = 0x20 | ecus[i].sn;
+            ecus[i].sn = (ecus[i].sn + 1) & 0xF;
+            ecus[i].left = (ecus[i].left > 7) ? ecus[i].left - 7 : 0;
+        }
+        n++;
+    }
+    return n;
+}
+
+static int64_t write_frame(uint32_t id, uint8_t dlc, const uint8_t* data) {
+    (void)id;
+    (void)dlc;
+    (void)data;
+    replay.written++;
+    return replay.clock;
+}
+
+static bool read_message_cb(const uint8_t* data, size_t size, const struct isotp_msg_info* info) {
+    (void)data;
+    (void)size;
+    if (!info->flags) {
+        replay.messages++;
+    } else if (info->flags & ISOTP_MSG_ABORTED) {
+        replay.aborted++;
+    }
+    return true;
+}
+
+static size_t rx_room(uint32_t channel) {
+    (void)channel;
+    return ISOTP_MAX_PAIRS;
+}
+
+static void set_timer(int64_t deadline) {
+    replay.timer = deadline;
+}
+
+static void unmatched_frame(uint32_t id, uint8_t dlc, const uint8_t* data, int64_t time) {
+    (void)id;
+    (void)dlc;
+    (void)data;
+    (void)time;
+    replay.unmatched++;
+}
+
+static struct isotp_event* get_next_event(void) {
+    uint64_t t = now_ns();
+    if (replay.start && replay.events < MAX_EVENTS) {
+        uint64_t busy = t - replay.start;
+        replay.latency[replay.events++] = (busy > UINT32_MAX) ? UINT32_MAX : (uint32_t)busy;
+    }
+    struct isotp_event* evt = isotp_event_alloc();
+    memset(evt, 0, sizeof(*evt));
+    if (!replay.configured) {
+        size_t size = 1 + pair_count * ISOTP_PAIRS_V3_RECORD_SIZE;
+        evt->type = EVENT_RECONFIGURE_PAIRS;
+        evt->pairs.size = size;
+        evt->pairs.data = isotp_pool_alloc(size);
+        memcpy(evt->pairs.data, pairs, size);
+        replay.configured = true;
+    } else if (replay.next == frame_count) {
+        evt->type = EVENT_SHUTDOWN;
+    } else if (replay.timer <= frames[replay.next].time) {
+        replay.clock = replay.timer;
+        replay.timer = INT64_MAX;
+        evt->type = EVENT_TIMER;
+        evt->timer.time = replay.clock;
+    } else {
+        const struct frame* frame = frames + replay.next++;
+        replay.clock = frame->time;
+        evt->type = EVENT_INCOMING_CAN;
+        evt->can.id = frame->id;
+        evt->can.dlc = frame->dlc;
+        memcpy(evt->can.data, frame->data, sizeof(evt->can.data));
+        evt->can.time = frame->time;
+    }
+    replay.start = now_ns();
+    return evt;
+}
+
+static int compare(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(double p) {
+    size_t i = (size_t)(p / 100 * (replay.events - 1));
+    return replay.latency[i];
+}
+
+int main(int argc, char** argv) {
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        char* p;
+        uint32_t txid, rxid;
+        if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            if (!parse_id(argv[++i], &p, &txid) || *p++ != ':' || !parse_id(p, &p, &rxid) || *p || !add_pair(txid, rxid)) {
+                fprintf(stderr, "bad or too many pairs: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!pair_count) {
+        for (int i = 0; i < SYNTHETIC_ECUS; i++) {
+            add_pair(0x7E0 + i, 0x7E8 + i);
+        }
+    }
+
+    frames = malloc(MAX_FRAMES * sizeof(*frames));
+    replay.latency = malloc(MAX_EVENTS * sizeof(*replay.latency));
+    if (!frames || !replay.latency) {
+        return 1;
+    }
+    frame_count = path ? load_candump(path) : synthesize();
+    if (!frame_count) {
+        fprintf(stderr, "no frames\n");
+        return 1;
+    }
+    replay.timer = INT64_MAX;
+
+    uint64_t start = now_ns();
+    isotp_event_loop(get_next_event, unmatched_frame, write_frame, read_message_cb, rx_room, set_timer);
+    double elapsed = (now_ns() - start) * 1e-9;
+
+    qsort(replay.latency, replay.events, sizeof(*replay.latency), compare);
+    printf("%zu frames from %s, %zu pairs\n", frame_count, path ? path : "the synthetic mix", pair_count);
+    printf("%10.0f frames/s, %10.0f messages/s (%" PRIu32 " messages, %" PRIu32 " aborted, %" PRIu32 " unmatched, %" PRIu32 " frames written)\n",
+        frame_count / elapsed, replay.messages / elapsed, replay.messages, replay.aborted, replay.unmatched, replay.written);
+    printf("ns per event: p50 %" PRIu32 ", p90 %" PRIu32 ", p99 %" PRIu32 ", p99.9 %" PRIu32 ", max %" PRIu32 "\n",
+        percentile(50), percentile(90), percentile(99), percentile(99.9), replay.latency[replay.events - 1]);
+    free(replay.latency);
+    free(frames);
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "isotp.h"
+#include "isotp_pool.h"
+
+// libFuzzer entry point for isotp_event_loop. The input is read as a script
+// of events: received frames, written messages, timer ticks, pair edits and
+// consumer back pressure. IDs come mostly from a fixed set of pairs, so
+// frames reach the transfer state machines instead of the unmatched path.
+// Everything handed to the loop keeps to its contract; after each run every
+// pool block and event must be free again.
+
+// physical, extended addressing, 29-bit, functional and streaming pairs
+static const struct {
+    uint32_t txid;
+    uint32_t rxid;
+    uint8_t ext;
+    uint8_t flags;
+} pair_set[] = {
+    { 0x7E0, 0x7E8, 0, 0 },
+    { 0x7E1, 0x7E9, 0, 0 },
+    { 0x200007E2, 0x200007EA, 0, 0 },
+    { 0x400006F1, 0x40000612, 0xF1, 0 },
+    { 0x98DA10F1, 0x98DAF110, 0, 0 },
+    { 0x7DF, 0x7E8, 0, ISOTP_PAIR_FUNCTIONAL },
+    { 0x98DB33F1, 0x98DAF100, 0, ISOTP_PAIR_FUNCTIONAL },
+    { 0x7E3, 0x7EB, 0, ISOTP_PAIR_STREAM },
+};
+#define PAIR_SET_COUNT (sizeof(pair_set) / sizeof(pair_set[0]))
+
+static struct {
+    const uint8_t* data;
+    size_t size;
+    int64_t clock;
+    bool configured;
+    size_t room;
+    bool reject; // read_message_cb turns messages down
+    bool tx_full; // write_frame fails
+} fuzz;
+
+static uint8_t next_byte(void) {
+    if (!fuzz.size) {
+        return 0;
+    }
+    fuzz.size--;
+    return *fuzz.data++;
+}
+
+static void fill_record(uint8_t* r, int i, uint8_t bs, uint8_t stmin) {
+    memset(r, 0, ISOTP_PAIRS_V3_RECORD_SIZE);
+    r[0] = pair_set[i].txid >> 24;
+    r[1] = pair_set[i].txid >> 16;
+    r[2] = pair_set[i].txid >> 8;
+    r[3] = pair_set[i].txid;
+    r[4] = pair_set[i].ext;
+    r[5] = 0xCC;
+    r[6] = pair_set[i].rxid >> 24;
+    r[7] = pair_set[i].rxid >> 16;
+    r[8] = pair_set[i].rxid >> 8;
+    r[9] = pair_set[i].rxid;
+    r[10] = pair_set[i].ext;
+    r[11] = 0xCC;
+    r[12] = bs;
+    r[13] = stmin;
+    r[14] = pair_set[i].flags;
+}
+
+// a frame from one of the pairs' peers, mostly, or any ID
+static void incoming_can(struct isotp_event* evt) {
+    uint8_t pick = next_byte();
+    int i = pick % (PAIR_SET_COUNT + 1);
+    evt->type = EVENT_INCOMING_CAN;
+    if (i < (int)PAIR_SET_COUNT) {
+        evt->can.id = (pair_set[i].rxid & 0x9FFFFFFF) + ((pair_set[i].flags & ISOTP_PAIR_FUNCTIONAL) ? (pick >> 5) : 0);
+        evt->can.id &= ~0x40000000;
+    } else {
+        evt->can.id = (next_byte() << 8) | next_byte();
+        evt->can.id &= 0x7FF;
+    }
+    evt->can.dlc = next_byte() % 9;
+    for (int j = 0; j < 8; j++) {
+        evt->can.data[j] = next_byte();
+    }
+    if (i < (int)PAIR_SET_COUNT && (pair_set[i].rxid & 0x40000000) && evt->can.dlc) {
+        evt->can.data[0] = pair_set[i].ext;
+    }
+    evt->can.time = fuzz.clock;
+}
+
+static bool write_msg(struct isotp_event* evt) {
+    int i = next_byte() % PAIR_SET_COUNT;
+    size_t addr = (pair_set[i].txid & 0x40000000) ? 5 : 4;
+    size_t size = addr + 1 + ((next_byte() << 8) | next_byte()) % (ISOTP_MAX_MSG_SIZE - addr);
+    uint8_t* data = isotp_pool_alloc(size);
+    if (!data) {
+        return false;
+    }
+    uint32_t id = pair_set[i].txid & 0xDFFFFFFF;
+    data[0] = id >> 24;
+    data[1] = id >> 16;
+    data[2] = id >> 8;
+    data[3] = id;
+    data[4] = pair_set[i].ext;
+    memset(data + addr, next_byte(), size - addr);
+    evt->type = EVENT_WRITE_MSG;
+    evt->msg.size = size;
+    evt->msg.data = data;
+    evt->msg.time = fuzz.clock;
+    return true;
+}
+
+static bool edit_pairs(struct isotp_event* evt) {
+    static const enum isotp_event_type types[] = { EVENT_ADD_PAIRS, EVENT_REMOVE_PAIRS, EVENT_UPDATE_PAIRS };
+    uint8_t* data = isotp_pool_alloc(ISOTP_PAIRS_V3_RECORD_SIZE);
+    if (!data) {
+        return false;
+    }
+    uint8_t pick = next_byte();
+    fill_record(data, pick % PAIR_SET_COUNT, next_byte() % 4, next_byte() % 3);
+    evt->type = types[(pick >> 4) % 3];
+    evt->pairs.size = ISOTP_PAIRS_V3_RECORD_SIZE;
+    evt->pairs.data = data;
+    // the characteristic's channel 0, or one of the J2534 channels
+    evt->pairs.channel = next_byte() % 2;
+    return true;
+}
+
+static bool reconfigure(struct isotp_event* evt) {
+    uint8_t mask = next_byte();
+    uint8_t* data = isotp_pool_alloc(1 + PAIR_SET_COUNT * ISOTP_PAIRS_V3_RECORD_SIZE);
+    if (!data) {
+        return false;
+    }
+    size_t size = 1;
+    data[0] = ISOTP_PAIRS_V3;
+    for (size_t i = 0; i < PAIR_SET_COUNT; i++) {
+        if (mask & (1 << i)) {
+            fill_record(data + size, i, next_byte() % 4, next_byte() % 3);
+            size += ISOTP_PAIRS_V3_RECORD_SIZE;
+        }
+    }
+    evt->type = EVENT_RECONFIGURE_PAIRS;
+    evt->pairs.size = size;
+    evt->pairs.data = data;
+    return true;
+}
+
+static struct isotp_event* get_next_event(void) {
+    struct isotp_event* evt = isotp_event_alloc();
+    if (!evt) {
+        abort();
+    }
+    memset(evt, 0, sizeof(*evt));
+    fuzz.clock += 100;
+    if (!fuzz.configured) {
+        fuzz.configured = true;
+        if (reconfigure(evt)) {
+            return evt;
+        }
+    }
+    while (fuzz.size) {
+        uint8_t op = next_byte();
+        switch (op % 8) {
+        case 0:
+        case 1:
+        case 2:
+            incoming_can(evt);
+            return evt;
+        case 3:
+            // up to a second on, past any timeout
+            fuzz.clock += next_byte() * 4096;
+            evt->type = EVENT_TIMER;
+            evt->timer.time = fuzz.clock;
+            return evt;
+        case 4:
+            if (write_msg(evt)) {
+                return evt;
+            }
+            break;
+        case 5:
+            if (edit_pairs(evt)) {
+                return evt;
+            }
+            break;
+        case 6:
+            if ((op >> 3) == 0 && reconfigure(evt)) {
+                return evt;
+            }
+            evt->type = EVENT_RECONFIGURE_BS_STMIN;
+            evt->bs_stmin.data[0] = next_byte() % 4;
+            evt->bs_stmin.data[1] = next_byte();
+            return evt;
+        default:
+            fuzz.room = (op >> 3) % 4;
+            fuzz.reject = op & 0x20;
+            fuzz.tx_full = op & 0x40;
+            break;
+        }
+    }
+    evt->type = EVENT_SHUTDOWN;
+    return evt;
+}
+
+static void unmatched_frame(uint32_t id, uint8_t dlc, const uint8_t* data, int64_t time) {
+    (void)id;
+    (void)time;
+    volatile uint8_t sink = 0;
+    for (int i = 0; i < dlc; i++) {
+        sink ^= data[i];
+    }
+}
+
+static int64_t write_frame(uint32_t id, uint8_t dlc, const uint8_t* data) {
+    (void)id;
+    volatile uint8_t sink = 0;
+    for (int i = 0; i < dlc; i++) {
+        sink ^= data[i];
+    }
+    return fuzz.tx_full ? -1 : fuzz.clock;
+}
+
+static bool read_message_cb(const uint8_t* data, size_t size, const struct isotp_msg_info* info) {
+    (void)info;
+    volatile uint8_t sink = 0;
+    for (size_t i = 0; i < size; i++) {
+        sink ^= data[i];
+    }
+    return !fuzz.reject;
+}
+
+static size_t rx_room(uint32_t channel) {
+    (void)channel;
+    return fuzz.room;
+}
+
+static void set_timer(int64_t deadline) {
+    (void)deadline;
+}
+
+// every block of both classes and every event can be taken again
+static void check_all_free(void) {
+    uint8_t* blocks[ISOTP_POOL_SMALL_COUNT + ISOTP_POOL_LARGE_COUNT];
+    for (int i = 0; i < ISOTP_POOL_SMALL_COUNT; i++) {
+        if (!(blocks[i] = isotp_pool_alloc(ISOTP_POOL_SMALL_SIZE))) {
+            abort();
+        }
+    }
+    for (int i = 0; i < ISOTP_POOL_LARGE_COUNT; i++) {
+        if (!(blocks[ISOTP_POOL_SMALL_COUNT + i] = isotp_pool_alloc(ISOTP_POOL_LARGE_SIZE))) {
+            abort();
+        }
+    }
+    for (int i = 0; i < ISOTP_POOL_SMALL_COUNT + ISOTP_POOL_LARGE_COUNT; i++) {
+        isotp_pool_free(blocks[i]);
+    }
+    struct isotp_event* events[ISOTP_EVENT_POOL_COUNT];
+    for (int i = 0; i < ISOTP_EVENT_POOL_COUNT; i++) {
+        if (!(events[i] = isotp_event_alloc())) {
+            abort();
+        }
+    }
+    for (int i = 0; i < ISOTP_EVENT_POOL_COUNT; i++) {
+        isotp_event_free(events[i]);
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    memset(&fuzz, 0, sizeof(fuzz));
+    fuzz.data = data;
+    fuzz.size = size;
+    fuzz.clock = 1000;
+    fuzz.room = 1;
+    isotp_event_loop(get_next_event, unmatched_frame, write_frame, read_message_cb, rx_room, set_timer);
+    check_all_free();
+    return 0;
+}
@@ -0,0 +1,45 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Runs the fuzz target without libFuzzer: over the files given, such as a
+// corpus or a crash to reproduce, or over random inputs if there are none.
+
+#define RANDOM_RUNS 100000
+#define RANDOM_MAX_SIZE 4096
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+static int run_file(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    static uint8_t data[1 << 20];
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        int failed = 0;
+        for (int i = 1; i < argc; i++) {
+            failed |= run_file(argv[i]);
+        }
+        return failed;
+    }
+    static uint8_t data[RANDOM_MAX_SIZE];
+    srand(1);
+    for (int run = 0; run < RANDOM_RUNS; run++) {
+        size_t size = rand() % RANDOM_MAX_SIZE;
+        for (size_t i = 0; i < size; i++) {
+            data[i] = rand();
+        }
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    printf("%d random inputs\n", RANDOM_RUNS);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef OMNITRIX_HOST_DRIVER_TWAI_H_
+#define OMNITRIX_HOST_DRIVER_TWAI_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// just enough of the IDF TWAI types for the headers the core includes;
+// the real header brings esp_err_t in with esp_err.h, TickType_t with
+// FreeRTOS.h
+typedef int esp_err_t;
+typedef uint32_t TickType_t;
+
+typedef struct {
+    union {
+        struct {
+            uint32_t extd : 1;
+            uint32_t rtr : 1;
+            uint32_t ss : 1;
+            uint32_t self : 1;
+            uint32_t dlc_non_comp : 1;
+            uint32_t reserved : 27;
+        };
+        uint32_t flags;
+    };
+    uint32_t identifier;
+    uint8_t data_length_code;
+    uint8_t data[8];
+} twai_message_t;
+
+#endif
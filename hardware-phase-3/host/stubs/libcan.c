@@ -0,0 +1,29 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <omnitrix/libcan.h>
+
+// the acceptance filter lives in hardware, nothing to do on the host
+bool omni_libcan_add_filter(uint32_t id, bool extd) {
+    (void)id;
+    (void)extd;
+    return true;
+}
+
+void omni_libcan_remove_filter(uint32_t id, bool extd) {
+    (void)id;
+    (void)extd;
+}
+
+bool omni_libcan_add_filter_mask(uint32_t id, uint32_t mask, bool extd) {
+    (void)id;
+    (void)mask;
+    (void)extd;
+    return true;
+}
+
+void omni_libcan_remove_filter_mask(uint32_t id, uint32_t mask, bool extd) {
+    (void)id;
+    (void)mask;
+    (void)extd;
+}
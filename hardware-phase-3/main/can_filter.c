@@ -0,0 +1,101 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "can_filter.h"
+
+static uint32_t load_be32(const uint8_t* bytes) {
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static struct can_filter_rule compile_rule(const struct can_filter* filter) {
+    struct can_filter_rule rule = {
+        .id_mask = filter->id_mask,
+        .id_pattern = filter->id_pattern & filter->id_mask,
+        .data_len = filter->data_len,
+        .extd = filter->extd,
+        .pass = filter->type == CAN_FILTER_PASS,
+    };
+    for (int i = 0; i < 2; i++) {
+        rule.data_mask[i] = load_be32(filter->data_mask + 4 * i);
+        rule.data_pattern[i] = load_be32(filter->data_pattern + 4 * i) & rule.data_mask[i];
+    }
+    return rule;
+}
+
+static bool rule_has_data(const struct can_filter_rule* rule) {
+    return rule->data_len != 0;
+}
+
+void can_filter_compile(const struct can_filter* filters, size_t count, struct can_filter_matcher* matcher) {
+    assert(filters || !count);
+    assert(count <= CAN_FILTER_MAX);
+    assert(matcher);
+    memset(matcher, 0, sizeof(*matcher));
+    // blocks first, so the first rule that matches decides
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            if (filters[i].type == (pass ? CAN_FILTER_PASS : CAN_FILTER_BLOCK)) {
+                matcher->rules[matcher->rule_count++] = compile_rule(&filters[i]);
+            }
+        }
+    }
+    for (uint32_t id = 0; id < 0x800; id++) {
+        bool passes = false;
+        bool blocks = false;
+        bool check = false;
+        for (size_t i = 0; i < matcher->rule_count; i++) {
+            const struct can_filter_rule* rule = &matcher->rules[i];
+            if (rule->extd || (id & rule->id_mask) != rule->id_pattern) {
+                continue;
+            }
+            if (!rule->pass && !rule_has_data(rule)) {
+                // blocked whatever the data; only blocks come before it
+                blocks = true;
+                break;
+            }
+            if (rule->pass && !rule_has_data(rule)) {
+                // passed whatever the data, unless a block on the data came first
+                passes = !check;
+                check = true;
+                break;
+            }
+            check = true;
+        }
+        if (passes) {
+            matcher->std_pass[id >> 5] |= 1u << (id & 0x1F);
+        } else if (check && !blocks) {
+            matcher->std_check[id >> 5] |= 1u << (id & 0x1F);
+        }
+    }
+}
+
+bool can_filter_match(const struct can_filter_matcher* matcher, uint32_t id, bool extd, uint8_t dlc, const uint8_t* data) {
+    assert(matcher);
+    assert(data || !dlc);
+    if (!extd) {
+        id &= 0x7FF;
+        if ((matcher->std_pass[id >> 5] >> (id & 0x1F)) & 1) {
+            return true;
+        }
+        if (!((matcher->std_check[id >> 5] >> (id & 0x1F)) & 1)) {
+            return false;
+        }
+    }
+    uint8_t bytes[8] = { 0 };
+    if (dlc > 8) {
+        dlc = 8;
+    }
+    memcpy(bytes, data, dlc);
+    uint32_t words[2] = { load_be32(bytes), load_be32(bytes + 4) };
+    for (size_t i = 0; i < matcher->rule_count; i++) {
+        const struct can_filter_rule* rule = &matcher->rules[i];
+        if (rule->extd == extd && (id & rule->id_mask) == rule->id_pattern && dlc >= rule->data_len
+            && (words[0] & rule->data_mask[0]) == rule->data_pattern[0] && (words[1] & rule->data_mask[1]) == rule->data_pattern[1]) {
+            return rule->pass;
+        }
+    }
+    return false;
+}
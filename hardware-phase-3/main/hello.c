@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -21,6 +22,7 @@
 #include <omnitrix/hello.h>
 #include <omnitrix/libcan.h>
 #include <omnitrix/libisotp.h>
+#include <omnitrix/libperiodic.h>
 #include <omnitrix/libvin.h>
 
 #ifdef CONFIG_OMNITRIX_ENABLE_BLE
@@ -29,6 +31,7 @@
 #endif
 
 #include "isotp.h"
+#include "isotp_pool.h"
 
 static const char tag[] = "omni_hello";
 
@@ -36,6 +39,29 @@ static uint8_t isotp_unmatched_frame_queue_storage[sizeof(twai_message_t) * 4];
 static StaticQueue_t isotp_unmatched_frame_queue_buffer;
 static QueueHandle_t isotp_unmatched_frame_queue_handle;
 
+// Fragments of messages on streaming pairs are served with a header in
+// front: 0xF0 (0xF1 for the last one), the sequence number (16 bits) and
+// the offset (32 bits), both big endian. Whole messages start with their
+// CAN ID, so their first byte never looks like that.
+#define HELLO_FRAGMENT 0xF0
+#define HELLO_FRAGMENT_LAST 0x01
+#define HELLO_FRAGMENT_HEADER 7
+
+// Messages too long for one write can be sent cut-through: 0xF0, the length
+// of the whole message (32 bits, big endian) and its start, at least the 5
+// address bytes, then 0xF1 followed by more of it for as many writes as it
+// takes. The first frame goes out right away; a write that would get too far
+// ahead of the bus is refused with BLE_ATT_ERR_PREPARE_QUEUE_FULL and should
+// be retried, one on a transfer that was aborted with BLE_ATT_ERR_UNLIKELY.
+#define HELLO_STREAM_START 0xF0
+#define HELLO_STREAM_MORE 0xF1
+#define HELLO_STREAM_HEADER 5
+
+static struct isotp_tx_stream hello_tx_stream;
+static bool hello_tx_streaming; // still holding the producer reference
+
+// received messages, each holding a reference to its pool block; the
+// characteristic only serves short ones
 static uint8_t isotp_msg_queue_storage[sizeof(struct isotp_msg) * 4];
 static StaticQueue_t isotp_msg_queue_buffer;
 static QueueHandle_t isotp_msg_queue_handle;
@@ -48,15 +74,109 @@ static const ble_uuid128_t gatt_svr_chr_can_uuid = BLE_UUID128_INIT(0x43, 0x17,
 static const ble_uuid128_t gatt_svr_chr_isotp_pairs_uuid = BLE_UUID128_INIT(0x39, 0x9d, 0x8e, 0x6a, 0x12, 0x6e, 0x8b, 0xb1, 0x57, 0x4d, 0xd7, 0xdf, 0x1d, 0x80, 0x31, 0x7e);
 static const ble_uuid128_t gatt_svr_chr_isotp_bs_stmin_uuid = BLE_UUID128_INIT(0xfc, 0xe2, 0x52, 0x84, 0xed, 0x1d, 0x22, 0x8d, 0xb4, 0x4e, 0xdb, 0x76, 0xfa, 0x17, 0x49, 0x27);
 static const ble_uuid128_t gatt_svr_chr_isotp_msg_uuid = BLE_UUID128_INIT(0x1e, 0x9a, 0x7a, 0x3f, 0x3f, 0x9e, 0x6f, 0x87, 0x3a, 0x42, 0x2b, 0xb9, 0xe1, 0xd4, 0x13, 0x28);
+static const ble_uuid128_t gatt_svr_chr_can_stats_uuid = BLE_UUID128_INIT(0xa8, 0xd2, 0xf8, 0x46, 0xe6, 0x2f, 0x44, 0x5a, 0x99, 0x90, 0x7e, 0x5c, 0x87, 0xce, 0x8f, 0x99);
 static uint16_t gatt_svr_chr_hello_val_handle;
 static uint16_t gatt_svr_chr_vin_val_handle;
 static uint16_t gatt_svr_chr_can_val_handle;
 static uint16_t gatt_svr_chr_isotp_pairs_val_handle;
 static uint16_t gatt_svr_chr_isotp_bs_stmin_val_handle;
 static uint16_t gatt_svr_chr_isotp_msg_val_handle;
+static uint16_t gatt_svr_chr_can_stats_val_handle;
+
+// takes the stream from the producer side once all of it is written
+static void hello_stream_close(void) {
+    if (hello_tx_streaming) {
+        hello_tx_streaming = false;
+        isotp_tx_stream_release(&hello_tx_stream);
+    }
+}
+
+static int hello_stream_start(const uint8_t* buf, uint16_t len) {
+    assert(len >= HELLO_STREAM_HEADER - 1 + 5);
+    size_t size = ((size_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    buf += HELLO_STREAM_HEADER - 1;
+    len -= HELLO_STREAM_HEADER - 1;
+    if (size < len || size > ISOTP_MAX_MSG_SIZE) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    // a new message gives up on one that was never finished
+    if (hello_tx_streaming) {
+        atomic_store(&hello_tx_stream.done, true);
+        hello_stream_close();
+    }
+    if (atomic_load(&hello_tx_stream.refs)) {
+        ESP_LOGD(tag, "previous stream still being sent");
+        return BLE_ATT_ERR_PREPARE_QUEUE_FULL;
+    }
+    struct isotp_event* event = isotp_event_alloc();
+    if (!event) {
+        ESP_LOGD(tag, "no event available");
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    uint8_t* data = isotp_pool_alloc(size);
+    if (!data) {
+        isotp_event_free(event);
+        ESP_LOGD(tag, "no message buffer available");
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    isotp_tx_stream_init(&hello_tx_stream, data, size);
+    bool written = isotp_tx_stream_write(&hello_tx_stream, buf, len);
+    assert(written);
+    (void)written;
+    event->type = EVENT_WRITE_MSG;
+    event->msg.size = size;
+    event->msg.time = esp_timer_get_time();
+    event->msg.data = data;
+    event->msg.stream = &hello_tx_stream;
+    if (xQueueSend(isotp_event_queue_handle, &event, 0) != pdTRUE) {
+        // neither reference was handed over
+        isotp_event_free(event);
+        isotp_tx_stream_release(&hello_tx_stream);
+        isotp_tx_stream_release(&hello_tx_stream);
+        ESP_LOGD(tag, "event queue error (full?)");
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    hello_tx_streaming = true;
+    if (size == len) {
+        hello_stream_close();
+    }
+    ESP_LOGD(tag, "queued msg stream of %u bytes", (unsigned)size);
+    return 0;
+}
+
+static int hello_stream_more(const uint8_t* buf, uint16_t len) {
+    if (!hello_tx_streaming) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    if (len > hello_tx_stream.size - atomic_load(&hello_tx_stream.filled)) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    if (!isotp_tx_stream_write(&hello_tx_stream, buf, len)) {
+        if (atomic_load(&hello_tx_stream.done)) {
+            ESP_LOGD(tag, "msg stream aborted");
+            hello_stream_close();
+            return BLE_ATT_ERR_UNLIKELY;
+        }
+        ESP_LOGD(tag, "msg stream ahead of the bus");
+        return BLE_ATT_ERR_PREPARE_QUEUE_FULL;
+    }
+    if (atomic_load(&hello_tx_stream.filled) == hello_tx_stream.size) {
+        hello_stream_close();
+    }
+    // a lost wake up only costs the event loop a poll interval
+    struct isotp_event* event = isotp_event_alloc();
+    if (event) {
+        event->type = EVENT_WRITE_STREAM;
+        event->msg.time = esp_timer_get_time();
+        if (xQueueSend(isotp_event_queue_handle, &event, 0) != pdTRUE) {
+            isotp_event_free(event);
+        }
+    }
+    return 0;
+}
 
 static int gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg) {
-    static struct isotp_event event;
+    struct isotp_event* event;
     switch (ctxt->op) {
     case BLE_GATT_ACCESS_OP_READ_CHR:
         if (attr_handle == gatt_svr_chr_hello_val_handle) {
@@ -87,13 +207,47 @@ static int gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle, struct bl
             ESP_LOGD(tag, "no can frames available");
             return BLE_ATT_ERR_UNLIKELY;
         }
+        if (attr_handle == gatt_svr_chr_can_stats_val_handle) {
+            ESP_LOGI(tag, "read can stats characteristic");
+            // the ISO-TP and then the periodic message counters follow, so
+            // readers of the earlier ones alone still work
+            struct omni_libcan_stats stats;
+            omni_libcan_get_stats(&stats);
+            struct omni_libisotp_stats isotp_stats;
+            omni_libisotp_get_stats(&isotp_stats);
+            struct omni_libperiodic_stats periodic_stats;
+            omni_libperiodic_get_stats(-1, &periodic_stats);
+            int rc = os_mbuf_append(ctxt->om, &stats, sizeof(stats));
+            if (rc == 0) {
+                rc = os_mbuf_append(ctxt->om, &isotp_stats, sizeof(isotp_stats));
+            }
+            if (rc == 0) {
+                rc = os_mbuf_append(ctxt->om, &periodic_stats, sizeof(periodic_stats));
+            }
+            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+        }
         if (attr_handle == gatt_svr_chr_isotp_msg_val_handle) {
             ESP_LOGI(tag, "read isotp msg characteristic");
-            static struct isotp_msg message;
+            struct isotp_msg message;
             if (xQueueReceive(isotp_msg_queue_handle, &message, 0) == pdTRUE) {
-                assert(message.size <= 256);
                 ESP_LOGD(tag, "msg read complete");
-                int rc = os_mbuf_append(ctxt->om, message.data, message.size);
+                int rc = 0;
+                if (message.flags & OMNI_LIBISOTP_FRAGMENT) {
+                    uint8_t header[HELLO_FRAGMENT_HEADER] = {
+                        HELLO_FRAGMENT | ((message.flags & OMNI_LIBISOTP_LAST_FRAGMENT) ? HELLO_FRAGMENT_LAST : 0),
+                        message.seq >> 8,
+                        message.seq,
+                        message.offset >> 24,
+                        message.offset >> 16,
+                        message.offset >> 8,
+                        message.offset,
+                    };
+                    rc = os_mbuf_append(ctxt->om, header, sizeof(header));
+                }
+                if (rc == 0) {
+                    rc = os_mbuf_append(ctxt->om, message.data, message.size);
+                }
+                isotp_pool_free(message.data);
                 return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
             }
             ESP_LOGD(tag, "no msgs available");
@@ -109,7 +263,7 @@ static int gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle, struct bl
             uint16_t len;
             if (ble_hs_mbuf_to_flat(ctxt->om, &message, sizeof(message), &len) == 0) {
                 ESP_LOGD(tag, "mbuf_to_flat ok");
-                if (twai_transmit(&message, 0) == ESP_OK) {
+                if (omni_libcan_transmit_bulk(&message, NULL) == ESP_OK) {
                     ESP_LOGD(tag, "can write complete");
                     int rc = os_mbuf_append(ctxt->om, &message, sizeof(message));
                     return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
@@ -126,14 +280,55 @@ static int gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle, struct bl
             uint16_t len;
             if (ble_hs_mbuf_to_flat(ctxt->om, &buf, sizeof(buf), &len) == 0) {
                 ESP_LOGD(tag, "mbuf_to_flat ok");
-                if (len % 12 == 0) {
-                    event.type = EVENT_RECONFIGURE_PAIRS;
-                    event.pairs.size = len;
-                    memcpy(event.pairs.data, buf, len);
+                // 1 + 14 * n and 1 + 15 * n are never multiples of 12, so the
+                // formats can share the characteristic
+                bool v2 = len % ISOTP_PAIRS_V2_RECORD_SIZE == 1 && buf[0] == ISOTP_PAIRS_V2;
+                bool v3 = len % ISOTP_PAIRS_V3_RECORD_SIZE == 1 && buf[0] == ISOTP_PAIRS_V3;
+                // edits of single pairs, which leave the others and their
+                // transfers alone
+                bool edit = len % ISOTP_PAIRS_V3_RECORD_SIZE == 1 && len > 1 && (buf[0] == ISOTP_PAIRS_ADD || buf[0] == ISOTP_PAIRS_REMOVE || buf[0] == ISOTP_PAIRS_UPDATE);
+                if (edit) {
+                    event = isotp_event_alloc();
+                    uint8_t* pairs = isotp_pool_alloc(len - 1);
+                    if (!event || !pairs) {
+                        isotp_event_free(event);
+                        isotp_pool_free(pairs);
+                        ESP_LOGD(tag, "no event or buffer available");
+                        return BLE_ATT_ERR_INSUFFICIENT_RES;
+                    }
+                    memcpy(pairs, buf + 1, len - 1);
+                    event->type = (buf[0] == ISOTP_PAIRS_ADD) ? EVENT_ADD_PAIRS : (buf[0] == ISOTP_PAIRS_REMOVE) ? EVENT_REMOVE_PAIRS : EVENT_UPDATE_PAIRS;
+                    event->pairs.size = len - 1;
+                    event->pairs.data = pairs;
+                    event->pairs.channel = 0;
+                    if (xQueueSend(isotp_event_queue_handle, &event, 0) == pdTRUE) {
+                        ESP_LOGD(tag, "queued pair edit");
+                        return 0;
+                    }
+                    isotp_event_free(event);
+                    isotp_pool_free(pairs);
+                    ESP_LOGD(tag, "event queue error (full?)");
+                    return BLE_ATT_ERR_UNLIKELY;
+                }
+                if (len % ISOTP_PAIRS_RECORD_SIZE == 0 || v2 || v3) {
+                    event = isotp_event_alloc();
+                    uint8_t* pairs = isotp_pool_alloc(len);
+                    if (!event || !pairs) {
+                        isotp_event_free(event);
+                        isotp_pool_free(pairs);
+                        ESP_LOGD(tag, "no event or buffer available");
+                        return BLE_ATT_ERR_INSUFFICIENT_RES;
+                    }
+                    memcpy(pairs, buf, len);
+                    event->type = EVENT_RECONFIGURE_PAIRS;
+                    event->pairs.size = len;
+                    event->pairs.data = pairs;
                     if (xQueueSend(isotp_event_queue_handle, &event, 0) == pdTRUE) {
                         ESP_LOGD(tag, "queued reconfigure pairs");
                         return 0;
                     }
+                    isotp_event_free(event);
+                    isotp_pool_free(pairs);
                     ESP_LOGD(tag, "event queue error (full?)");
                     return BLE_ATT_ERR_UNLIKELY;
                 }
@@ -149,13 +344,19 @@ static int gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle, struct bl
             if (ble_hs_mbuf_to_flat(ctxt->om, &buf, sizeof(buf), &len) == 0) {
                 ESP_LOGD(tag, "mbuf_to_flat ok");
                 if (len == 2) {
-                    event.type = EVENT_RECONFIGURE_BS_STMIN;
-                    event.bs_stmin.data[0] = buf[0];
-                    event.bs_stmin.data[1] = buf[1];
+                    event = isotp_event_alloc();
+                    if (!event) {
+                        ESP_LOGD(tag, "no event available");
+                        return BLE_ATT_ERR_INSUFFICIENT_RES;
+                    }
+                    event->type = EVENT_RECONFIGURE_BS_STMIN;
+                    event->bs_stmin.data[0] = buf[0];
+                    event->bs_stmin.data[1] = buf[1];
                     if (xQueueSend(isotp_event_queue_handle, &event, 0) == pdTRUE) {
                         ESP_LOGD(tag, "queued reconfigure bs/stmin");
                         return 0;
                     }
+                    isotp_event_free(event);
                     ESP_LOGD(tag, "event queue error (full?)");
                     return BLE_ATT_ERR_UNLIKELY;
                 }
@@ -170,14 +371,35 @@ static int gatt_svc_access(uint16_t conn_handle, uint16_t attr_handle, struct bl
             uint16_t len;
             if (ble_hs_mbuf_to_flat(ctxt->om, &buf, sizeof(buf), &len) == 0) {
                 ESP_LOGD(tag, "mbuf_to_flat ok");
+                if (len >= HELLO_STREAM_HEADER + 5 && buf[0] == HELLO_STREAM_START) {
+                    return hello_stream_start(buf + 1, len - 1);
+                }
+                if (len >= 1 && buf[0] == HELLO_STREAM_MORE) {
+                    return hello_stream_more(buf + 1, len - 1);
+                }
                 if (len >= 4) {
-                    event.type = EVENT_WRITE_MSG;
-                    event.msg.size = len;
-                    memcpy(event.msg.data, buf, len);
+                    event = isotp_event_alloc();
+                    if (!event) {
+                        ESP_LOGD(tag, "no event available");
+                        return BLE_ATT_ERR_INSUFFICIENT_RES;
+                    }
+                    event->type = EVENT_WRITE_MSG;
+                    event->msg.size = len;
+                    event->msg.time = esp_timer_get_time();
+                    event->msg.stream = NULL;
+                    event->msg.data = isotp_pool_alloc(len);
+                    if (!event->msg.data) {
+                        isotp_event_free(event);
+                        ESP_LOGD(tag, "no message buffer available");
+                        return BLE_ATT_ERR_INSUFFICIENT_RES;
+                    }
+                    memcpy(event->msg.data, buf, len);
                     if (xQueueSend(isotp_event_queue_handle, &event, 0) == pdTRUE) {
                         ESP_LOGD(tag, "queued msg send");
                         return 0;
                     }
+                    isotp_pool_free(event->msg.data);
+                    isotp_event_free(event);
                     ESP_LOGD(tag, "event queue error (full?)");
                     return BLE_ATT_ERR_UNLIKELY;
                 }
@@ -237,6 +459,12 @@ const struct ble_gatt_svc_def omni_hello_gatt_svr_svcs[] = {
                 .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
                 .val_handle = &gatt_svr_chr_isotp_msg_val_handle,
             },
+            {
+                .uuid = &gatt_svr_chr_can_stats_uuid.u,
+                .access_cb = gatt_svc_access,
+                .flags = BLE_GATT_CHR_F_READ,
+                .val_handle = &gatt_svr_chr_can_stats_val_handle,
+            },
             {
                 0,
             },
@@ -248,22 +476,44 @@ const struct ble_gatt_svc_def omni_hello_gatt_svr_svcs[] = {
 };
 #endif
 
-static void isotp_read_handler(struct isotp_msg* msg) {
+static bool isotp_read_handler(struct isotp_msg* msg) {
+    if (msg->flags & (OMNI_LIBISOTP_TX_DONE | OMNI_LIBISOTP_ABORTED | OMNI_LIBISOTP_WINDOW_END)) {
+        return true;
+    }
+    if (!(msg->flags & OMNI_LIBISOTP_FRAGMENT) && msg->size > 256) {
+        ESP_LOGE(tag, "message too large for the isotp msg characteristic, dropped");
+        return false;
+    }
+    assert(msg->size <= ISOTP_STREAM_CHUNK || !(msg->flags & OMNI_LIBISOTP_FRAGMENT));
+    // the fragment header is put in front when it is read
+    struct isotp_msg ref = *msg;
+    ref.data = isotp_pool_ref(msg->data);
+    assert(ref.data);
     // TODO: remove queues; notify instead
-    xQueueSend(isotp_msg_queue_handle, msg, 0);
+    if (xQueueSend(isotp_msg_queue_handle, &ref, pdMS_TO_TICKS(OMNI_LIBISOTP_HANDLER_WAIT_MS)) != pdTRUE) {
+        isotp_pool_free(ref.data);
+        return false;
+    }
+    return true;
 }
 
-static void isotp_unmatched_handler(struct twai_message_timestamp* msg) {
+static size_t isotp_room(void) {
+    return uxQueueSpacesAvailable(isotp_msg_queue_handle);
+}
+
+static bool isotp_unmatched_handler(struct twai_message_timestamp* msg) {
     // TODO: remove queues; notify instead
-    xQueueSend(isotp_unmatched_frame_queue_handle, msg, 0);
+    // raw frames cannot be held up, so a full queue drops them and gets counted
+    return xQueueSend(isotp_unmatched_frame_queue_handle, msg, 0) == pdTRUE;
 }
 
 void omni_hello_main(void) {
     omni_libisotp_main();
-    omni_libisotp_add_incoming_handler(isotp_read_handler);
-    omni_libisotp_add_unmatched_handler(isotp_unmatched_handler);
     isotp_unmatched_frame_queue_handle = xQueueCreateStatic(4, sizeof(twai_message_t), isotp_unmatched_frame_queue_storage, &isotp_unmatched_frame_queue_buffer);
     isotp_msg_queue_handle = xQueueCreateStatic(4, sizeof(struct isotp_msg), isotp_msg_queue_storage, &isotp_msg_queue_buffer);
+    // pairs configured through the isotp_pairs characteristic use channel 0
+    omni_libisotp_subscribe(isotp_read_handler, 0, isotp_room);
+    omni_libisotp_add_unmatched_handler(isotp_unmatched_handler);
 }
 
 #endif
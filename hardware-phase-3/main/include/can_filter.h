@@ -0,0 +1,58 @@
+#ifndef OMNI_J2534_CAN_FILTER_H_
+#define OMNI_J2534_CAN_FILTER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAN_FILTER_MAX 10
+
+enum can_filter_type {
+    CAN_FILTER_UNUSED = 0,
+    CAN_FILTER_PASS = 1,
+    CAN_FILTER_BLOCK = 2,
+};
+
+/**
+ * A J2534 pass or block filter: a frame matches if its ID and leading data
+ * bytes equal pattern under mask, and it has at least data_len data bytes.
+ */
+struct can_filter {
+    enum can_filter_type type;
+    bool extd;
+    uint32_t id_mask;
+    uint32_t id_pattern;
+    uint8_t data_len;
+    uint8_t data_mask[8];
+    uint8_t data_pattern[8];
+};
+
+struct can_filter_rule {
+    uint32_t id_mask;
+    uint32_t id_pattern; // already masked
+    uint32_t data_mask[2]; // data bytes 0-3 and 4-7, big-endian
+    uint32_t data_pattern[2];
+    uint8_t data_len;
+    bool extd;
+    bool pass;
+};
+
+/**
+ * The filters compiled for matching. 11-bit IDs are looked up in two bitmaps
+ * first: IDs that pass on the ID alone, and IDs that need their data
+ * compared. Those and all 29-bit IDs go through the rules, block filters
+ * first; the first rule that matches decides.
+ */
+struct can_filter_matcher {
+    uint32_t std_pass[0x800 / 32];
+    uint32_t std_check[0x800 / 32];
+    struct can_filter_rule rules[CAN_FILTER_MAX];
+    size_t rule_count;
+};
+
+/** Compiles the filters that are in use, in any order */
+void can_filter_compile(const struct can_filter* filters, size_t count, struct can_filter_matcher* matcher);
+/** Whether a frame passes: no block filter matches it and a pass filter does */
+bool can_filter_match(const struct can_filter_matcher* matcher, uint32_t id, bool extd, uint8_t dlc, const uint8_t* data);
+
+#endif
@@ -1,11 +1,15 @@
 #ifndef OMNI_HELLO_ISOTP_H_
 #define OMNI_HELLO_ISOTP_H_
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define ISOTP_MAX_PAIRS 80
+// reassembly contexts for responders to functional requests, kept in
+// isotp_addr_pairs after the configured pairs and managed by the event loop
+#define ISOTP_MAX_RESPONDERS 8
 
 struct isotp_addr_pairs {
     bool active;
@@ -16,46 +20,200 @@ struct isotp_addr_pairs {
     uint8_t rxext;
     uint8_t rxpad;
     uint32_t channel;
+    uint8_t bs; // block size we ask for in our flow control frames
+    uint8_t stmin; // STmin we ask for, and the least we leave between our own consecutive frames
+    uint8_t flags; // ISOTP_PAIR_*
 };
 
-extern struct isotp_addr_pairs isotp_addr_pairs[ISOTP_MAX_PAIRS];
+// hand received messages over in fragments as they come in, see
+// ISOTP_MSG_FRAGMENT. Their flow control asks for blocks shorter than a
+// fragment, whatever the pair's block size, and a fragment the consumer
+// has no room for aborts the reception.
+#define ISOTP_PAIR_STREAM 0x01
+// fragments are at most this long, the first one is sent right after the first frame
+#define ISOTP_STREAM_CHUNK 256
+// functional (broadcast) requests: single frames to txid, answered by any
+// number of ECUs. For a while after each request every responder that fits
+// rxid gets a reassembly context and flow control of its own, ISO 15765-4
+// style: an 11-bit rxid (0x7E8) takes the eight IDs from there, each answered
+// at the ID 8 below; a 29-bit one (0x18DAF100) takes any source address in
+// its low byte, answered with source and target address swapped. The
+// responses come with the responder's ID in front like any other message,
+// then ISOTP_MSG_WINDOW_END.
+#define ISOTP_PAIR_FUNCTIONAL 0x02
+
+extern struct isotp_addr_pairs isotp_addr_pairs[ISOTP_MAX_PAIRS + ISOTP_MAX_RESPONDERS];
+
+/**
+ * Keep the pair lookup index in sync when pairs are (de)activated outside
+ * EVENT_RECONFIGURE_PAIRS: call after setting active, or after clearing it
+ * (the IDs must still be in place). Only on the event loop's task, lookups
+ * do not lock against them; other tasks send EVENT_ADD_PAIRS and friends.
+ */
+void isotp_pair_added(int index);
+void isotp_pair_removed(int index);
+/** Index of the lowest active pair for an incoming frame or outgoing message, -1 if none */
+int isotp_pair_find_rx(uint32_t id, const uint8_t* data, uint8_t dlc);
+int isotp_pair_find_tx(uint32_t id, const uint8_t* data, size_t size);
 
 enum isotp_event_type {
     EVENT_RECONFIGURE_PAIRS,
+    EVENT_ADD_PAIRS,
+    EVENT_REMOVE_PAIRS,
+    EVENT_UPDATE_PAIRS,
     EVENT_RECONFIGURE_BS_STMIN,
     EVENT_WRITE_MSG,
+    EVENT_WRITE_STREAM, // more of a cut-through message was written, only msg.time is set
     EVENT_INCOMING_CAN,
+    EVENT_TIMER,
     EVENT_SHUTDOWN,
 };
 
+// EVENT_RECONFIGURE_PAIRS takes 12 byte records (txid, txext, txpad, rxid,
+// rxext, rxpad; IDs big endian), ISOTP_PAIRS_V2 followed by 14 byte records
+// that add bs and stmin, or ISOTP_PAIRS_V3 followed by 15 byte records that
+// also add the pair flags. The first get the BS/STmin last set with
+// EVENT_RECONFIGURE_BS_STMIN.
+#define ISOTP_PAIRS_V2 0x02
+#define ISOTP_PAIRS_V3 0x03
+#define ISOTP_PAIRS_RECORD_SIZE 12
+#define ISOTP_PAIRS_V2_RECORD_SIZE 14
+#define ISOTP_PAIRS_V3_RECORD_SIZE 15
+
+// EVENT_ADD_PAIRS, EVENT_REMOVE_PAIRS and EVENT_UPDATE_PAIRS take just 15 byte
+// V3 records and leave every other pair, and the transfers on it, alone. A
+// record names the pair on pairs.channel with the same txid, txext, rxid and
+// rxext (padding aside). Adding a pair that exists updates it; removing one ends
+// its transfers without indications, as does an update that changes
+// ISOTP_PAIR_FUNCTIONAL. On the isotp_pairs characteristic the records follow
+// one of these bytes.
+#define ISOTP_PAIRS_ADD 0x04
+#define ISOTP_PAIRS_REMOVE 0x05
+#define ISOTP_PAIRS_UPDATE 0x06
+
+/**
+ * Cut-through transmit: a message whose first frame goes out before all of it
+ * is there. The producer allocates data for the whole message, writes at
+ * least its first 5 bytes, then queues EVENT_WRITE_MSG with msg.stream set and
+ * follows up with isotp_tx_stream_write() and an EVENT_WRITE_STREAM for each
+ * piece. Producer and event loop each hold a reference; whoever lets go last
+ * frees data.
+ */
+struct isotp_tx_stream {
+    uint8_t* data; // from isotp_pool_alloc()
+    size_t size; // of the whole message, including the address bytes
+    _Atomic size_t filled; // written by the producer
+    _Atomic size_t sent; // consumed by the event loop
+    _Atomic bool done; // sent or aborted, no point writing more
+    _Atomic int refs;
+};
+
+// how far the producer may get ahead of the bus; while the receiver holds the
+// transfer up with flow control the producer is held up as well
+#define ISOTP_TX_STREAM_WINDOW 512
+
+/** Starts a stream over data holding size bytes, with references for the producer and the event loop */
+void isotp_tx_stream_init(struct isotp_tx_stream* stream, uint8_t* data, size_t size);
+/**
+ * Appends all of data, or nothing if that would overrun the message or the
+ * window, or the transfer is done. Only the producer may call it.
+ */
+bool isotp_tx_stream_write(struct isotp_tx_stream* stream, const uint8_t* data, size_t size);
+/** Drops a reference, freeing the buffer with the last one; returns true if that was it */
+bool isotp_tx_stream_release(struct isotp_tx_stream* stream);
+
 struct isotp_event {
     enum isotp_event_type type;
     union {
         struct {
             size_t size;
-            uint8_t data[252];
+            uint8_t* data; // from isotp_pool_alloc(), the event loop frees it
+            uint32_t channel; // pairs edited with EVENT_ADD_PAIRS and friends; 0 for the isotp_pairs characteristic
         } pairs;
         struct {
-            uint8_t data[2];
+            uint8_t data[2]; // bs, stmin: for every pair on channel 0
         } bs_stmin;
         struct {
             size_t size;
-            uint8_t data[256];
+            uint8_t* data; // from isotp_pool_alloc(), the event loop frees it
+            int64_t time; // µs, monotonic; when it was queued
+            struct isotp_tx_stream* stream; // cut-through, data is stream->data; NULL otherwise
         } msg;
         struct {
-            uint32_t id;
+            uint32_t id; // bit 31 set for extended IDs
             uint8_t dlc;
             uint8_t data[8];
-            uint8_t frame[72]; // big enough to hold a CAN-FD frame on Linux
+            int64_t time; // µs, monotonic
         } can;
+        struct {
+            int64_t time; // µs, monotonic; when the timer fired
+        } timer;
     };
 };
 
-typedef void isotp_event_cb(struct isotp_event*);
-typedef void isotp_unmatched_frame(const uint8_t* frame);
-typedef void isotp_write_frame(uint32_t id, uint8_t dlc, const uint8_t* data);
-typedef void isotp_read_message_cb(const uint8_t* data, size_t size, uint32_t channel);
+// events come from a fixed pool and are queued by pointer, so a queue this
+// deep never fills
+#define ISOTP_EVENT_POOL_COUNT 32
+
+/** Safe to call from any task; returns NULL if every event is taken */
+struct isotp_event* isotp_event_alloc(void);
+void isotp_event_free(struct isotp_event* evt);
+
+// same values as the J2534 RxStatus bits
+#define ISOTP_MSG_TX 0x01
+#define ISOTP_MSG_TX_DONE 0x08
+// manufacturer specific: a transfer timed out or was cut short, data is just its address
+#define ISOTP_MSG_ABORTED 0x01000000
+// manufacturer specific: part of a message on an ISOTP_PAIR_STREAM pair; data
+// is the address bytes followed by the part starting at offset
+#define ISOTP_MSG_FRAGMENT 0x02000000
+#define ISOTP_MSG_LAST_FRAGMENT 0x04000000
+// manufacturer specific: no more responses to the functional request to data, its address
+#define ISOTP_MSG_WINDOW_END 0x08000000
+
+struct isotp_msg_info {
+    uint32_t channel;
+    uint32_t flags; // ISOTP_MSG_*
+    int64_t time; // µs, monotonic; last frame received, or last frame sent for TX_DONE
+    // fragments only, offsets do not count the address bytes
+    uint32_t seq; // counts up from 0 within the message
+    size_t offset;
+    size_t total;
+};
+
+/** Waits for the next event, from isotp_event_alloc(); the event loop frees it */
+typedef struct isotp_event* isotp_event_cb(void);
+/** A received frame no pair takes, as in an EVENT_INCOMING_CAN */
+typedef void isotp_unmatched_frame(uint32_t id, uint8_t dlc, const uint8_t* data, int64_t time);
+/** Returns when the frame is done on the bus (or a fair estimate of it), or -1 if it was not sent */
+typedef int64_t isotp_write_frame(uint32_t id, uint8_t dlc, const uint8_t* data);
+/**
+ * Returns false if the consumer had no room for it and it was dropped. Messages
+ * and fragments come in pool blocks that are never written again, so the
+ * consumer may keep them with isotp_pool_ref() instead of copying; the data of
+ * indications (TX_DONE, ABORTED, WINDOW_END) is only valid during the call.
+ */
+typedef bool isotp_read_message_cb(const uint8_t* data, size_t size, const struct isotp_msg_info* info);
+/**
+ * How many more messages read_message_cb could take right now for channel,
+ * all the way to whoever consumes them. Receptions are held up with FC.WAIT
+ * while that is not enough for all of them.
+ */
+typedef size_t isotp_rx_room(uint32_t channel);
+/** Asks for an EVENT_TIMER at or after deadline (µs), replacing any earlier request */
+typedef void isotp_set_timer(int64_t deadline);
+
+void isotp_event_loop(isotp_event_cb* get_next_event, isotp_unmatched_frame* unmatched_frame, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb, isotp_rx_room* rx_room, isotp_set_timer* set_timer);
+
+struct isotp_stats {
+    uint32_t fc_wait; // FC.WAIT sent while the consumer had no room
+    uint32_t fc_overflow; // FC.OVFLW sent: no buffer, too long, or the consumer stayed full
+    uint32_t msg_dropped; // messages and indications read_message_cb could not take, responses to functional requests with no responder slot left
+    uint32_t tx_dropped; // messages written while every TX slot was taken
+    uint32_t pair_rejected; // records to add with every pair taken, or to remove or update a pair that is not there
+};
 
-void isotp_event_loop(isotp_event_cb* get_next_event, isotp_unmatched_frame* unmatched_frame, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb);
+/** Counters since boot; safe to call from any task */
+void isotp_get_stats(struct isotp_stats* stats);
 
 #endif
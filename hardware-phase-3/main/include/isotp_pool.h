@@ -0,0 +1,27 @@
+#ifndef OMNI_HELLO_ISOTP_POOL_H_
+#define OMNI_HELLO_ISOTP_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// largest message: 4 ID bytes, the extended address and 4095 bytes of data
+#define ISOTP_MAX_MSG_SIZE 4100
+
+// at most 32 blocks per class
+#define ISOTP_POOL_SMALL_SIZE 256
+#define ISOTP_POOL_SMALL_COUNT 16
+#define ISOTP_POOL_LARGE_SIZE ISOTP_MAX_MSG_SIZE
+#define ISOTP_POOL_LARGE_COUNT 4
+
+/**
+ * Fixed-block pool for message buffers. Safe to use from any task; returns
+ * NULL if the size is too large or no block is free. Blocks are reference
+ * counted, starting at one; isotp_pool_free() drops a reference and frees
+ * the block with the last.
+ */
+uint8_t* isotp_pool_alloc(size_t size);
+void isotp_pool_free(uint8_t* block);
+/** Takes another reference; returns block, or NULL if it is not from the pool */
+uint8_t* isotp_pool_ref(const uint8_t* block);
+
+#endif
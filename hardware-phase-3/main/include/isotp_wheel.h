@@ -0,0 +1,43 @@
+#ifndef OMNI_HELLO_ISOTP_WHEEL_H_
+#define OMNI_HELLO_ISOTP_WHEEL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// 64 slots of ~16 ms: a timer fires up to one slot late
+#define ISOTP_WHEEL_SLOTS 64
+#define ISOTP_WHEEL_SHIFT 14
+
+struct isotp_wheel_timer {
+    struct isotp_wheel_timer* next;
+    struct isotp_wheel_timer** pprev; // NULL while not armed
+    int64_t expires;
+    int owner; // free for the user to tell timers apart
+    uint8_t slot;
+};
+
+/**
+ * Hashed timer wheel for timeouts. Timers are embedded in their owners, so
+ * arming and cancelling never allocate. Not thread safe.
+ */
+struct isotp_wheel {
+    struct isotp_wheel_timer* slots[ISOTP_WHEEL_SLOTS];
+    uint64_t occupied;
+    int64_t tick; // last tick that was fully expired
+};
+
+void isotp_wheel_init(struct isotp_wheel* wheel, int64_t now);
+/** (Re)arms the timer to expire at or after expires (µs) */
+void isotp_wheel_arm(struct isotp_wheel* wheel, struct isotp_wheel_timer* timer, int64_t expires);
+void isotp_wheel_cancel(struct isotp_wheel* wheel, struct isotp_wheel_timer* timer);
+/** Removes and returns one timer that expired by now, NULL once there are none */
+struct isotp_wheel_timer* isotp_wheel_expire(struct isotp_wheel* wheel, int64_t now);
+/** When isotp_wheel_expire() may have something to return next, INT64_MAX if nothing is armed */
+int64_t isotp_wheel_next(const struct isotp_wheel* wheel);
+
+static inline bool isotp_wheel_armed(const struct isotp_wheel_timer* timer) {
+    return timer->pprev != NULL;
+}
+
+#endif
@@ -2,18 +2,70 @@
 #define OMNITRIX_LIBCAN_H_
 
 #include <driver/twai.h>
-#include <sys/time.h>
+#include <stdint.h>
 
 struct twai_message_timestamp {
     twai_message_t msg;
-    struct timeval time;
+    int64_t time; // µs since boot (esp_timer_get_time), taken when the driver handed the frame over
+};
+
+struct omni_libcan_stats {
+    uint32_t hw_accepted; // frames the hardware acceptance filter let through
+    uint32_t sw_rejected; // of those, false positives dropped by the software filter
+    uint32_t ring_overruns; // frames dropped because the dispatcher fell behind
+    uint32_t rx_missed; // frames lost by the driver or controller (RX queue full, FIFO overrun)
+    uint32_t hw_reinstalls; // hardware filter changes
+    uint32_t hw_filter_code;
+    uint32_t hw_filter_mask;
+    uint32_t hw_filter_single;
 };
 
 typedef void omni_libcan_incoming_handler(struct twai_message_timestamp* msg);
 
 void omni_libcan_main(void);
+/**
+ * Registers a handler for received frames whose ID matches id under mask
+ * (for extended frames, bit 31 of the ID is set). Handlers run on the CAN
+ * dispatcher task and get the frame in place; they must not keep the
+ * pointer.
+ */
+bool omni_libcan_subscribe(omni_libcan_incoming_handler* handler, uint32_t id, uint32_t mask, bool extd);
+void omni_libcan_unsubscribe(omni_libcan_incoming_handler* handler);
+/** Registers a handler for every frame that passes the acceptance filter */
 void omni_libcan_add_incoming_handler(omni_libcan_incoming_handler* handler);
-void omni_libcan_add_filter(uint32_t id, bool extd);
+/**
+ * Software acceptance filter. Frames are only handed to the incoming
+ * handlers if their ID was registered, either exactly, under a mask or
+ * within a range. Registrations are reference counted; every add must be
+ * paired with a remove of the same arguments.
+ */
+bool omni_libcan_add_filter(uint32_t id, bool extd);
+void omni_libcan_remove_filter(uint32_t id, bool extd);
+bool omni_libcan_add_filter_mask(uint32_t id, uint32_t mask, bool extd);
+void omni_libcan_remove_filter_mask(uint32_t id, uint32_t mask, bool extd);
+bool omni_libcan_add_filter_range(uint32_t first, uint32_t last, bool extd);
+void omni_libcan_remove_filter_range(uint32_t first, uint32_t last, bool extd);
 void omni_libcan_clear_filter(void);
+/**
+ * The hardware acceptance filter follows the registrations a little later,
+ * on the CAN reader task. Waits until it lets the IDs matching id under mask
+ * through; false if that took longer than timeout.
+ */
+bool omni_libcan_filter_wait(uint32_t id, uint32_t mask, bool extd, TickType_t timeout);
+void omni_libcan_get_stats(struct omni_libcan_stats* stats);
+/**
+ * twai_transmit() that is safe while the driver is reinstalled for a new
+ * hardware filter: it fails with ESP_ERR_INVALID_STATE meanwhile, or keeps
+ * trying for up to ticks. Never call twai_transmit() directly.
+ */
+esp_err_t omni_libcan_transmit(const twai_message_t* msg, TickType_t ticks);
+/**
+ * omni_libcan_transmit() without waiting, for anything but periodic messages:
+ * fails with ESP_ERR_TIMEOUT while the bulk share of the TX queue is taken.
+ * If ahead is not NULL, it gets how many frames were queued before this one.
+ */
+esp_err_t omni_libcan_transmit_bulk(const twai_message_t* msg, uint32_t* ahead);
+/** Longest a data frame can take on the bus at the configured bit rate, stuff bits and interframe space included, in µs */
+uint32_t omni_libcan_frame_time_us(uint8_t dlc, bool extd);
 
 #endif
@@ -3,24 +3,76 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include <omnitrix/libcan.h>
 
+#define OMNI_LIBISOTP_TX 0x01 // J2534 TX_MSG_TYPE: the message was one of ours
+#define OMNI_LIBISOTP_TX_DONE 0x08 // J2534 TX_INDICATION: data is just the address of a sent message
+#define OMNI_LIBISOTP_ABORTED 0x01000000 // a transfer timed out or was aborted, data is just its address
+#define OMNI_LIBISOTP_FRAGMENT 0x02000000 // part of a message on a streaming pair: its address, then the part at offset
+#define OMNI_LIBISOTP_LAST_FRAGMENT 0x04000000
+#define OMNI_LIBISOTP_WINDOW_END 0x08000000 // the responses to a functional request are in, data is just its address
+
 struct isotp_msg {
     uint32_t channel;
+    uint32_t flags; // OMNI_LIBISOTP_*
+    int64_t time; // µs since boot (esp_timer_get_time)
     size_t size;
-    uint8_t data[256];
+    uint8_t* data; // pool block, only valid while the handler runs unless it takes a reference with isotp_pool_ref()
+    // fragments only, offsets do not count the address bytes
+    uint32_t seq; // counts up from 0 within the message
+    size_t offset;
+    size_t total;
 };
 
-typedef void omni_libisotp_incoming_handler(struct isotp_msg* msg);
-typedef void omni_libisotp_unmatched_handler(struct twai_message_timestamp* msg);
+#define OMNI_LIBISOTP_ANY_CHANNEL 0xFFFFFFFF
+
+struct omni_libisotp_stats {
+    uint32_t fc_wait; // FC.WAIT sent while the dispatcher was behind
+    uint32_t fc_overflow; // FC.OVFLW sent: no buffer, too long, or the dispatcher stayed behind
+    uint32_t msg_dropped; // messages and indications with no room to dispatch them
+    uint32_t tx_dropped; // messages written while every TX slot was taken
+    uint32_t frames_dropped; // received frames with no room in the event queue
+    uint32_t unmatched_dropped; // frames for no pair with no room to dispatch them
+    uint32_t msg_handler_dropped; // messages a subscriber had no room for
+    uint32_t unmatched_handler_dropped; // frames a subscriber had no room for
+    uint32_t pair_rejected; // pair edits with no free pair, or for a pair that is not there
+};
+
+// How long a handler may block on a full queue of its own before it drops.
+// Handlers with a room callback should not find it full, as receptions for
+// them are held with FC.WAIT before that.
+#define OMNI_LIBISOTP_HANDLER_WAIT_MS 50
+
+/** Handlers return false if they had to drop the message or frame */
+typedef bool omni_libisotp_incoming_handler(struct isotp_msg* msg);
+/** How many more messages a handler could take without blocking */
+typedef size_t omni_libisotp_room(void);
+typedef bool omni_libisotp_unmatched_handler(struct twai_message_timestamp* msg);
 
+// queues struct isotp_event* from isotp_event_alloc(), the ISO-TP task frees them
 extern QueueHandle_t isotp_event_queue_handle;
 
 void omni_libisotp_main(void);
+/**
+ * Registers a handler for reassembled messages on one channel, or on every
+ * channel with OMNI_LIBISOTP_ANY_CHANNEL. Handlers run on the ISO-TP
+ * dispatch task. Receptions on the channel are held with FC.WAIT while room,
+ * unless NULL, says the handler is full.
+ */
+bool omni_libisotp_subscribe(omni_libisotp_incoming_handler* handler, uint32_t channel, omni_libisotp_room* room);
+void omni_libisotp_unsubscribe(omni_libisotp_incoming_handler* handler, uint32_t channel);
 void omni_libisotp_add_incoming_handler(omni_libisotp_incoming_handler* handler);
+/**
+ * Registers a handler for frames that did not belong to any ISO-TP pair and
+ * whose ID matches id under mask (bit 31 marks extended IDs).
+ */
+bool omni_libisotp_subscribe_unmatched(omni_libisotp_unmatched_handler* handler, uint32_t id, uint32_t mask, bool extd);
+void omni_libisotp_unsubscribe_unmatched(omni_libisotp_unmatched_handler* handler);
 void omni_libisotp_add_unmatched_handler(omni_libisotp_unmatched_handler* handler);
+void omni_libisotp_get_stats(struct omni_libisotp_stats* stats);
 
 #endif
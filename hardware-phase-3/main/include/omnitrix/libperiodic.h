@@ -0,0 +1,36 @@
+#ifndef OMNITRIX_LIBPERIODIC_H_
+#define OMNITRIX_LIBPERIODIC_H_
+
+#include <driver/twai.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OMNI_LIBPERIODIC_MAX 32
+
+// Lateness is measured from when a frame was due to when the driver took
+// it; how long it then waits in the TX queue is up to the bus.
+struct omni_libperiodic_stats {
+    uint32_t sent;
+    uint32_t dropped; // due while the TX queue was full
+    uint32_t skipped; // periods that passed without a turn
+    uint32_t late_max_us;
+    uint32_t late_avg_us;
+};
+
+void omni_libperiodic_main(void);
+/**
+ * Sends frame every interval_us, the first time right away. Returns the
+ * message ID, or -1 if all OMNI_LIBPERIODIC_MAX are taken.
+ */
+int omni_libperiodic_start(const twai_message_t* frame, uint32_t interval_us);
+/**
+ * Replaces a running message's frame and interval. The next frame is due one
+ * new interval after the last one was, so the change neither doubles nor
+ * skips a frame.
+ */
+bool omni_libperiodic_update(int id, const twai_message_t* frame, uint32_t interval_us);
+void omni_libperiodic_stop(int id);
+/** For one running message, or over every message since boot with id -1 */
+bool omni_libperiodic_get_stats(int id, struct omni_libperiodic_stats* stats);
+
+#endif
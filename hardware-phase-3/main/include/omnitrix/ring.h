@@ -0,0 +1,83 @@
+#ifndef OMNITRIX_RING_H_
+#define OMNITRIX_RING_H_
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Lock-free single-producer/single-consumer ring.
+ *
+ * Slots are filled and consumed in place: the producer acquires a slot,
+ * writes into it and publishes it; the consumer peeks a batch of slots,
+ * reads them by pointer and releases the whole batch at once. The capacity
+ * must be a power of two.
+ */
+struct omni_ring {
+    uint8_t* storage;
+    size_t elem_size;
+    uint32_t mask;
+    _Atomic uint32_t head; // only written by the producer
+    _Atomic uint32_t tail; // only written by the consumer
+};
+
+#define OMNI_RING_INIT(array)                                      \
+    {                                                              \
+        .storage = (uint8_t*)(array),                              \
+        .elem_size = sizeof((array)[0]),                           \
+        .mask = (sizeof(array) / sizeof((array)[0])) - 1,          \
+        .head = 0,                                                 \
+        .tail = 0,                                                 \
+    }
+
+/** Producer: returns the next free slot, or NULL if the ring is full */
+static inline void* omni_ring_acquire(struct omni_ring* ring) {
+    assert(ring);
+    assert((ring->mask & (ring->mask + 1)) == 0);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail > ring->mask) {
+        return NULL;
+    }
+    return ring->storage + (size_t)(head & ring->mask) * ring->elem_size;
+}
+
+/**
+ * Producer: makes the slot returned by omni_ring_acquire visible to the
+ * consumer. Returns true if the ring was empty before, i.e. the consumer may
+ * be sleeping and needs a wake-up.
+ */
+static inline bool omni_ring_publish(struct omni_ring* ring) {
+    assert(ring);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return head == tail;
+}
+
+/** Consumer: number of published slots available, capped at max */
+static inline size_t omni_ring_peek(struct omni_ring* ring, size_t max) {
+    assert(ring);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t count = head - tail;
+    return (count < max) ? count : max;
+}
+
+/** Consumer: the i-th available slot, i < omni_ring_peek() */
+static inline void* omni_ring_at(struct omni_ring* ring, size_t i) {
+    assert(ring);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    return ring->storage + (size_t)((tail + i) & ring->mask) * ring->elem_size;
+}
+
+/** Consumer: hands the first n available slots back to the producer */
+static inline void omni_ring_release(struct omni_ring* ring, size_t n) {
+    assert(ring);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + (uint32_t)n, memory_order_release);
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -7,19 +8,34 @@
 #include <omnitrix/libcan.h>
 
 #include "isotp.h"
+#include "isotp_pool.h"
+#include "isotp_wheel.h"
 
 #define CAN_DEBUG 1
 #define BLE_DEBUG 1
 
-struct isotp_addr_pairs isotp_addr_pairs[ISOTP_MAX_PAIRS] = { 0 };
+// configured pairs, then the responders to functional requests
+#define ISOTP_PAIR_SLOTS (ISOTP_MAX_PAIRS + ISOTP_MAX_RESPONDERS)
+
+struct isotp_addr_pairs isotp_addr_pairs[ISOTP_PAIR_SLOTS] = { 0 };
 
 static struct {
     struct {
-        uint8_t buf[256];
-        int offset;
-        int size;
+        uint8_t* buf; // from the pool while a message is being reassembled
+        size_t offset;
+        size_t size;
         uint8_t ctr;
-    } pairs[ISOTP_MAX_PAIRS];
+        uint8_t bs_count; // consecutive frames since our last flow control
+        bool stream; // buf only holds the address and what came in since the last fragment
+        size_t chunk; // offset in the message of what follows the address in buf
+        uint32_t seq; // next fragment
+        struct isotp_wheel_timer timer; // N_Cr, the next FC.WAIT while held, or the end of a functional pair's window
+        bool held; // answered with FC.WAIT, waiting for the consumer
+        bool ff_pending; // the first frame has not been answered with CTS yet
+        uint8_t wft; // FC.WAIT sent in a row
+        uint8_t functional; // responders: the functional pair they answer
+    } pairs[ISOTP_PAIR_SLOTS];
+    // for pairs configured without their own
     uint8_t bs;
     uint8_t stmin;
 #ifdef CAN_DEBUG
@@ -30,6 +46,86 @@ static struct {
 #endif
 } isotp_addr_pairs_extra = { 0 };
 
+// open addressing index from (masked CAN ID, extended address) to pair, one
+// for each direction. Entries are only hints, lookups check the pair itself,
+// so removals just leave a tombstone behind. Probes only stop at empty
+// entries, so the event loop rebuilds the index once tombstones take up
+// PAIR_INDEX_TOMBSTONE_MAX entries; responders come and go with every
+// functional request.
+#define PAIR_INDEX_SIZE 256
+#define PAIR_INDEX_EMPTY 0
+#define PAIR_INDEX_DELETED 0xFF
+#define PAIR_INDEX_TOMBSTONE_MAX (PAIR_INDEX_SIZE / 4)
+
+// entries are pair number + 1
+_Static_assert(ISOTP_PAIR_SLOTS < PAIR_INDEX_DELETED, "pair numbers must fit an index entry");
+
+static uint8_t rx_index[PAIR_INDEX_SIZE];
+static uint8_t tx_index[PAIR_INDEX_SIZE];
+static int pair_index_count = 0;
+static int pair_index_tombstones = 0; // in both tables together
+
+// transfers that do not fit a single frame, or that wait for another
+// transfer on the same pair, are sent from here by the event loop
+#define ISOTP_MAX_TX 8
+// ISO 15765-2 timeouts. N_As: a frame must get onto the bus (here: into the
+// driver's TX queue), N_Bs: the flow control must arrive, N_Cr: the next
+// consecutive frame must arrive.
+#define ISOTP_N_AS_US 1000000
+#define ISOTP_N_BS_US 1000000
+#define ISOTP_N_CR_US 1000000
+// while the consumer has no room for another message, a reception is held up
+// with FC.WAIT, repeated well within the sender's N_Bs, up to N_WFTmax times
+#define ISOTP_WAIT_US 250000
+#define ISOTP_WFT_MAX 8
+// how long to back off when the CAN TX queue is full
+#define ISOTP_TX_RETRY_US 1000
+// rounds of one frame per transfer before other events get a turn
+#define ISOTP_TX_BURST 4
+// how long a cut-through transfer waits for its producer before it is
+// aborted; the receiver would give up after N_Cr anyway
+#define ISOTP_TX_STREAM_STALL_US 1000000
+// how long after a functional request responses may start: P2CAN of
+// ISO 15765-4. Those that started go on for as long as they take.
+#define ISOTP_FUNCTIONAL_WINDOW_US 50000
+
+enum isotp_tx_state {
+    TX_IDLE,
+    TX_QUEUED, // waiting for an earlier transfer on the same pair
+    TX_FIRST_FRAME,
+    TX_WAIT_FC,
+    TX_CONSECUTIVE,
+};
+
+static struct {
+    struct {
+        enum isotp_tx_state state;
+        int index;
+        uint32_t seq;
+        int64_t deadline; // when the next frame is due, INT64_MAX while waiting for flow control
+        struct isotp_wheel_timer timer; // N_As, N_Bs or a stalled stream
+        uint8_t* buf; // from the pool, owned by the slot unless it is stream->data
+        struct isotp_tx_stream* stream; // cut-through, or NULL
+        bool starved; // the next frame of the stream has not been written yet
+        size_t offset;
+        size_t size;
+        uint8_t sn;
+        uint8_t bs;
+        uint8_t bs_count;
+        uint8_t stmin;
+    } slots[ISOTP_MAX_TX];
+    uint32_t seq;
+    int first; // slot served first in the next round
+    int64_t now; // latest time seen in an event or returned by write_frame
+    int64_t timer; // deadline the timer is armed for, INT64_MAX if none
+} isotp_tx = { .timer = INT64_MAX };
+
+// timeouts of all transfers; RX timers are owned by their pair number, TX
+// timers by ISOTP_PAIR_SLOTS + slot
+static struct isotp_wheel isotp_wheel;
+
+static struct isotp_stats isotp_stats = { 0 };
+
 #ifdef CAN_DEBUG
 
 #define debug_frame_log(write_frame, msg)                     \
@@ -96,14 +192,15 @@ static void debug_msg_log_n(isotp_read_message_cb* read_message_cb, const char*
     assert(size);
 
     uint8_t buf[256] = { 0xFF, 0xFF, 0xFF, 0xFE, 0x02 };
+    struct isotp_msg_info info = { 0 };
 
     for (; size > 251; size -= 251, msg += 251) {
         memcpy(buf + 5, msg, 251);
-        read_message_cb(buf, 256, 0);
+        read_message_cb(buf, 256, &info);
     }
     if (size) {
         memcpy(buf + 5, msg, size);
-        read_message_cb(buf, size + 5, 0);
+        read_message_cb(buf, size + 5, &info);
     }
 }
 
@@ -112,23 +209,24 @@ static void debug_msg(struct isotp_event* evt, isotp_read_message_cb* read_messa
     assert(read_message_cb);
     assert(evt->type == EVENT_WRITE_MSG);
 
+    struct isotp_msg_info info = { 0 };
     if (evt->msg.size > 3) {
         evt->msg.data[3] -= 1;
         if (evt->msg.size > 4) {
             switch (evt->msg.data[4]) {
             case 0:
                 isotp_addr_pairs_extra.ble_debug = false;
-                read_message_cb(evt->msg.data, 5, 0);
+                read_message_cb(evt->msg.data, 5, &info);
                 return;
             case 1:
                 isotp_addr_pairs_extra.ble_debug = true;
-                read_message_cb(evt->msg.data, 5, 0);
+                read_message_cb(evt->msg.data, 5, &info);
                 return;
             default:
                 break;
             }
             evt->msg.data[4] = 0xFF;
-            read_message_cb(evt->msg.data, 5, 0);
+            read_message_cb(evt->msg.data, 5, &info);
         }
     }
 }
@@ -139,40 +237,455 @@ static void debug_msg(struct isotp_event* evt, isotp_read_message_cb* read_messa
 
 #endif
 
-static void handle_write_msg(struct isotp_event* evt, int index, isotp_write_frame* write_frame) {
-    assert(evt);
-    assert(index >= 0 && index < ISOTP_MAX_PAIRS);
+// hands a message or an indication over, counting those the consumer could not take
+static void deliver(const uint8_t* data, size_t size, const struct isotp_msg_info* info, isotp_read_message_cb* read_message_cb) {
+    if (!read_message_cb(data, size, info)) {
+        isotp_stats.msg_dropped++;
+    }
+}
 
-    int pad_sz = 0, msg_start = 4, sf_max = 11;
+static void indicate(int index, const uint8_t* addr, bool tx, uint32_t flags, int64_t time, isotp_read_message_cb* read_message_cb) {
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+    assert(addr);
+    assert(read_message_cb);
+
+    struct isotp_msg_info info = {
+        .channel = isotp_addr_pairs[index].channel,
+        .flags = flags,
+        .time = time,
+    };
+    uint32_t id = tx ? isotp_addr_pairs[index].txid : isotp_addr_pairs[index].rxid;
+    deliver(addr, (id & 0x40000000) ? 5 : 4, &info, read_message_cb);
+}
+
+// J2534 style TxDone indication; a functional request opens (or extends)
+// the window for its responses
+static void tx_done(int index, const uint8_t* addr, int64_t time, isotp_read_message_cb* read_message_cb) {
+    if (time >= 0) {
+        indicate(index, addr, true, ISOTP_MSG_TX_DONE, time, read_message_cb);
+        if (isotp_addr_pairs[index].flags & ISOTP_PAIR_FUNCTIONAL) {
+            isotp_wheel_arm(&isotp_wheel, &isotp_addr_pairs_extra.pairs[index].timer, time + ISOTP_FUNCTIONAL_WINDOW_US);
+        }
+    }
+}
+
+// sends one frame of a message: the addressing byte, the PCI bytes, as much
+// of the message as fits and optional padding
+static int64_t tx_write(int index, const uint8_t* data, size_t size, size_t* offset, const uint8_t* pci, int pci_sz, isotp_write_frame* write_frame) {
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+    assert(data);
+    assert(offset);
+    assert(pci);
+    assert(write_frame);
+
+    uint8_t frame[8];
+    int len = 0;
     if (isotp_addr_pairs[index].txid & 0x40000000) {
-        pad_sz++;
-        msg_start++;
-        sf_max++;
-    }
-    if (evt->msg.size <= sf_max) {
-        // single frame
-        uint8_t dlc = evt->msg.size - 3;
-        if (isotp_addr_pairs[index].txid & 0x20000000) {
-            dlc = 8;
-            for (int i = evt->msg.size; i < sf_max; i++) {
-                evt->msg.data[i] = isotp_addr_pairs[index].txpad;
+        frame[len++] = isotp_addr_pairs[index].txext;
+    }
+    memcpy(frame + len, pci, pci_sz);
+    len += pci_sz;
+    int n = (size - *offset < (size_t)(8 - len)) ? (int)(size - *offset) : 8 - len;
+    memcpy(frame + len, data + *offset, n);
+    len += n;
+    if (isotp_addr_pairs[index].txid & 0x20000000) {
+        memset(frame + len, isotp_addr_pairs[index].txpad, 8 - len);
+        len = 8;
+    }
+    int64_t time = write_frame(isotp_addr_pairs[index].txid & 0x9FFFFFFF, len, frame);
+    if (time >= 0) {
+        *offset += n;
+        if (time > isotp_tx.now) {
+            isotp_tx.now = time;
+        }
+    }
+    return time;
+}
+
+void isotp_tx_stream_init(struct isotp_tx_stream* stream, uint8_t* data, size_t size) {
+    assert(stream);
+    assert(data);
+
+    stream->data = data;
+    stream->size = size;
+    atomic_init(&stream->filled, 0);
+    atomic_init(&stream->sent, 0);
+    atomic_init(&stream->done, false);
+    atomic_init(&stream->refs, 2);
+}
+
+bool isotp_tx_stream_write(struct isotp_tx_stream* stream, const uint8_t* data, size_t size) {
+    assert(stream);
+    assert(data || !size);
+
+    if (atomic_load(&stream->done)) {
+        return false;
+    }
+    // only the producer moves filled, the event loop only ever moves sent up
+    size_t filled = atomic_load_explicit(&stream->filled, memory_order_relaxed);
+    size_t sent = atomic_load_explicit(&stream->sent, memory_order_relaxed);
+    if (size > stream->size - filled || filled + size > sent + ISOTP_TX_STREAM_WINDOW) {
+        return false;
+    }
+    memcpy(stream->data + filled, data, size);
+    atomic_store_explicit(&stream->filled, filled + size, memory_order_release);
+    return true;
+}
+
+bool isotp_tx_stream_release(struct isotp_tx_stream* stream) {
+    assert(stream);
+
+    // the producer may reuse the stream as soon as refs drops to 0
+    uint8_t* data = stream->data;
+    int refs = atomic_fetch_sub(&stream->refs, 1);
+    assert(refs > 0);
+    if (refs > 1) {
+        return false;
+    }
+    isotp_pool_free(data);
+    return true;
+}
+
+_Static_assert(ISOTP_EVENT_POOL_COUNT <= 32, "free events are tracked in a 32-bit mask");
+
+static struct isotp_event isotp_events[ISOTP_EVENT_POOL_COUNT];
+// set bits are free events
+static _Atomic uint32_t isotp_events_free = (uint32_t)((1ULL << ISOTP_EVENT_POOL_COUNT) - 1);
+
+struct isotp_event* isotp_event_alloc(void) {
+    uint32_t mask = atomic_load(&isotp_events_free);
+    while (mask) {
+        int bit = __builtin_ctz(mask);
+        if (atomic_compare_exchange_weak(&isotp_events_free, &mask, mask & ~(1u << bit))) {
+            return &isotp_events[bit];
+        }
+    }
+    return NULL;
+}
+
+void isotp_event_free(struct isotp_event* evt) {
+    if (!evt) {
+        return;
+    }
+    size_t i = evt - isotp_events;
+    assert(i < ISOTP_EVENT_POOL_COUNT);
+    uint32_t old = atomic_fetch_or(&isotp_events_free, 1u << i);
+    assert(!(old & (1u << i)));
+    (void)old;
+}
+
+// whether the next frame of a cut-through transfer still waits for its data
+static bool tx_starved(int slot) {
+    struct isotp_tx_stream* stream = isotp_tx.slots[slot].stream;
+    if (!stream) {
+        return false;
+    }
+    // as much as the next frame carries: the message if it fits a single
+    // frame, after the addressing byte and the PCI otherwise
+    bool ext = isotp_addr_pairs[isotp_tx.slots[slot].index].txid & 0x40000000;
+    size_t room = ext ? 7 : 8;
+    if (isotp_tx.slots[slot].state == TX_CONSECUTIVE) {
+        room -= 1;
+    } else if (stream->size <= 11) {
+        room = stream->size;
+    } else {
+        room -= (stream->size - (ext ? 5 : 4) > 0xFFF) ? 6 : 2;
+    }
+    size_t want = isotp_tx.slots[slot].offset + room;
+    if (want > stream->size) {
+        want = stream->size;
+    }
+    return atomic_load_explicit(&stream->filled, memory_order_acquire) < want;
+}
+
+static void tx_sent(int slot) {
+    if (isotp_tx.slots[slot].stream) {
+        atomic_store_explicit(&isotp_tx.slots[slot].stream->sent, isotp_tx.slots[slot].offset, memory_order_relaxed);
+    }
+}
+
+// lets go of the message, telling a cut-through producer to stop
+static void tx_release(int slot) {
+    if (isotp_tx.slots[slot].stream) {
+        atomic_store(&isotp_tx.slots[slot].stream->done, true);
+        isotp_tx_stream_release(isotp_tx.slots[slot].stream);
+        isotp_tx.slots[slot].stream = NULL;
+    } else {
+        isotp_pool_free(isotp_tx.slots[slot].buf);
+    }
+    isotp_tx.slots[slot].buf = NULL;
+}
+
+static bool tx_busy(int index) {
+    for (int i = 0; i < ISOTP_MAX_TX; i++) {
+        if (isotp_tx.slots[i].state != TX_IDLE && isotp_tx.slots[i].index == index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int tx_find(int index, enum isotp_tx_state state) {
+    for (int i = 0; i < ISOTP_MAX_TX; i++) {
+        if (isotp_tx.slots[i].state == state && isotp_tx.slots[i].index == index) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void tx_finish(int slot) {
+    assert(slot >= 0 && slot < ISOTP_MAX_TX);
+
+    int index = isotp_tx.slots[slot].index;
+    isotp_tx.slots[slot].state = TX_IDLE;
+    isotp_tx.slots[slot].starved = false;
+    isotp_wheel_cancel(&isotp_wheel, &isotp_tx.slots[slot].timer);
+    tx_release(slot);
+    // start the oldest transfer that was queued behind this one
+    int next = -1;
+    for (int i = 0; i < ISOTP_MAX_TX; i++) {
+        if (isotp_tx.slots[i].state == TX_QUEUED && isotp_tx.slots[i].index == index
+            && (next < 0 || (int32_t)(isotp_tx.slots[i].seq - isotp_tx.slots[next].seq) < 0)) {
+            next = i;
+        }
+    }
+    if (next >= 0) {
+        isotp_tx.slots[next].state = TX_FIRST_FRAME;
+        isotp_tx.slots[next].deadline = isotp_tx.now;
+    }
+}
+
+static void tx_abort(int slot, isotp_read_message_cb* read_message_cb) {
+    assert(slot >= 0 && slot < ISOTP_MAX_TX);
+
+    indicate(isotp_tx.slots[slot].index, isotp_tx.slots[slot].buf, true, ISOTP_MSG_TX | ISOTP_MSG_ABORTED, isotp_tx.now, read_message_cb);
+    tx_finish(slot);
+}
+
+static void tx_wait_fc(int slot, int64_t time) {
+    assert(slot >= 0 && slot < ISOTP_MAX_TX);
+
+    isotp_tx.slots[slot].state = TX_WAIT_FC;
+    isotp_tx.slots[slot].deadline = INT64_MAX;
+    isotp_wheel_arm(&isotp_wheel, &isotp_tx.slots[slot].timer, time + ISOTP_N_BS_US);
+}
+
+static uint32_t stmin_us(uint8_t stmin) {
+    if (stmin <= 0x7F) {
+        return stmin * 1000;
+    }
+    if (stmin >= 0xF1 && stmin <= 0xF9) {
+        return (stmin - 0xF0) * 100;
+    }
+    // reserved values are to be treated as the longest STmin
+    return 0x7F * 1000;
+}
+
+// sends the next frame of the transfer in the given slot, if it is due
+static void tx_pump(int slot, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb) {
+    assert(slot >= 0 && slot < ISOTP_MAX_TX);
+    assert(write_frame);
+    assert(read_message_cb);
+
+    int index = isotp_tx.slots[slot].index;
+    int msg_start = (isotp_addr_pairs[index].txid & 0x40000000) ? 5 : 4;
+    if (isotp_tx.slots[slot].deadline > isotp_tx.now) {
+        return;
+    }
+    isotp_tx.slots[slot].starved = isotp_tx.slots[slot].state != TX_WAIT_FC && tx_starved(slot);
+    if (isotp_tx.slots[slot].starved) {
+        // EVENT_WRITE_STREAM brings the deadline forward, polling covers
+        // a wake up lost to a full event queue
+        isotp_tx.slots[slot].deadline = isotp_tx.now + ISOTP_TX_RETRY_US;
+        if (!isotp_wheel_armed(&isotp_tx.slots[slot].timer)) {
+            isotp_wheel_arm(&isotp_wheel, &isotp_tx.slots[slot].timer, isotp_tx.now + ISOTP_TX_STREAM_STALL_US);
+        }
+        return;
+    }
+    int64_t time;
+    switch (isotp_tx.slots[slot].state) {
+    case TX_FIRST_FRAME: {
+        size_t len = isotp_tx.slots[slot].size - msg_start;
+        if (isotp_tx.slots[slot].size <= 11) {
+            // only gets here if it was queued behind another transfer
+            uint8_t pci = len;
+            time = tx_write(index, isotp_tx.slots[slot].buf, isotp_tx.slots[slot].size, &isotp_tx.slots[slot].offset, &pci, 1, write_frame);
+            if (time >= 0) {
+                tx_done(index, isotp_tx.slots[slot].buf, time, read_message_cb);
+                tx_finish(slot);
+                return;
+            }
+        } else {
+            // 12-bit length, or the escape sequence with a 32-bit length
+            uint8_t pci[6] = { 0x10 | (len >> 8), len, 0, 0, 0, 0 };
+            int pci_sz = 2;
+            if (len > 0xFFF) {
+                pci[0] = 0x10;
+                pci[1] = 0;
+                pci[2] = len >> 24;
+                pci[3] = len >> 16;
+                pci[4] = len >> 8;
+                pci[5] = len;
+                pci_sz = 6;
+            }
+            time = tx_write(index, isotp_tx.slots[slot].buf, isotp_tx.slots[slot].size, &isotp_tx.slots[slot].offset, pci, pci_sz, write_frame);
+            if (time >= 0) {
+                tx_sent(slot);
+                isotp_tx.slots[slot].sn = 1;
+                tx_wait_fc(slot, time);
+                return;
             }
         }
-        evt->msg.data[3] = isotp_addr_pairs[index].txext;
-        evt->msg.data[3 + pad_sz] = evt->msg.size - msg_start;
-        write_frame(isotp_addr_pairs[index].txid & 0x9FFFFFFF, dlc, evt->msg.data + 3);
+        break;
+    }
+    case TX_CONSECUTIVE: {
+        uint8_t pci = 0x20 | isotp_tx.slots[slot].sn;
+        time = tx_write(index, isotp_tx.slots[slot].buf, isotp_tx.slots[slot].size, &isotp_tx.slots[slot].offset, &pci, 1, write_frame);
+        if (time >= 0) {
+            tx_sent(slot);
+            isotp_wheel_cancel(&isotp_wheel, &isotp_tx.slots[slot].timer);
+            isotp_tx.slots[slot].sn = (isotp_tx.slots[slot].sn + 1) & 0xF;
+            if (isotp_tx.slots[slot].offset >= isotp_tx.slots[slot].size) {
+                tx_done(index, isotp_tx.slots[slot].buf, time, read_message_cb);
+                tx_finish(slot);
+                return;
+            }
+            if (isotp_tx.slots[slot].bs && ++isotp_tx.slots[slot].bs_count == isotp_tx.slots[slot].bs) {
+                tx_wait_fc(slot, time);
+                return;
+            }
+            // whichever asks for more: the receiver's flow control or our own configuration
+            uint32_t gap = stmin_us(isotp_tx.slots[slot].stmin);
+            uint32_t own = stmin_us(isotp_addr_pairs[index].stmin);
+            if (own > gap) {
+                gap = own;
+            }
+            // write_frame() reports when the frame will have left the bus,
+            // STmin counts from there; without one the driver's TX queue
+            // is left to pace the frames
+            isotp_tx.slots[slot].deadline = gap ? time + gap : isotp_tx.now;
+        }
+        break;
+    }
+    default:
+        return;
+    }
+    if (time < 0) {
+        // CAN TX queue full, try again a little later, for up to N_As
+        isotp_tx.slots[slot].deadline = isotp_tx.now + ISOTP_TX_RETRY_US;
+        if (!isotp_wheel_armed(&isotp_tx.slots[slot].timer)) {
+            isotp_wheel_arm(&isotp_wheel, &isotp_tx.slots[slot].timer, isotp_tx.now + ISOTP_N_AS_US);
+        }
+        return;
+    }
+}
+
+static void tx_flow_control(struct isotp_event* evt, int index, size_t pci_byte, isotp_read_message_cb* read_message_cb) {
+    assert(evt);
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+
+    int slot = tx_find(index, TX_WAIT_FC);
+    if (slot < 0 || evt->can.dlc < pci_byte + 3) {
+        return;
+    }
+    switch (evt->can.data[pci_byte] & 0xF) {
+    case 0:
+        // clear to send
+        isotp_tx.slots[slot].state = TX_CONSECUTIVE;
+        isotp_tx.slots[slot].bs = evt->can.data[pci_byte + 1];
+        isotp_tx.slots[slot].bs_count = 0;
+        isotp_tx.slots[slot].stmin = evt->can.data[pci_byte + 2];
+        isotp_tx.slots[slot].deadline = evt->can.time;
+        isotp_wheel_cancel(&isotp_wheel, &isotp_tx.slots[slot].timer);
+        break;
+    case 1:
+        // wait
+        tx_wait_fc(slot, evt->can.time);
+        break;
+    default:
+        // overflow or invalid
+        tx_abort(slot, read_message_cb);
+        break;
+    }
+}
+
+static void rx_abort(int index, isotp_read_message_cb* read_message_cb) {
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+
+    isotp_wheel_cancel(&isotp_wheel, &isotp_addr_pairs_extra.pairs[index].timer);
+    isotp_addr_pairs_extra.pairs[index].held = false;
+    if (isotp_addr_pairs_extra.pairs[index].buf) {
+        indicate(index, isotp_addr_pairs_extra.pairs[index].buf, false, ISOTP_MSG_ABORTED, isotp_tx.now, read_message_cb);
+        isotp_pool_free(isotp_addr_pairs_extra.pairs[index].buf);
+        isotp_addr_pairs_extra.pairs[index].buf = NULL;
     }
-    // TODO: the rest of the owl
 }
 
-static void send_flow_control(int index, isotp_write_frame* write_frame) {
+// hands over what was received since the last fragment; the consumer may
+// keep the block, so unless it was the last one the rest goes into a fresh
+// one. A fragment the consumer has no room for would leave a hole in the
+// message, so the reception is aborted instead. Returns false if it was.
+static bool rx_fragment(int index, int64_t time, bool last, isotp_read_message_cb* read_message_cb, isotp_rx_room* rx_room) {
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+    assert(isotp_addr_pairs_extra.pairs[index].buf);
+
+    size_t addr_size = (isotp_addr_pairs[index].rxid & 0x40000000) ? 5 : 4;
+    size_t chunk = isotp_addr_pairs_extra.pairs[index].chunk;
+    struct isotp_msg_info info = {
+        .channel = isotp_addr_pairs[index].channel,
+        .flags = ISOTP_MSG_FRAGMENT | (last ? ISOTP_MSG_LAST_FRAGMENT : 0),
+        .time = time,
+        .seq = isotp_addr_pairs_extra.pairs[index].seq++,
+        .offset = chunk - addr_size,
+        .total = isotp_addr_pairs_extra.pairs[index].size - addr_size,
+    };
+    if (!rx_room(info.channel) || !read_message_cb(isotp_addr_pairs_extra.pairs[index].buf, addr_size + isotp_addr_pairs_extra.pairs[index].offset - chunk, &info)) {
+        isotp_stats.msg_dropped++;
+        rx_abort(index, read_message_cb);
+        return false;
+    }
+    isotp_addr_pairs_extra.pairs[index].chunk = isotp_addr_pairs_extra.pairs[index].offset;
+    if (last) {
+        return true;
+    }
+    uint8_t* buf = isotp_pool_alloc(ISOTP_STREAM_CHUNK);
+    if (!buf) {
+        rx_abort(index, read_message_cb);
+        return false;
+    }
+    memcpy(buf, isotp_addr_pairs_extra.pairs[index].buf, addr_size);
+    isotp_pool_free(isotp_addr_pairs_extra.pairs[index].buf);
+    isotp_addr_pairs_extra.pairs[index].buf = buf;
+    return true;
+}
+
+#define FC_CTS 0
+#define FC_WAIT 1
+#define FC_OVFLW 2
+
+// Streaming receptions get blocks of at most this many consecutive frames,
+// fewer bytes than a fragment holds. Each block then hands over one
+// fragment at most before the next flow control, which holds the sender
+// with FC.WAIT while the consumer is behind.
+#define ISOTP_STREAM_BS ((ISOTP_STREAM_CHUNK - 5) / 7)
+
+static uint8_t rx_block_size(int index) {
+    uint8_t bs = isotp_addr_pairs[index].bs;
+    if ((isotp_addr_pairs[index].flags & ISOTP_PAIR_STREAM) && (!bs || bs > ISOTP_STREAM_BS)) {
+        bs = ISOTP_STREAM_BS;
+    }
+    return bs;
+}
+
+static void send_flow_control(int index, uint8_t status, isotp_write_frame* write_frame) {
     int start = 1;
     uint8_t dlc = 3;
     uint8_t buf[9];
     buf[0] = isotp_addr_pairs[index].txext;
-    buf[1] = 0x30;
-    buf[2] = isotp_addr_pairs_extra.bs;
-    buf[3] = isotp_addr_pairs_extra.stmin;
+    buf[1] = 0x30 | status;
+    buf[2] = rx_block_size(index);
+    buf[3] = isotp_addr_pairs[index].stmin;
     buf[4] = isotp_addr_pairs[index].txpad;
     buf[5] = isotp_addr_pairs[index].txpad;
     buf[6] = isotp_addr_pairs[index].txpad;
@@ -188,160 +701,761 @@ static void send_flow_control(int index, isotp_write_frame* write_frame) {
     write_frame(isotp_addr_pairs[index].txid & 0x9FFFFFFF, dlc, buf + start);
 }
 
-static void handle_read_can(struct isotp_event* evt, int index, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb) {
+// whether the consumer can take a message from this pair on top of those
+// already on their way to it
+static bool rx_ready(int index, isotp_rx_room* rx_room) {
+    size_t pending = 0;
+    for (int i = 0; i < ISOTP_PAIR_SLOTS; i++) {
+        if (i != index && isotp_addr_pairs_extra.pairs[i].buf && !isotp_addr_pairs_extra.pairs[i].held) {
+            pending++;
+        }
+    }
+    return rx_room(isotp_addr_pairs[index].channel) > pending;
+}
+
+// answers a first frame or the end of a block: CTS if the consumer has room,
+// FC.WAIT while it has not. After N_WFTmax of those the transfer is dropped,
+// with FC.OVFLW if nothing but the first frame came yet (the only place the
+// standard allows it).
+static void rx_flow_control(int index, int64_t time, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb, isotp_rx_room* rx_room) {
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+    assert(isotp_addr_pairs_extra.pairs[index].buf);
+
+    if (rx_ready(index, rx_room)) {
+        isotp_addr_pairs_extra.pairs[index].held = false;
+        isotp_addr_pairs_extra.pairs[index].ff_pending = false;
+        isotp_addr_pairs_extra.pairs[index].wft = 0;
+        isotp_wheel_arm(&isotp_wheel, &isotp_addr_pairs_extra.pairs[index].timer, time + ISOTP_N_CR_US);
+        send_flow_control(index, FC_CTS, write_frame);
+        return;
+    }
+    if (isotp_addr_pairs_extra.pairs[index].wft == ISOTP_WFT_MAX) {
+        if (isotp_addr_pairs_extra.pairs[index].ff_pending) {
+            isotp_stats.fc_overflow++;
+            send_flow_control(index, FC_OVFLW, write_frame);
+        }
+        rx_abort(index, read_message_cb);
+        return;
+    }
+    isotp_stats.fc_wait++;
+    isotp_addr_pairs_extra.pairs[index].held = true;
+    isotp_addr_pairs_extra.pairs[index].wft++;
+    isotp_wheel_arm(&isotp_wheel, &isotp_addr_pairs_extra.pairs[index].timer, time + ISOTP_WAIT_US);
+    send_flow_control(index, FC_WAIT, write_frame);
+}
+
+// whether id answers the functional pair at index, and where the flow
+// control to it goes (see ISOTP_PAIR_FUNCTIONAL)
+static bool responder_match(int index, uint32_t id, uint32_t* fc_id) {
+    uint32_t base = isotp_addr_pairs[index].rxid & 0x9FFFFFFF;
+    id &= 0x9FFFFFFF;
+    if (base & 0x80000000) {
+        if ((id & 0xFFFFFF00) != (base & 0xFFFFFF00)) {
+            return false;
+        }
+        *fc_id = (id & 0xFFFF0000) | ((id & 0xFF) << 8) | ((id >> 8) & 0xFF);
+    } else {
+        if ((id & 0xFFFFFFF8) != (base & 0xFFFFFFF8)) {
+            return false;
+        }
+        *fc_id = id - 8;
+    }
+    return true;
+}
+
+// gives a response to a functional request that is still collecting a pair
+// of its own; only single and first frames start one. -1 if the frame is no
+// such response.
+static int responder_open(const struct isotp_event* evt) {
+    for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
+        uint32_t fc_id;
+        if (!isotp_addr_pairs[i].active || !(isotp_addr_pairs[i].flags & ISOTP_PAIR_FUNCTIONAL)
+            || !isotp_wheel_armed(&isotp_addr_pairs_extra.pairs[i].timer) || !responder_match(i, evt->can.id, &fc_id)) {
+            continue;
+        }
+        size_t pci_byte = (isotp_addr_pairs[i].rxid & 0x40000000) ? 1 : 0;
+        if (evt->can.dlc <= pci_byte || (pci_byte && evt->can.data[0] != isotp_addr_pairs[i].rxext) || (evt->can.data[pci_byte] >> 4) > 1) {
+            continue;
+        }
+        for (int r = ISOTP_MAX_PAIRS; r < ISOTP_PAIR_SLOTS; r++) {
+            if (!isotp_addr_pairs[r].active) {
+                isotp_addr_pairs[r] = isotp_addr_pairs[i];
+                isotp_addr_pairs[r].txid = fc_id | (isotp_addr_pairs[i].txid & 0x60000000);
+                isotp_addr_pairs[r].rxid = (evt->can.id & 0x9FFFFFFF) | (isotp_addr_pairs[i].rxid & 0x60000000);
+                isotp_addr_pairs[r].flags &= ~ISOTP_PAIR_FUNCTIONAL;
+                isotp_addr_pairs_extra.pairs[r].functional = i;
+                isotp_pair_added(r);
+                return r;
+            }
+        }
+        // more responders than slots
+        isotp_stats.msg_dropped++;
+        return -1;
+    }
+    return -1;
+}
+
+// lets a responder go once its response is in and its window has closed
+static void responder_reap(int index) {
+    if (index < ISOTP_MAX_PAIRS || !isotp_addr_pairs[index].active || isotp_addr_pairs_extra.pairs[index].buf
+        || isotp_wheel_armed(&isotp_addr_pairs_extra.pairs[isotp_addr_pairs_extra.pairs[index].functional].timer)) {
+        return;
+    }
+    isotp_addr_pairs[index].active = false;
+    isotp_pair_removed(index);
+}
+
+// no more responses start for the functional pair at index
+static void functional_close(int index, isotp_read_message_cb* read_message_cb) {
+    for (int r = ISOTP_MAX_PAIRS; r < ISOTP_PAIR_SLOTS; r++) {
+        if (isotp_addr_pairs_extra.pairs[r].functional == index) {
+            responder_reap(r);
+        }
+    }
+    uint32_t id = isotp_addr_pairs[index].txid & 0x9FFFFFFF;
+    uint8_t addr[5] = { id >> 24, id >> 16, id >> 8, id, isotp_addr_pairs[index].txext };
+    indicate(index, addr, true, ISOTP_MSG_WINDOW_END, isotp_tx.now, read_message_cb);
+}
+
+static void tx_service(isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb, isotp_rx_room* rx_room, isotp_set_timer* set_timer) {
+    assert(set_timer);
+
+    struct isotp_wheel_timer* expired;
+    while ((expired = isotp_wheel_expire(&isotp_wheel, isotp_tx.now))) {
+        if (expired->owner < ISOTP_PAIR_SLOTS && isotp_addr_pairs_extra.pairs[expired->owner].held) {
+            // time for the next FC.WAIT, or the consumer made room
+            rx_flow_control(expired->owner, isotp_tx.now, write_frame, read_message_cb, rx_room);
+            responder_reap(expired->owner);
+        } else if (expired->owner < ISOTP_MAX_PAIRS && (isotp_addr_pairs[expired->owner].flags & ISOTP_PAIR_FUNCTIONAL)) {
+            functional_close(expired->owner, read_message_cb);
+        } else if (expired->owner < ISOTP_PAIR_SLOTS) {
+            // N_Cr
+            rx_abort(expired->owner, read_message_cb);
+            responder_reap(expired->owner);
+        } else {
+            // N_As, N_Bs or a stalled stream
+            tx_abort(expired->owner - ISOTP_PAIR_SLOTS, read_message_cb);
+        }
+    }
+    // one frame per due transfer and round, starting one slot further each
+    // time, so concurrent transfers interleave on the bus
+    for (int round = 0; round < ISOTP_TX_BURST; round++) {
+        bool due = false;
+        for (int n = 0; n < ISOTP_MAX_TX; n++) {
+            int i = (isotp_tx.first + n) % ISOTP_MAX_TX;
+            if (isotp_tx.slots[i].state != TX_IDLE && isotp_tx.slots[i].state != TX_QUEUED && isotp_tx.slots[i].deadline <= isotp_tx.now) {
+                tx_pump(i, write_frame, read_message_cb);
+                due = true;
+            }
+        }
+        isotp_tx.first = (isotp_tx.first + 1) % ISOTP_MAX_TX;
+        if (!due) {
+            break;
+        }
+    }
+    int64_t next = isotp_wheel_next(&isotp_wheel);
+    for (int i = 0; i < ISOTP_MAX_TX; i++) {
+        if (isotp_tx.slots[i].state != TX_IDLE && isotp_tx.slots[i].state != TX_QUEUED && isotp_tx.slots[i].deadline < next) {
+            next = isotp_tx.slots[i].deadline;
+        }
+    }
+    if (next < isotp_tx.timer) {
+        isotp_tx.timer = next;
+        set_timer(next);
+    }
+}
+
+// key: CAN ID with bit 31 (extended ID) and bit 30 (extended addressing)
+static inline size_t pair_hash(uint32_t key, uint8_t ext) {
+    return ((key ^ ((uint32_t)ext << 21)) * 2654435761u) >> 24;
+}
+
+static inline bool pair_matches(uint32_t id, uint8_t ext, uint32_t key, uint8_t key_ext) {
+    return (id & 0xDFFFFFFF) == key && (!(key & 0x40000000) || ext == key_ext);
+}
+
+static void pair_index_insert(uint8_t* table, int index, uint32_t id, uint8_t ext) {
+    uint32_t key = id & 0xDFFFFFFF;
+    uint8_t key_ext = (key & 0x40000000) ? ext : 0;
+    size_t h = pair_hash(key, key_ext);
+    for (size_t n = 0; n < PAIR_INDEX_SIZE; n++, h = (h + 1) % PAIR_INDEX_SIZE) {
+        if (table[h] == PAIR_INDEX_EMPTY || table[h] == PAIR_INDEX_DELETED) {
+            if (table[h] == PAIR_INDEX_DELETED) {
+                pair_index_tombstones--;
+            }
+            table[h] = index + 1;
+            return;
+        }
+    }
+    assert(0);
+}
+
+static void pair_index_erase(uint8_t* table, int index, uint32_t id, uint8_t ext) {
+    uint32_t key = id & 0xDFFFFFFF;
+    uint8_t key_ext = (key & 0x40000000) ? ext : 0;
+    size_t h = pair_hash(key, key_ext);
+    for (size_t n = 0; n < PAIR_INDEX_SIZE && table[h] != PAIR_INDEX_EMPTY; n++, h = (h + 1) % PAIR_INDEX_SIZE) {
+        if (table[h] == index + 1) {
+            table[h] = PAIR_INDEX_DELETED;
+            pair_index_tombstones++;
+            return;
+        }
+    }
+}
+
+// lowest active pair matching the key, the same one a scan in pair order finds
+static int pair_index_find(const uint8_t* table, bool rx, uint32_t key, uint8_t key_ext, int best) {
+    size_t h = pair_hash(key, key_ext);
+    for (size_t n = 0; n < PAIR_INDEX_SIZE && table[h] != PAIR_INDEX_EMPTY; n++, h = (h + 1) % PAIR_INDEX_SIZE) {
+        if (table[h] == PAIR_INDEX_DELETED) {
+            continue;
+        }
+        int i = table[h] - 1;
+        if ((best >= 0 && i >= best) || !isotp_addr_pairs[i].active) {
+            continue;
+        }
+        if (rx ? pair_matches(isotp_addr_pairs[i].rxid, isotp_addr_pairs[i].rxext, key, key_ext)
+               : pair_matches(isotp_addr_pairs[i].txid, isotp_addr_pairs[i].txext, key, key_ext)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void isotp_pair_added(int index) {
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+    // a functional pair takes no frames itself, its responders do
+    if (!(isotp_addr_pairs[index].flags & ISOTP_PAIR_FUNCTIONAL)) {
+        pair_index_insert(rx_index, index, isotp_addr_pairs[index].rxid, isotp_addr_pairs[index].rxext);
+    }
+    pair_index_insert(tx_index, index, isotp_addr_pairs[index].txid, isotp_addr_pairs[index].txext);
+    pair_index_count++;
+}
+
+void isotp_pair_removed(int index) {
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+    pair_index_erase(rx_index, index, isotp_addr_pairs[index].rxid, isotp_addr_pairs[index].rxext);
+    pair_index_erase(tx_index, index, isotp_addr_pairs[index].txid, isotp_addr_pairs[index].txext);
+    if (--pair_index_count <= 0) {
+        // nothing left to find, drop the tombstones
+        pair_index_count = 0;
+        pair_index_tombstones = 0;
+        memset(rx_index, PAIR_INDEX_EMPTY, sizeof(rx_index));
+        memset(tx_index, PAIR_INDEX_EMPTY, sizeof(tx_index));
+    }
+}
+
+static void pair_index_rebuild(void) {
+    memset(rx_index, PAIR_INDEX_EMPTY, sizeof(rx_index));
+    memset(tx_index, PAIR_INDEX_EMPTY, sizeof(tx_index));
+    pair_index_count = 0;
+    pair_index_tombstones = 0;
+    for (int i = 0; i < ISOTP_PAIR_SLOTS; i++) {
+        if (isotp_addr_pairs[i].active) {
+            isotp_pair_added(i);
+        }
+    }
+}
+
+int isotp_pair_find_rx(uint32_t id, const uint8_t* data, uint8_t dlc) {
+    assert(data || !dlc);
+    int best = pair_index_find(rx_index, true, id & 0x9FFFFFFF, 0, -1);
+    if (dlc) {
+        best = pair_index_find(rx_index, true, (id & 0x9FFFFFFF) | 0x40000000, data[0], best);
+    }
+    return best;
+}
+
+int isotp_pair_find_tx(uint32_t id, const uint8_t* data, size_t size) {
+    assert(data);
+    int best = pair_index_find(tx_index, false, id & 0x9FFFFFFF, 0, -1);
+    if (size > 4) {
+        best = pair_index_find(tx_index, false, (id & 0x9FFFFFFF) | 0x40000000, data[4], best);
+    }
+    return best;
+}
+
+static void handle_write_msg(struct isotp_event* evt, int index, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb) {
     assert(evt);
-    assert(index >= 0 && index < ISOTP_MAX_PAIRS);
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
+
+    if ((isotp_addr_pairs[index].flags & ISOTP_PAIR_FUNCTIONAL) && (evt->msg.stream || evt->msg.size > 11)) {
+        // functional requests must fit a single frame
+        indicate(index, evt->msg.data, true, ISOTP_MSG_TX | ISOTP_MSG_ABORTED, isotp_tx.now, read_message_cb);
+        return;
+    }
+    int msg_start = (isotp_addr_pairs[index].txid & 0x40000000) ? 5 : 4;
+    bool busy = tx_busy(index);
+    if (!busy && !evt->msg.stream && evt->msg.size <= 11) {
+        // single frame, no need to keep it around
+        size_t offset = msg_start;
+        uint8_t pci = evt->msg.size - msg_start;
+        int64_t time = tx_write(index, evt->msg.data, evt->msg.size, &offset, &pci, 1, write_frame);
+        if (time >= 0) {
+            tx_done(index, evt->msg.data, time, read_message_cb);
+            return;
+        }
+        // CAN TX queue full, let a slot retry it
+    }
+    for (int i = 0; i < ISOTP_MAX_TX; i++) {
+        if (isotp_tx.slots[i].state == TX_IDLE) {
+            isotp_tx.slots[i].state = busy ? TX_QUEUED : TX_FIRST_FRAME;
+            isotp_tx.slots[i].index = index;
+            isotp_tx.slots[i].seq = isotp_tx.seq++;
+            isotp_tx.slots[i].deadline = isotp_tx.now;
+            isotp_tx.slots[i].buf = evt->msg.data;
+            isotp_tx.slots[i].stream = evt->msg.stream;
+            isotp_tx.slots[i].starved = false;
+            isotp_tx.slots[i].size = evt->msg.size;
+            isotp_tx.slots[i].offset = msg_start;
+            evt->msg.data = NULL; // the slot owns it now
+            evt->msg.stream = NULL;
+            return;
+        }
+    }
+    isotp_stats.tx_dropped++;
+    debug_frame_log(write_frame, "TX slots full, message dropped");
+}
+
+static void handle_read_can(struct isotp_event* evt, int index, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb, isotp_rx_room* rx_room) {
+    assert(evt);
+    assert(index >= 0 && index < ISOTP_PAIR_SLOTS);
     assert(read_message_cb);
 
     size_t pci_byte = (isotp_addr_pairs[index].rxid & 0x40000000) ? 1 : 0;
+    struct isotp_msg_info info = {
+        .channel = isotp_addr_pairs[index].channel,
+        .time = evt->can.time,
+    };
     switch (evt->can.data[pci_byte] >> 4) {
     case 0:
         if (evt->can.data[pci_byte] <= (7 - pci_byte)) {
-            uint8_t buf[11];
+            // straight into a block the consumer can keep
+            uint8_t* buf = isotp_pool_alloc(11);
+            if (!buf) {
+                isotp_stats.msg_dropped++;
+                break;
+            }
             buf[0] = evt->can.id >> 24;
             buf[1] = evt->can.id >> 16;
             buf[2] = evt->can.id >> 8;
             buf[3] = evt->can.id;
             buf[4] = evt->can.data[0];
             memcpy(buf + 4 + pci_byte, evt->can.data + pci_byte + 1, 7 - pci_byte);
-            read_message_cb(buf, evt->can.data[pci_byte] + pci_byte + 4, isotp_addr_pairs[index].channel);
+            deliver(buf, evt->can.data[pci_byte] + pci_byte + 4, &info, read_message_cb);
+            isotp_pool_free(buf);
         }
         break;
-    case 1:
-        if (evt->can.data[pci_byte] == 0x10 && evt->can.data[pci_byte + 1] <= (252 - pci_byte)) {
-            isotp_addr_pairs_extra.pairs[index].offset = 10;
-            isotp_addr_pairs_extra.pairs[index].size = evt->can.data[pci_byte + 1] + pci_byte + 4;
-            isotp_addr_pairs_extra.pairs[index].ctr = 1;
-            assert(isotp_addr_pairs_extra.pairs[index].size <= 256);
-            isotp_addr_pairs_extra.pairs[index].buf[0] = evt->can.id >> 24;
-            isotp_addr_pairs_extra.pairs[index].buf[1] = evt->can.id >> 16;
-            isotp_addr_pairs_extra.pairs[index].buf[2] = evt->can.id >> 8;
-            isotp_addr_pairs_extra.pairs[index].buf[3] = evt->can.id;
-            isotp_addr_pairs_extra.pairs[index].buf[4] = evt->can.data[0];
-            memcpy(isotp_addr_pairs_extra.pairs[index].buf + 4 + pci_byte, evt->can.data + pci_byte + 2, 6 - pci_byte);
-            send_flow_control(index, write_frame);
+    case 1: {
+        // 12-bit length, or 0 followed by a 32-bit length
+        size_t header = pci_byte + 2;
+        uint32_t len = ((evt->can.data[pci_byte] & 0xF) << 8) | evt->can.data[pci_byte + 1];
+        if (!len) {
+            header += 4;
+            len = ((uint32_t)evt->can.data[pci_byte + 2] << 24) | (evt->can.data[pci_byte + 3] << 16) | (evt->can.data[pci_byte + 4] << 8) | evt->can.data[pci_byte + 5];
+            if (len <= 0xFFF) {
+                break;
+            }
+        } else if (len < 8 - pci_byte) {
+            // would have fit a single frame
+            break;
+        }
+        if (evt->can.dlc < 8) {
+            break;
+        }
+        // a new first frame aborts whatever was being reassembled
+        rx_abort(index, read_message_cb);
+        bool stream = isotp_addr_pairs[index].flags & ISOTP_PAIR_STREAM;
+        size_t size = (size_t)len + pci_byte + 4;
+        uint8_t* buf = NULL;
+        if (stream) {
+            // never needs the whole message at once, so any length will do
+            // as long as its size fits a size_t
+            buf = (size > len) ? isotp_pool_alloc(ISOTP_STREAM_CHUNK) : NULL;
+        } else if (len <= ISOTP_MAX_MSG_SIZE && size <= ISOTP_MAX_MSG_SIZE) {
+            buf = isotp_pool_alloc(size);
+        }
+        if (!buf) {
+            isotp_stats.fc_overflow++;
+            send_flow_control(index, FC_OVFLW, write_frame);
+            break;
+        }
+        buf[0] = evt->can.id >> 24;
+        buf[1] = evt->can.id >> 16;
+        buf[2] = evt->can.id >> 8;
+        buf[3] = evt->can.id;
+        buf[4] = evt->can.data[0];
+        memcpy(buf + 4 + pci_byte, evt->can.data + header, 8 - header);
+        isotp_addr_pairs_extra.pairs[index].buf = buf;
+        isotp_addr_pairs_extra.pairs[index].offset = 4 + pci_byte + 8 - header;
+        isotp_addr_pairs_extra.pairs[index].size = size;
+        isotp_addr_pairs_extra.pairs[index].ctr = 1;
+        isotp_addr_pairs_extra.pairs[index].bs_count = 0;
+        isotp_addr_pairs_extra.pairs[index].stream = stream;
+        isotp_addr_pairs_extra.pairs[index].chunk = 4 + pci_byte;
+        isotp_addr_pairs_extra.pairs[index].seq = 0;
+        isotp_addr_pairs_extra.pairs[index].held = false;
+        isotp_addr_pairs_extra.pairs[index].ff_pending = true;
+        isotp_addr_pairs_extra.pairs[index].wft = 0;
+        rx_flow_control(index, evt->can.time, write_frame, read_message_cb, rx_room);
+        if (stream && !isotp_addr_pairs_extra.pairs[index].held && isotp_addr_pairs_extra.pairs[index].buf) {
+            // the sooner the first bytes are out, the better
+            rx_fragment(index, evt->can.time, false, read_message_cb, rx_room);
         }
         break;
+    }
     case 2: {
-        int offset = isotp_addr_pairs_extra.pairs[index].offset;
-        int size = isotp_addr_pairs_extra.pairs[index].size;
-        int max_sz = 7 - pci_byte;
-        int rem = size - offset;
-        if (rem > 0 && (evt->can.data[pci_byte] & 0xF) == isotp_addr_pairs_extra.pairs[index].ctr) {
-            isotp_addr_pairs_extra.pairs[index].ctr = (isotp_addr_pairs_extra.pairs[index].ctr + 1) & 0xF;
-            memcpy(isotp_addr_pairs_extra.pairs[index].buf + offset, evt->can.data + pci_byte + 1, (max_sz < size) ? max_sz : size);
-            isotp_addr_pairs_extra.pairs[index].offset += (max_sz < size) ? max_sz : size;
-            rem -= max_sz;
-            if (rem <= 0) {
-                read_message_cb(isotp_addr_pairs_extra.pairs[index].buf, size, isotp_addr_pairs[index].channel);
+        uint8_t* buf = isotp_addr_pairs_extra.pairs[index].buf;
+        size_t offset = isotp_addr_pairs_extra.pairs[index].offset;
+        size_t size = isotp_addr_pairs_extra.pairs[index].size;
+        size_t n = 7 - pci_byte;
+        if (!buf) {
+            break;
+        }
+        if ((evt->can.data[pci_byte] & 0xF) != isotp_addr_pairs_extra.pairs[index].ctr) {
+            // lost a frame, the rest of the message is of no use
+            rx_abort(index, read_message_cb);
+            break;
+        }
+        isotp_addr_pairs_extra.pairs[index].ctr = (isotp_addr_pairs_extra.pairs[index].ctr + 1) & 0xF;
+        if (n > size - offset) {
+            n = size - offset;
+        }
+        // where in buf: the whole message is there unless streaming
+        size_t at = offset;
+        bool stream = isotp_addr_pairs_extra.pairs[index].stream;
+        if (stream) {
+            if (4 + pci_byte + offset - isotp_addr_pairs_extra.pairs[index].chunk + n > ISOTP_STREAM_CHUNK) {
+                if (!rx_fragment(index, evt->can.time, false, read_message_cb, rx_room)) {
+                    break;
+                }
+                buf = isotp_addr_pairs_extra.pairs[index].buf;
+            }
+            at = 4 + pci_byte + offset - isotp_addr_pairs_extra.pairs[index].chunk;
+        }
+        memcpy(buf + at, evt->can.data + pci_byte + 1, n);
+        isotp_addr_pairs_extra.pairs[index].offset += n;
+        if (isotp_addr_pairs_extra.pairs[index].offset == size) {
+            isotp_wheel_cancel(&isotp_wheel, &isotp_addr_pairs_extra.pairs[index].timer);
+            if (!stream) {
+                deliver(buf, size, &info, read_message_cb);
+            } else if (!rx_fragment(index, evt->can.time, true, read_message_cb, rx_room)) {
+                // aborted, buf is gone
+                break;
+            }
+            isotp_pool_free(buf);
+            isotp_addr_pairs_extra.pairs[index].buf = NULL;
+        } else {
+            isotp_wheel_arm(&isotp_wheel, &isotp_addr_pairs_extra.pairs[index].timer, evt->can.time + ISOTP_N_CR_US);
+            if (rx_block_size(index) && ++isotp_addr_pairs_extra.pairs[index].bs_count == rx_block_size(index)) {
+                isotp_addr_pairs_extra.pairs[index].bs_count = 0;
+                rx_flow_control(index, evt->can.time, write_frame, read_message_cb, rx_room);
             }
         }
         break;
     }
     case 3:
+        tx_flow_control(evt, index, pci_byte, read_message_cb);
         break;
     default:
         break;
     }
 }
 
-void isotp_event_loop(isotp_event_cb* get_next_event, isotp_unmatched_frame* unmatched_frame, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb) {
+// lets the frames for a configured pair through the CAN acceptance filter,
+// those of all its responders for a functional pair
+static void pair_filter(int index, bool add) {
+    uint32_t id = isotp_addr_pairs[index].rxid & 0x1FFFFFFF;
+    bool extd = (isotp_addr_pairs[index].rxid & 0x80000000) != 0;
+    if (isotp_addr_pairs[index].flags & ISOTP_PAIR_FUNCTIONAL) {
+        uint32_t mask = extd ? 0x1FFFFF00 : 0x7F8;
+        if (add) {
+            omni_libcan_add_filter_mask(id, mask, extd);
+        } else {
+            omni_libcan_remove_filter_mask(id, mask, extd);
+        }
+    } else if (add) {
+        omni_libcan_add_filter(id, extd);
+    } else {
+        omni_libcan_remove_filter(id, extd);
+    }
+}
+
+// sets the pair at index from a 12, 14 or 15 byte record
+static void pair_parse(int index, const uint8_t* record, size_t record_size) {
+    isotp_addr_pairs[index].active = true;
+    isotp_addr_pairs[index].txid = ((uint32_t)record[0] << 24) | (record[1] << 16) | (record[2] << 8) | record[3];
+    isotp_addr_pairs[index].txext = record[4];
+    isotp_addr_pairs[index].txpad = record[5];
+    isotp_addr_pairs[index].rxid = ((uint32_t)record[6] << 24) | (record[7] << 16) | (record[8] << 8) | record[9];
+    isotp_addr_pairs[index].rxext = record[10];
+    isotp_addr_pairs[index].rxpad = record[11];
+    isotp_addr_pairs[index].bs = (record_size > ISOTP_PAIRS_RECORD_SIZE) ? record[12] : isotp_addr_pairs_extra.bs;
+    isotp_addr_pairs[index].stmin = (record_size > ISOTP_PAIRS_RECORD_SIZE) ? record[13] : isotp_addr_pairs_extra.stmin;
+    isotp_addr_pairs[index].flags = (record_size > ISOTP_PAIRS_V2_RECORD_SIZE) ? record[14] : 0;
+}
+
+// ends the RX state of the pair at index without telling anyone
+static void pair_reset(int index) {
+    isotp_wheel_cancel(&isotp_wheel, &isotp_addr_pairs_extra.pairs[index].timer);
+    isotp_pool_free(isotp_addr_pairs_extra.pairs[index].buf);
+    isotp_addr_pairs_extra.pairs[index].buf = NULL;
+    isotp_addr_pairs_extra.pairs[index].held = false;
+}
+
+// takes the configured pair at index out, along with its transfers and, for
+// a functional pair, its responders
+static void pair_close(int index) {
+    assert(index >= 0 && index < ISOTP_MAX_PAIRS);
+    for (int i = 0; i < ISOTP_MAX_TX; i++) {
+        if (isotp_tx.slots[i].state != TX_IDLE && isotp_tx.slots[i].index == index) {
+            isotp_tx.slots[i].state = TX_IDLE;
+            isotp_tx.slots[i].starved = false;
+            isotp_wheel_cancel(&isotp_wheel, &isotp_tx.slots[i].timer);
+            tx_release(i);
+        }
+    }
+    for (int r = ISOTP_MAX_PAIRS; r < ISOTP_PAIR_SLOTS; r++) {
+        if (isotp_addr_pairs[r].active && isotp_addr_pairs_extra.pairs[r].functional == index) {
+            pair_reset(r);
+            isotp_pair_removed(r);
+            memset(isotp_addr_pairs + r, 0, sizeof(isotp_addr_pairs[0]));
+        }
+    }
+    pair_reset(index);
+    pair_filter(index, false);
+    isotp_pair_removed(index);
+    memset(isotp_addr_pairs + index, 0, sizeof(isotp_addr_pairs[0]));
+}
+
+// drops every pair and transfer without telling anyone
+static void pairs_clear(void) {
+    for (int i = 0; i < ISOTP_MAX_TX; i++) {
+        isotp_tx.slots[i].state = TX_IDLE;
+        isotp_tx.slots[i].starved = false;
+        isotp_wheel_cancel(&isotp_wheel, &isotp_tx.slots[i].timer);
+        tx_release(i);
+    }
+    for (int i = 0; i < ISOTP_PAIR_SLOTS; i++) {
+        pair_reset(i);
+        if (isotp_addr_pairs[i].active && i < ISOTP_MAX_PAIRS) {
+            pair_filter(i, false);
+        }
+        memset(isotp_addr_pairs + i, 0, sizeof(isotp_addr_pairs[0]));
+    }
+}
+
+// the pair on channel a V3 record names, -1 if there is none
+static int pair_lookup(const uint8_t* record, uint32_t channel) {
+    uint32_t txid = ((uint32_t)record[0] << 24) | (record[1] << 16) | (record[2] << 8) | record[3];
+    uint32_t rxid = ((uint32_t)record[6] << 24) | (record[7] << 16) | (record[8] << 8) | record[9];
+    for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
+        if (isotp_addr_pairs[i].active && isotp_addr_pairs[i].channel == channel
+            && ((isotp_addr_pairs[i].txid ^ txid) & 0xDFFFFFFF) == 0 && isotp_addr_pairs[i].txext == record[4]
+            && ((isotp_addr_pairs[i].rxid ^ rxid) & 0xDFFFFFFF) == 0 && isotp_addr_pairs[i].rxext == record[10]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// EVENT_ADD_PAIRS, EVENT_REMOVE_PAIRS or EVENT_UPDATE_PAIRS for one record;
+// only the pair it names, its filter and its index entries change
+static void pair_edit(enum isotp_event_type type, const uint8_t* record, uint32_t channel) {
+    int index = pair_lookup(record, channel);
+    if (index < 0 && type == EVENT_ADD_PAIRS) {
+        for (index = 0; index < ISOTP_MAX_PAIRS && isotp_addr_pairs[index].active; index++) { }
+        if (index == ISOTP_MAX_PAIRS) {
+            isotp_stats.pair_rejected++;
+            return;
+        }
+    } else if (index < 0) {
+        isotp_stats.pair_rejected++;
+        return;
+    } else if (type == EVENT_REMOVE_PAIRS) {
+        pair_close(index);
+        return;
+    } else if ((isotp_addr_pairs[index].flags ^ record[14]) & ISOTP_PAIR_FUNCTIONAL) {
+        // takes a different filter and different transfers
+        pair_close(index);
+    } else {
+        // transfers go on, with the new BS/STmin from the next flow control;
+        // the record matched the IDs the index has, so it stays as it is
+        pair_parse(index, record, ISOTP_PAIRS_V3_RECORD_SIZE);
+        return;
+    }
+    pair_parse(index, record, ISOTP_PAIRS_V3_RECORD_SIZE);
+    isotp_addr_pairs[index].channel = channel;
+    pair_filter(index, true);
+    isotp_pair_added(index);
+}
+
+void isotp_get_stats(struct isotp_stats* stats) {
+    assert(stats);
+    // only the event loop writes them, a torn read is off by one at worst
+    *stats = isotp_stats;
+}
+
+void isotp_event_loop(isotp_event_cb* get_next_event, isotp_unmatched_frame* unmatched_frame, isotp_write_frame* write_frame, isotp_read_message_cb* read_message_cb, isotp_rx_room* rx_room, isotp_set_timer* set_timer) {
     assert(get_next_event);
     assert(unmatched_frame);
     assert(write_frame);
     assert(read_message_cb);
-
-    struct isotp_event evt;
+    assert(rx_room);
+    assert(set_timer);
 
     memset(&isotp_addr_pairs, 0, sizeof(isotp_addr_pairs));
+    pair_index_rebuild();
+    memset(&isotp_tx, 0, sizeof(isotp_tx));
+    isotp_tx.timer = INT64_MAX;
+    isotp_wheel_init(&isotp_wheel, 0);
+    for (int i = 0; i < ISOTP_PAIR_SLOTS; i++) {
+        isotp_addr_pairs_extra.pairs[i].timer = (struct isotp_wheel_timer) { .owner = i };
+    }
+    for (int i = 0; i < ISOTP_MAX_TX; i++) {
+        isotp_tx.slots[i].timer.owner = ISOTP_PAIR_SLOTS + i;
+    }
 
     for (;;) {
-        get_next_event(&evt);
-        switch (evt.type) {
+        struct isotp_event* evt = get_next_event();
+        assert(evt);
+        switch (evt->type) {
         case EVENT_RECONFIGURE_PAIRS: {
-            for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
-                memset(isotp_addr_pairs + i, 0, sizeof(isotp_addr_pairs[0]));
+            pairs_clear();
+            const uint8_t* record = evt->pairs.data;
+            size_t record_size = ISOTP_PAIRS_RECORD_SIZE;
+            size_t size = evt->pairs.size;
+            if (size % ISOTP_PAIRS_RECORD_SIZE && size && record[0] == ISOTP_PAIRS_V2) {
+                record++;
+                size--;
+                record_size = ISOTP_PAIRS_V2_RECORD_SIZE;
+            } else if (size % ISOTP_PAIRS_RECORD_SIZE && size && record[0] == ISOTP_PAIRS_V3) {
+                record++;
+                size--;
+                record_size = ISOTP_PAIRS_V3_RECORD_SIZE;
             }
-            omni_libcan_clear_filter();
-            assert(evt.pairs.size % 12 == 0);
-            assert(evt.pairs.size / 12 <= ISOTP_MAX_PAIRS);
-            for (int i = 0, j = 0; i + 11 < evt.pairs.size && j < ISOTP_MAX_PAIRS; i += 12, j++) {
-                isotp_addr_pairs[j].active = true;
-                isotp_addr_pairs[j].txid = (evt.pairs.data[i] << 24) | (evt.pairs.data[i + 1] << 16) | (evt.pairs.data[i + 2] << 8) | evt.pairs.data[i + 3];
-                isotp_addr_pairs[j].txext = evt.pairs.data[i + 4];
-                isotp_addr_pairs[j].txpad = evt.pairs.data[i + 5];
-                isotp_addr_pairs[j].rxid = (evt.pairs.data[i + 6] << 24) | (evt.pairs.data[i + 7] << 16) | (evt.pairs.data[i + 8] << 8) | evt.pairs.data[i + 9];
-                isotp_addr_pairs[j].rxext = evt.pairs.data[i + 10];
-                isotp_addr_pairs[j].rxpad = evt.pairs.data[i + 11];
-                omni_libcan_add_filter(isotp_addr_pairs[j].rxid & 0x1FFFFFFF, (isotp_addr_pairs[j].rxid & 0x80000000) != 0);
+            assert(size % record_size == 0);
+            assert(size / record_size <= ISOTP_MAX_PAIRS);
+            for (int j = 0; size >= record_size && j < ISOTP_MAX_PAIRS; record += record_size, size -= record_size, j++) {
+                pair_parse(j, record, record_size);
+                pair_filter(j, true);
             }
+            isotp_pool_free(evt->pairs.data);
+            pair_index_rebuild();
+            break;
+        }
+        case EVENT_ADD_PAIRS:
+        case EVENT_REMOVE_PAIRS:
+        case EVENT_UPDATE_PAIRS: {
+            assert(evt->pairs.size % ISOTP_PAIRS_V3_RECORD_SIZE == 0);
+            for (size_t off = 0; off + ISOTP_PAIRS_V3_RECORD_SIZE <= evt->pairs.size; off += ISOTP_PAIRS_V3_RECORD_SIZE) {
+                pair_edit(evt->type, evt->pairs.data + off, evt->pairs.channel);
+            }
+            isotp_pool_free(evt->pairs.data);
             break;
         }
         case EVENT_RECONFIGURE_BS_STMIN: {
-            isotp_addr_pairs_extra.bs = evt.bs_stmin.data[0];
-            isotp_addr_pairs_extra.stmin = evt.bs_stmin.data[1];
+            isotp_addr_pairs_extra.bs = evt->bs_stmin.data[0];
+            isotp_addr_pairs_extra.stmin = evt->bs_stmin.data[1];
+            for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
+                if (isotp_addr_pairs[i].active && isotp_addr_pairs[i].channel == 0) {
+                    isotp_addr_pairs[i].bs = evt->bs_stmin.data[0];
+                    isotp_addr_pairs[i].stmin = evt->bs_stmin.data[1];
+                }
+            }
             break;
         }
         case EVENT_WRITE_MSG: {
             debug_frame_log(write_frame, "Writing message...");
-            assert(evt.msg.size > 4);
-            uint32_t id = (evt.msg.data[0] << 24) | (evt.msg.data[1] << 16) | (evt.msg.data[2] << 8) | evt.msg.data[3];
-            bool matched = false;
-            for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
-                bool is_active = isotp_addr_pairs[i].active;
-                bool id_match = is_active && (id & 0x9FFFFFFF) == (isotp_addr_pairs[i].txid & 0x9FFFFFFF);
-                if (id_match && isotp_addr_pairs[i].txid & 0x40000000) {
-                    assert(evt.msg.size > 5);
-                }
-                bool id_ext_match = id_match && (!(isotp_addr_pairs[i].txid & 0x40000000) || (isotp_addr_pairs[i].txext == evt.msg.data[4]));
-                if (id_ext_match) {
-                    matched = true;
-                    handle_write_msg(&evt, i, write_frame);
-                    break;
+            assert(evt->msg.size > 4);
+            // a cut-through producer has written at least the address
+            assert(!evt->msg.stream || (evt->msg.stream->data == evt->msg.data && evt->msg.stream->size == evt->msg.size && atomic_load(&evt->msg.stream->filled) >= 5));
+            if (evt->msg.time > isotp_tx.now) {
+                isotp_tx.now = evt->msg.time;
+            }
+            uint32_t id = ((uint32_t)evt->msg.data[0] << 24) | (evt->msg.data[1] << 16) | (evt->msg.data[2] << 8) | evt->msg.data[3];
+            int index = isotp_pair_find_tx(id, evt->msg.data, evt->msg.size);
+            bool matched = index >= 0;
+            if (matched) {
+                if (isotp_addr_pairs[index].txid & 0x40000000) {
+                    assert(evt->msg.size > 5);
                 }
+                handle_write_msg(evt, index, write_frame, read_message_cb);
             }
 #ifdef BLE_DEBUG
-            if (!matched && id == 0xFFFFFFFF) {
-                debug_msg(&evt, read_message_cb);
-                break;
+            if (!matched && !evt->msg.stream && id == 0xFFFFFFFF) {
+                debug_msg(evt, read_message_cb);
+                matched = true;
             }
 #endif
-            if (!matched && evt.msg.size <= 11) {
+            if (!matched && !evt->msg.stream && evt->msg.size <= 11) {
                 // allow anyways when it fits in a single frame
-                for (int i = evt.msg.size; i < 11; i++) {
-                    evt.msg.data[i] = 0;
+                for (int i = evt->msg.size; i < 11; i++) {
+                    evt->msg.data[i] = 0;
                 }
-                evt.msg.data[3] = evt.msg.size - 4;
-                write_frame(id, 8, evt.msg.data + 3);
+                evt->msg.data[3] = evt->msg.size - 4;
+                write_frame(id, 8, evt->msg.data + 3);
+            }
+            // NULL if a TX slot took it over
+            if (evt->msg.stream) {
+                // dropped, tell the producer to stop
+                atomic_store(&evt->msg.stream->done, true);
+                isotp_tx_stream_release(evt->msg.stream);
+            } else {
+                isotp_pool_free(evt->msg.data);
             }
             break;
         }
+        case EVENT_WRITE_STREAM:
+            if (evt->msg.time > isotp_tx.now) {
+                isotp_tx.now = evt->msg.time;
+            }
+            for (int i = 0; i < ISOTP_MAX_TX; i++) {
+                if (isotp_tx.slots[i].starved) {
+                    isotp_tx.slots[i].deadline = isotp_tx.now;
+                }
+            }
+            break;
         case EVENT_INCOMING_CAN: {
             debug_msg_log(read_message_cb, "Incoming frame...");
-            bool matched = false;
-            for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
-                bool is_active = isotp_addr_pairs[i].active;
-                bool id_match = is_active && (evt.can.id & 0x9FFFFFFF) == (isotp_addr_pairs[i].rxid & 0x9FFFFFFF);
-                bool id_ext_match = id_match && (!(isotp_addr_pairs[i].rxid & 0x40000000) || (isotp_addr_pairs[i].rxext == evt.can.data[0]));
-                if (id_ext_match) {
-                    matched = true;
-                    handle_read_can(&evt, i, write_frame, read_message_cb);
-                    break;
-                }
+            if (evt->can.time > isotp_tx.now) {
+                isotp_tx.now = evt->can.time;
             }
-            if (!matched) {
+            int index = isotp_pair_find_rx(evt->can.id, evt->can.data, evt->can.dlc);
+            if (index < 0) {
+                index = responder_open(evt);
+            }
+            if (index >= 0) {
+                handle_read_can(evt, index, write_frame, read_message_cb, rx_room);
+                responder_reap(index);
+            } else {
 #ifdef CAN_DEBUG
-                if (evt.can.id == 0x9FFFFFFF) {
-                    debug_frame(&evt, write_frame);
+                if (evt->can.id == 0x9FFFFFFF) {
+                    debug_frame(evt, write_frame);
                     break;
                 }
 #endif
-                unmatched_frame(evt.can.frame);
+                unmatched_frame(evt->can.id, evt->can.dlc, evt->can.data, evt->can.time);
             }
             break;
         }
+        case EVENT_TIMER:
+            isotp_tx.timer = INT64_MAX;
+            if (evt->timer.time > isotp_tx.now) {
+                isotp_tx.now = evt->timer.time;
+            }
+            break;
         case EVENT_SHUTDOWN:
+            // nothing left held, so the loop can be started again
+            pairs_clear();
+            pair_index_rebuild();
+            isotp_event_free(evt);
             return;
         }
+        isotp_event_free(evt);
+        if (pair_index_tombstones >= PAIR_INDEX_TOMBSTONE_MAX) {
+            pair_index_rebuild();
+        }
+        tx_service(write_frame, read_message_cb, rx_room, set_timer);
     }
 }
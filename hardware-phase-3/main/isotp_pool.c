@@ -0,0 +1,102 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "isotp_pool.h"
+
+_Static_assert(ISOTP_POOL_SMALL_COUNT <= 32 && ISOTP_POOL_LARGE_COUNT <= 32, "pool classes are tracked in a 32-bit mask");
+
+static uint8_t small_blocks[ISOTP_POOL_SMALL_COUNT][ISOTP_POOL_SMALL_SIZE];
+static uint8_t large_blocks[ISOTP_POOL_LARGE_COUNT][ISOTP_POOL_LARGE_SIZE];
+
+// set bits are free blocks
+static _Atomic uint32_t small_free = (uint32_t)((1ULL << ISOTP_POOL_SMALL_COUNT) - 1);
+static _Atomic uint32_t large_free = (uint32_t)((1ULL << ISOTP_POOL_LARGE_COUNT) - 1);
+
+// references to blocks in use, 0 for free ones
+static _Atomic uint8_t small_refs[ISOTP_POOL_SMALL_COUNT];
+static _Atomic uint8_t large_refs[ISOTP_POOL_LARGE_COUNT];
+
+// finds the class and number of a block, false if it is not from the pool
+static bool locate(const uint8_t* block, _Atomic uint32_t** free_mask, _Atomic uint8_t** refs, size_t* i) {
+    if (block >= small_blocks[0] && block < small_blocks[0] + sizeof(small_blocks)) {
+        *i = (block - small_blocks[0]) / ISOTP_POOL_SMALL_SIZE;
+        assert(block == small_blocks[*i]);
+        *free_mask = &small_free;
+        *refs = &small_refs[*i];
+        return true;
+    }
+    if (block >= large_blocks[0] && block < large_blocks[0] + sizeof(large_blocks)) {
+        *i = (block - large_blocks[0]) / ISOTP_POOL_LARGE_SIZE;
+        assert(block == large_blocks[*i]);
+        *free_mask = &large_free;
+        *refs = &large_refs[*i];
+        return true;
+    }
+    return false;
+}
+
+static int take(_Atomic uint32_t* free_mask) {
+    uint32_t mask = atomic_load(free_mask);
+    while (mask) {
+        int bit = __builtin_ctz(mask);
+        if (atomic_compare_exchange_weak(free_mask, &mask, mask & ~(1u << bit))) {
+            return bit;
+        }
+    }
+    return -1;
+}
+
+uint8_t* isotp_pool_alloc(size_t size) {
+    if (size <= ISOTP_POOL_SMALL_SIZE) {
+        int bit = take(&small_free);
+        if (bit >= 0) {
+            atomic_store(&small_refs[bit], 1);
+            return small_blocks[bit];
+        }
+    }
+    if (size <= ISOTP_POOL_LARGE_SIZE) {
+        // small messages may spill over into the large class
+        int bit = take(&large_free);
+        if (bit >= 0) {
+            atomic_store(&large_refs[bit], 1);
+            return large_blocks[bit];
+        }
+    }
+    return NULL;
+}
+
+uint8_t* isotp_pool_ref(const uint8_t* block) {
+    _Atomic uint32_t* free_mask;
+    _Atomic uint8_t* refs;
+    size_t i;
+    if (!block || !locate(block, &free_mask, &refs, &i)) {
+        return NULL;
+    }
+    uint8_t old = atomic_fetch_add(refs, 1);
+    assert(old > 0 && old < UINT8_MAX);
+    (void)old;
+    return (uint8_t*)block;
+}
+
+void isotp_pool_free(uint8_t* block) {
+    if (!block) {
+        return;
+    }
+    _Atomic uint32_t* free_mask;
+    _Atomic uint8_t* refs;
+    size_t i;
+    bool found = locate(block, &free_mask, &refs, &i);
+    assert(found);
+    (void)found;
+    uint8_t old_refs = atomic_fetch_sub(refs, 1);
+    assert(old_refs > 0);
+    if (old_refs > 1) {
+        return;
+    }
+    uint32_t old = atomic_fetch_or(free_mask, 1u << i);
+    assert(!(old & (1u << i)));
+    (void)old;
+}
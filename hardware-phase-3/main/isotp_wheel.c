@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "isotp_wheel.h"
+
+_Static_assert(ISOTP_WHEEL_SLOTS == 64, "occupied slots are tracked in a 64-bit mask");
+
+#define SLOT_MASK (ISOTP_WHEEL_SLOTS - 1)
+
+void isotp_wheel_init(struct isotp_wheel* wheel, int64_t now) {
+    assert(wheel);
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->tick = now >> ISOTP_WHEEL_SHIFT;
+}
+
+void isotp_wheel_arm(struct isotp_wheel* wheel, struct isotp_wheel_timer* timer, int64_t expires) {
+    assert(wheel);
+    assert(timer);
+    isotp_wheel_cancel(wheel, timer);
+    // the tick after the one it expires in, so it is never expired early
+    int64_t tick = (expires >> ISOTP_WHEEL_SHIFT) + 1;
+    if (tick <= wheel->tick) {
+        tick = wheel->tick + 1;
+    }
+    uint8_t slot = tick & SLOT_MASK;
+    timer->expires = expires;
+    timer->slot = slot;
+    timer->next = wheel->slots[slot];
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = &wheel->slots[slot];
+    wheel->slots[slot] = timer;
+    wheel->occupied |= 1ULL << slot;
+}
+
+void isotp_wheel_cancel(struct isotp_wheel* wheel, struct isotp_wheel_timer* timer) {
+    assert(wheel);
+    assert(timer);
+    if (!timer->pprev) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    if (!wheel->slots[timer->slot]) {
+        wheel->occupied &= ~(1ULL << timer->slot);
+    }
+}
+
+struct isotp_wheel_timer* isotp_wheel_expire(struct isotp_wheel* wheel, int64_t now) {
+    assert(wheel);
+    int64_t target = now >> ISOTP_WHEEL_SHIFT;
+    if (target - wheel->tick > ISOTP_WHEEL_SLOTS) {
+        // every slot gets looked at once, more rounds would not find more
+        wheel->tick = target - ISOTP_WHEEL_SLOTS;
+    }
+    while (wheel->tick < target) {
+        uint8_t slot = (wheel->tick + 1) & SLOT_MASK;
+        if (wheel->occupied & (1ULL << slot)) {
+            for (struct isotp_wheel_timer* timer = wheel->slots[slot]; timer; timer = timer->next) {
+                if (timer->expires <= now) {
+                    isotp_wheel_cancel(wheel, timer);
+                    return timer;
+                }
+            }
+        }
+        wheel->tick++;
+    }
+    return NULL;
+}
+
+int64_t isotp_wheel_next(const struct isotp_wheel* wheel) {
+    assert(wheel);
+    if (!wheel->occupied) {
+        return INT64_MAX;
+    }
+    unsigned start = (wheel->tick + 1) & SLOT_MASK;
+    uint64_t rotated = start ? (wheel->occupied >> start) | (wheel->occupied << (ISOTP_WHEEL_SLOTS - start)) : wheel->occupied;
+    return (wheel->tick + 1 + __builtin_ctzll(rotated)) << ISOTP_WHEEL_SHIFT;
+}
@@ -2,6 +2,10 @@
 #ifdef CONFIG_OMNITRIX_ENABLE_J2534
 
 #include <assert.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -11,9 +15,13 @@
 #include <omnitrix/j2534.h>
 #include <omnitrix/libcan.h>
 #include <omnitrix/libisotp.h>
+#include <omnitrix/libperiodic.h>
+#include <omnitrix/ring.h>
 #include <omnitrix/uuid.gen.h>
 
+#include "can_filter.h"
 #include "isotp.h"
+#include "isotp_pool.h"
 #include "j2534.pb-c.h"
 
 enum {
@@ -60,6 +68,17 @@ enum {
     ERR_INVALID_DEVICE_ID = 26,
 };
 
+enum {
+    ISO15765_FRAME_PAD = 0x40,
+    ISO15765_ADDR_TYPE = 0x80,
+    CAN_29BIT_ID = 0x100, // TxFlags and RxStatus
+};
+
+enum {
+    ISO15765_BS = 0x1E,
+    ISO15765_STMIN = 0x1F,
+};
+
 enum {
     CH_CAN_1 = 0x314e4143,
     CH_ISO15765_1 = 0x314f5349,
@@ -68,6 +87,227 @@ enum {
 
 static bool channels[2] = { 0 };
 
+// flow control parameters of the ISO15765 channels, given to their pairs
+static struct {
+    uint8_t bs;
+    uint8_t stmin;
+} iso_flow[2] = { 0 };
+
+static int iso_flow_index(uint32_t channel) {
+    switch (channel) {
+    case CH_ISO15765_1:
+        return 0;
+    case CH_ISO15765_2:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static bool channel_open(uint32_t channel) {
+    switch (channel) {
+    case CH_CAN_1:
+        return channels[0];
+    case CH_ISO15765_1:
+    case CH_ISO15765_2:
+        return channels[1];
+    default:
+        return false;
+    }
+}
+
+// Flow control filters of the ISO15765 channels, as the V3 records the
+// ISO-TP task got for them; filter IDs are indices plus one. The pairs
+// themselves belong to the ISO-TP task, which adds, updates and removes
+// them (and their CAN filters and transfers) on EVENT_*_PAIRS. Only the
+// control worker touches this.
+static struct {
+    uint32_t channel; // 0 if unused
+    uint8_t record[ISOTP_PAIRS_V3_RECORD_SIZE];
+} iso_filters[ISOTP_MAX_PAIRS];
+
+// how long a filter change waits for a free event or buffer
+#define PAIRS_POST_WAIT_MS 100
+
+// hands records to the ISO-TP task; false if it was too busy to take them
+static bool post_pairs(enum isotp_event_type type, uint32_t channel, const uint8_t* records, size_t size) {
+    TickType_t start = xTaskGetTickCount();
+    struct isotp_event* event = NULL;
+    uint8_t* data = NULL;
+    for (;;) {
+        event = event ? event : isotp_event_alloc();
+        data = data ? data : isotp_pool_alloc(size);
+        if (event && data) {
+            break;
+        }
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(PAIRS_POST_WAIT_MS)) {
+            isotp_event_free(event);
+            isotp_pool_free(data);
+            return false;
+        }
+        vTaskDelay(1);
+    }
+    memcpy(data, records, size);
+    event->type = type;
+    event->pairs.size = size;
+    event->pairs.data = data;
+    event->pairs.channel = channel;
+    // the queue holds every event there is
+    if (xQueueSend(isotp_event_queue_handle, &event, 0) != pdTRUE) {
+        isotp_event_free(event);
+        isotp_pool_free(data);
+        return false;
+    }
+    return true;
+}
+
+static bool release_iso_filter(int index) {
+    assert(index >= 0 && index < ISOTP_MAX_PAIRS);
+    if (!iso_filters[index].channel) {
+        return true;
+    }
+    if (!post_pairs(EVENT_REMOVE_PAIRS, iso_filters[index].channel, iso_filters[index].record, ISOTP_PAIRS_V3_RECORD_SIZE)) {
+        return false;
+    }
+    iso_filters[index].channel = 0;
+    return true;
+}
+
+// J2534 message IDs are the scheduler's plus one; each remembers its
+// channel and the address it sends to
+static struct {
+    uint32_t channel; // 0 if unused
+    uint32_t id; // bit 31 set for 29-bit IDs
+    int ext; // extended address, -1 without
+} periodic_msgs[OMNI_LIBPERIODIC_MAX] = { 0 };
+
+static void stop_periodics(uint32_t channel) {
+    for (int i = 0; i < OMNI_LIBPERIODIC_MAX; i++) {
+        if (periodic_msgs[i].channel == channel) {
+            omni_libperiodic_stop(i);
+            periodic_msgs[i].channel = 0;
+        }
+    }
+}
+
+// Frames for the CAN channel, straight from the CAN dispatcher, which
+// produces, to ReadMsgs on the CAN read lane, which consumes. Only frames
+// that get through the channel's filters are queued.
+#define CAN_READ_RING 256
+static struct twai_message_timestamp can_ring_storage[CAN_READ_RING];
+static struct omni_ring can_ring = OMNI_RING_INIT(can_ring_storage);
+static atomic_bool can_receiving = false;
+static atomic_uint can_overruns = 0; // frames lost since the last ReadMsgs
+// A ReadMsgs short of frames sleeps on can_ready; the dispatcher gives it
+// once can_wanted, the frames still missing, has counted down to zero.
+static StaticSemaphore_t can_ready_buffer;
+static SemaphoreHandle_t can_ready;
+static atomic_uint can_wanted = 0;
+
+// A ReadMsgs response takes as many frames as fit one notification, MTU - 3
+// bytes at the link's ATT MTU: the id, call and code fields take at most 10 bytes packed,
+// a message at most 27, for 8 bytes of a 29-bit frame and a 32-bit
+// timestamp. Never more than the ring holds.
+#define CAN_READ_HEADER_BYTES 10
+#define CAN_READ_MESSAGE_BYTES 27
+static atomic_uint can_read_mtu = 23; // as last seen by the CAN read lane; 23 until negotiated
+#define CAN_WRITE_WAIT_MS 100
+
+// Pass and block filters of the CAN channel; filter IDs are indices plus
+// one. The dispatcher matches against the compiled copy, which is swapped
+// under the lock whenever a filter comes or goes.
+static struct can_filter can_filters[CAN_FILTER_MAX] = { 0 };
+static struct can_filter_matcher can_matcher = { 0 };
+// when the channel was last connected; ReadMsgs skips older frames
+static int64_t can_epoch = 0;
+static portMUX_TYPE can_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void can_filters_changed(void) {
+    static struct can_filter_matcher next;
+    can_filter_compile(can_filters, CAN_FILTER_MAX, &next);
+    taskENTER_CRITICAL(&can_lock);
+    can_matcher = next;
+    taskEXIT_CRITICAL(&can_lock);
+}
+
+// how long StartFilter waits for the hardware filter to let the new IDs in
+#define FILTER_LIVE_WAIT_MS 100
+
+// pass filters open libcan's acceptance filter for their IDs, exactly or
+// under their ID mask
+static bool can_filter_register(const struct can_filter* filter) {
+    uint32_t width = filter->extd ? 0x1FFFFFFF : 0x7FF;
+    uint32_t mask = filter->id_mask & width;
+    bool ok = (mask == width) ? omni_libcan_add_filter(filter->id_pattern & mask, filter->extd)
+                              : omni_libcan_add_filter_mask(filter->id_pattern & mask, mask, filter->extd);
+    if (ok) {
+        omni_libcan_filter_wait(filter->id_pattern & mask, mask, filter->extd, pdMS_TO_TICKS(FILTER_LIVE_WAIT_MS));
+    }
+    return ok;
+}
+
+static void can_filter_unregister(const struct can_filter* filter) {
+    uint32_t width = filter->extd ? 0x1FFFFFFF : 0x7FF;
+    uint32_t mask = filter->id_mask & width;
+    if (mask == width) {
+        omni_libcan_remove_filter(filter->id_pattern & mask, filter->extd);
+    } else {
+        omni_libcan_remove_filter_mask(filter->id_pattern & mask, mask, filter->extd);
+    }
+}
+
+static void release_can_filter(int index) {
+    assert(index >= 0 && index < CAN_FILTER_MAX);
+    if (can_filters[index].type == CAN_FILTER_PASS) {
+        can_filter_unregister(&can_filters[index]);
+    }
+    can_filters[index].type = CAN_FILTER_UNUSED;
+}
+
+static void can_read_handler(struct twai_message_timestamp* msg) {
+    if (!atomic_load_explicit(&can_receiving, memory_order_relaxed)) {
+        return;
+    }
+    taskENTER_CRITICAL(&can_lock);
+    bool pass = can_filter_match(&can_matcher, msg->msg.identifier, msg->msg.extd, msg->msg.rtr ? 0 : msg->msg.data_length_code, msg->msg.data);
+    taskEXIT_CRITICAL(&can_lock);
+    if (!pass) {
+        return;
+    }
+    struct twai_message_timestamp* slot = omni_ring_acquire(&can_ring);
+    if (!slot) {
+        atomic_fetch_add_explicit(&can_overruns, 1, memory_order_relaxed);
+        return;
+    }
+    *slot = *msg;
+    omni_ring_publish(&can_ring);
+    unsigned wanted = atomic_load(&can_wanted);
+    while (wanted && !atomic_compare_exchange_weak(&can_wanted, &wanted, wanted - 1)) {
+    }
+    if (wanted == 1) {
+        xSemaphoreGive(can_ready);
+    }
+}
+
+// Frames left over from before a reconnect are dropped by the reader, not
+// here: only the consumer may move the tail, and ReadMsgs runs on a task
+// of its own.
+static void can_open(void) {
+    taskENTER_CRITICAL(&can_lock);
+    can_epoch = esp_timer_get_time();
+    taskEXIT_CRITICAL(&can_lock);
+    atomic_store(&can_overruns, 0);
+    atomic_store(&can_receiving, true);
+}
+
+static void can_close(void) {
+    atomic_store(&can_receiving, false);
+    for (int i = 0; i < CAN_FILTER_MAX; i++) {
+        release_can_filter(i);
+    }
+    can_filters_changed();
+}
+
 struct mem {
     void* buf;
     uint16_t len;
@@ -99,6 +339,9 @@ static struct mem process_connect(uint8_t* inbuf, size_t insz) {
     res->call = CALL__Connect;
     switch (req->protocol) {
     case CAN:
+        if (!channels[0]) {
+            can_open();
+        }
         res->code = STATUS_NOERROR;
         res->channel = CH_CAN_1;
         channels[0] = true;
@@ -106,17 +349,21 @@ static struct mem process_connect(uint8_t* inbuf, size_t insz) {
     case ISO15765:
         if (channels[1]) {
             for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
-                isotp_addr_pairs[i].active = false;
+                release_iso_filter(i);
             }
         }
         res->code = STATUS_NOERROR;
         res->channel = CH_ISO15765_1;
         channels[1] = true;
+        iso_flow[0].bs = 0;
+        iso_flow[0].stmin = 0;
         break;
     case ISO15765_PS:
         res->code = STATUS_NOERROR;
         res->channel = CH_ISO15765_2;
         channels[1] = true;
+        iso_flow[1].bs = 0;
+        iso_flow[1].stmin = 0;
         break;
     default:
         if (req->protocol && req->protocol < 11) {
@@ -144,6 +391,8 @@ static struct mem process_disconnect(uint8_t* inbuf, size_t insz) {
     switch (req->channel) {
     case CH_CAN_1:
         if (channels[0]) {
+            stop_periodics(CH_CAN_1);
+            can_close();
             res->code = STATUS_NOERROR;
             channels[0] = false;
         } else {
@@ -153,8 +402,10 @@ static struct mem process_disconnect(uint8_t* inbuf, size_t insz) {
     case CH_ISO15765_1:
         if (channels[1]) {
             for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
-                isotp_addr_pairs[i].active = false;
+                release_iso_filter(i);
             }
+            stop_periodics(CH_ISO15765_1);
+            stop_periodics(CH_ISO15765_2);
             res->code = STATUS_NOERROR;
             channels[1] = false;
         } else {
@@ -162,6 +413,7 @@ static struct mem process_disconnect(uint8_t* inbuf, size_t insz) {
         }
         break;
     case CH_ISO15765_2:
+        stop_periodics(CH_ISO15765_2);
         res->code = STATUS_NOERROR;
         break;
     default:
@@ -173,6 +425,12 @@ static struct mem process_disconnect(uint8_t* inbuf, size_t insz) {
     PACK_AND_RETURN(base);
 }
 
+// messages per ReadMsgs response, and the bytes they may take packed, with
+// a generous allowance for the fields around the data
+#define ISO_READ_BATCH 32
+#define ISO_READ_BYTES 60000
+#define ISO_READ_OVERHEAD 32
+
 static struct isotp_msg isotp_msg_queue_storage[8];
 static StaticQueue_t isotp_msg_queue_buffer;
 static QueueHandle_t isotp_msg_queue_handle;
@@ -181,52 +439,182 @@ static struct isotp_msg isotp_ps_msg_queue_storage[8];
 static StaticQueue_t isotp_ps_msg_queue_buffer;
 static QueueHandle_t isotp_ps_msg_queue_handle;
 
-static void isotp_read_handler(struct isotp_msg* msg) {
-    // TODO: remove queues; notify instead
-    if (msg->channel == CH_ISO15765_2) {
-        xQueueSend(isotp_ps_msg_queue_handle, msg, 0);
-    } else {
-        xQueueSend(isotp_msg_queue_handle, msg, 0);
+// queued messages hold a reference to their pool block, handed on to the response
+static bool queue_msg(QueueHandle_t queue, struct isotp_msg* msg) {
+    struct isotp_msg ref = *msg;
+    ref.data = isotp_pool_ref(msg->data);
+    assert(ref.data);
+    if (xQueueSend(queue, &ref, pdMS_TO_TICKS(OMNI_LIBISOTP_HANDLER_WAIT_MS)) != pdTRUE) {
+        isotp_pool_free(ref.data);
+        return false;
     }
+    return true;
+}
+
+static bool isotp_read_handler(struct isotp_msg* msg) {
+    // TODO: remove queues; notify instead
+    return queue_msg(isotp_msg_queue_handle, msg);
 }
 
+static bool isotp_ps_read_handler(struct isotp_msg* msg) {
+    return queue_msg(isotp_ps_msg_queue_handle, msg);
+}
+
+static size_t isotp_room(void) {
+    return uxQueueSpacesAvailable(isotp_msg_queue_handle);
+}
+
+static size_t isotp_ps_room(void) {
+    return uxQueueSpacesAvailable(isotp_ps_msg_queue_handle);
+}
+
+// A ReadMsgs timeout in ticks, rounded up: pdMS_TO_TICKS rounds down, which
+// would turn one shorter than a tick into no wait at all.
+static TickType_t read_timeout(uint32_t ms) {
+    return (TickType_t)(((uint64_t)ms * configTICK_RATE_HZ + 999) / 1000);
+}
+
+// ticks left until a ReadMsgs deadline, 0 once it has passed
+static TickType_t read_wait(TickType_t start, TickType_t timeout) {
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    return (elapsed < timeout) ? timeout - elapsed : 0;
+}
+
+// Whatever is queued is taken at once; only an empty queue is waited on,
+// and the whole batch shares one deadline. The messages and their structs
+// come in one allocation, the data stays in its pool blocks.
 static void read_iso(ReadRequest* req, ReadResponse* res) {
+    QueueHandle_t queue = (req->channel == CH_ISO15765_2) ? isotp_ps_msg_queue_handle : isotp_msg_queue_handle;
+    size_t max = (req->num < ISO_READ_BATCH) ? req->num : ISO_READ_BATCH;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = read_timeout(req->timeout);
+    Message** msgs = malloc(max * (sizeof(Message*) + sizeof(Message)));
+    assert(msgs || !max);
+    Message* slots = (Message*)(msgs + max);
     size_t count = 0;
-    Message** msgs = malloc(sizeof(Message*) * req->num);
-    assert(msgs);
-    for (count = 0; count < req->num; count++) {
-        msgs[count] = NULL;
-    }
-    res->code = STATUS_NOERROR;
-    for (count = 0; count < req->num; count++) {
+    size_t bytes = 0;
+    bool full = false;
+    while (count < max) {
         struct isotp_msg msg;
-        BaseType_t r;
-        if (req->channel == CH_ISO15765_2) {
-            r = xQueueReceive(isotp_ps_msg_queue_handle, &msg, pdMS_TO_TICKS(100));
-        } else {
-            r = xQueueReceive(isotp_msg_queue_handle, &msg, pdMS_TO_TICKS(100));
-        }
-        if (r == pdTRUE) {
-            // TODO: use timeouts correctly
-            msgs[count] = malloc(sizeof(Message));
-            assert(msgs[count]);
-            message__init(msgs[count]);
-            msgs[count]->protocol = 6;
-            msgs[count]->data.len = msg.size;
-            msgs[count]->data.data = malloc(msg.size);
-            assert(msgs[count]->data.data);
-            memcpy(msgs[count]->data.data, msg.data, msg.size);
-        } else {
-            res->code = ERR_TIMEOUT;
+        if (xQueuePeek(queue, &msg, read_wait(start, timeout)) != pdTRUE) {
+            break;
+        }
+        if (count && bytes + msg.size + ISO_READ_OVERHEAD > ISO_READ_BYTES) {
+            // left for the next ReadMsgs
+            full = true;
             break;
         }
+        xQueueReceive(queue, &msg, 0);
+        message__init(&slots[count]);
+        slots[count].protocol = ISO15765;
+        slots[count].rx_status = msg.flags;
+        // J2534 timestamps are 32-bit microseconds and wrap
+        slots[count].timestamp = (uint32_t)msg.time;
+        slots[count].data.len = msg.size;
+        slots[count].data.data = msg.data;
+        msgs[count] = &slots[count];
+        bytes += msg.size + ISO_READ_OVERHEAD;
+        count++;
     }
-    if (count != 0) {
-        res->messages = msgs;
-        res->n_messages = count;
-    } else {
-        res->code = ERR_BUFFER_EMPTY;
+    if (!count) {
         free(msgs);
+        res->code = ERR_BUFFER_EMPTY;
+        return;
+    }
+    res->messages = msgs;
+    res->n_messages = count;
+    res->code = (count < max && !full && timeout) ? ERR_TIMEOUT : STATUS_NOERROR;
+}
+
+// up to max frames from the ring, after dropping those from an earlier connection
+static size_t can_peek(size_t max) {
+    taskENTER_CRITICAL(&can_lock);
+    int64_t epoch = can_epoch;
+    taskEXIT_CRITICAL(&can_lock);
+    size_t stale = 0;
+    while (omni_ring_peek(&can_ring, stale + 1) > stale && ((const struct twai_message_timestamp*)omni_ring_at(&can_ring, stale))->time < epoch) {
+        stale++;
+    }
+    omni_ring_release(&can_ring, stale);
+    return omni_ring_peek(&can_ring, max);
+}
+
+static size_t can_read_batch(void) {
+    size_t room = atomic_load(&can_read_mtu) - 3;
+    if (room < CAN_READ_HEADER_BYTES + CAN_READ_MESSAGE_BYTES) {
+        return 1;
+    }
+    size_t batch = (room - CAN_READ_HEADER_BYTES) / CAN_READ_MESSAGE_BYTES;
+    return (batch < CAN_READ_RING) ? batch : CAN_READ_RING;
+}
+
+// Sleeps until the ring holds max frames or the wait is over. The ring is
+// counted again after each store to can_wanted, until no frame came in
+// between, so none goes uncounted.
+static size_t can_wait(size_t max, TickType_t start, TickType_t timeout) {
+    size_t count = can_peek(max);
+    TickType_t wait;
+    while (count < max && (wait = read_wait(start, timeout))) {
+        // a give left over from an earlier wait
+        xSemaphoreTake(can_ready, 0);
+        size_t seen;
+        do {
+            seen = count;
+            atomic_store(&can_wanted, max - seen);
+            count = can_peek(max);
+        } while (count != seen && count < max);
+        if (count < max) {
+            xSemaphoreTake(can_ready, wait);
+        }
+        atomic_store(&can_wanted, 0);
+        count = can_peek(max);
+    }
+    return count;
+}
+
+// like read_iso, but frames are copied out of the ring
+static void read_can(ReadRequest* req, ReadResponse* res) {
+    size_t batch = can_read_batch();
+    size_t max = (req->num < batch) ? req->num : batch;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = read_timeout(req->timeout);
+    size_t count = can_wait(max, start, timeout);
+    if (!count) {
+        res->code = ERR_BUFFER_EMPTY;
+        return;
+    }
+    struct can_message {
+        Message msg;
+        uint8_t data[12];
+    };
+    Message** msgs = malloc(count * (sizeof(Message*) + sizeof(struct can_message)));
+    assert(msgs);
+    struct can_message* slots = (struct can_message*)(msgs + count);
+    for (size_t i = 0; i < count; i++) {
+        const struct twai_message_timestamp* frame = omni_ring_at(&can_ring, i);
+        uint32_t id = frame->msg.identifier;
+        uint8_t dlc = frame->msg.rtr ? 0 : (frame->msg.data_length_code > 8) ? 8 : frame->msg.data_length_code;
+        message__init(&slots[i].msg);
+        slots[i].msg.protocol = CAN;
+        slots[i].msg.rx_status = frame->msg.extd ? CAN_29BIT_ID : 0;
+        // J2534 timestamps are 32-bit microseconds and wrap
+        slots[i].msg.timestamp = (uint32_t)frame->time;
+        slots[i].data[0] = id >> 24;
+        slots[i].data[1] = id >> 16;
+        slots[i].data[2] = id >> 8;
+        slots[i].data[3] = id;
+        memcpy(slots[i].data + 4, frame->msg.data, dlc);
+        slots[i].msg.data.len = 4 + dlc;
+        slots[i].msg.data.data = slots[i].data;
+        msgs[i] = &slots[i].msg;
+    }
+    omni_ring_release(&can_ring, count);
+    res->messages = msgs;
+    res->n_messages = count;
+    if (atomic_exchange(&can_overruns, 0)) {
+        res->code = ERR_BUFFER_OVERFLOW;
+    } else {
+        res->code = (count < max && timeout) ? ERR_TIMEOUT : STATUS_NOERROR;
     }
 }
 
@@ -243,7 +631,7 @@ static struct mem process_read(uint8_t* inbuf, size_t insz) {
     switch (req->channel) {
     case CH_CAN_1:
         if (channels[0]) {
-            res->code = ERR_NOT_SUPPORTED;
+            read_can(req, res);
         } else {
             res->code = ERR_INVALID_CHANNEL_ID;
         }
@@ -260,6 +648,7 @@ static struct mem process_read(uint8_t* inbuf, size_t insz) {
         res->code = ERR_INVALID_CHANNEL_ID;
         break;
     }
+    uint32_t channel = req->channel;
     read_request__free_unpacked(req, NULL);
 
     size_t sz = read_response__get_packed_size(res);
@@ -270,28 +659,43 @@ static struct mem process_read(uint8_t* inbuf, size_t insz) {
         result.len = sz;
         read_response__pack(res, result.buf);
     }
-    if (res->messages) {
+    if (res->messages && channel != CH_CAN_1) {
         for (size_t i = 0; i < res->n_messages; i++) {
-            if (res->messages[i]) {
-                if (res->messages[i]->data.data) {
-                    free(res->messages[i]->data.data);
-                }
-                free(res->messages[i]);
-            }
+            // pool blocks from the ISO-TP queues
+            isotp_pool_free(res->messages[i]->data.data);
         }
-        free(res->messages);
     }
+    free(res->messages);
     free(res);
     return result;
 }
 
 static void write_iso(WriteRequest* req, WriteResponse* res) {
-    static struct isotp_event event;
     for (size_t i = 0; i < req->n_messages; i++) {
-        event.type = EVENT_WRITE_MSG;
-        event.msg.size = req->messages[i]->data.len;
-        memcpy(event.msg.data, req->messages[i]->data.data, event.msg.size);
+        size_t size = req->messages[i]->data.len;
+        if (size < 5 || size > ISOTP_MAX_MSG_SIZE) {
+            res->code = ERR_INVALID_MSG;
+            res->num = i;
+            return;
+        }
+        struct isotp_event* event = isotp_event_alloc();
+        uint8_t* data = isotp_pool_alloc(size);
+        if (!event || !data) {
+            isotp_event_free(event);
+            isotp_pool_free(data);
+            res->code = ERR_BUFFER_FULL;
+            res->num = i;
+            return;
+        }
+        memcpy(data, req->messages[i]->data.data, size);
+        event->type = EVENT_WRITE_MSG;
+        event->msg.size = size;
+        event->msg.time = esp_timer_get_time();
+        event->msg.data = data;
+        event->msg.stream = NULL;
         if (xQueueSend(isotp_event_queue_handle, &event, 0) != pdTRUE) {
+            isotp_event_free(event);
+            isotp_pool_free(data);
             res->code = ERR_BUFFER_FULL;
             res->num = i + 1;
             return;
@@ -301,6 +705,71 @@ static void write_iso(WriteRequest* req, WriteResponse* res) {
     res->num = req->n_messages;
 }
 
+// a CAN channel message: 4-byte ID, then up to 8 data bytes
+static bool can_frame(const Message* msg, twai_message_t* frame) {
+    bool extd = (msg->tx_flags & CAN_29BIT_ID) != 0;
+    if (msg->data.len < 4 || msg->data.len > 12) {
+        return false;
+    }
+    uint32_t id = ((uint32_t)msg->data.data[0] << 24) | (msg->data.data[1] << 16) | (msg->data.data[2] << 8) | msg->data.data[3];
+    if (id > (extd ? 0x1FFFFFFF : 0x7FF)) {
+        return false;
+    }
+    memset(frame, 0, sizeof(*frame));
+    frame->extd = extd;
+    frame->identifier = id;
+    frame->data_length_code = msg->data.len - 4;
+    memcpy(frame->data, msg->data.data + 4, msg->data.len - 4);
+    return true;
+}
+
+// an ISO15765 channel message that fits a single frame: 4-byte ID, the
+// extended address with ISO15765_ADDR_TYPE, then the payload
+static bool iso_single_frame(const Message* msg, twai_message_t* frame) {
+    size_t addr = (msg->tx_flags & ISO15765_ADDR_TYPE) ? 5 : 4;
+    if (msg->data.len <= addr || msg->data.len > 11) {
+        return false;
+    }
+    Message can = *msg;
+    uint8_t data[12];
+    size_t payload = msg->data.len - addr;
+    memcpy(data, msg->data.data, addr);
+    data[addr] = payload;
+    memcpy(data + addr + 1, msg->data.data + addr, payload);
+    can.data.len = addr + 1 + payload;
+    if (msg->tx_flags & ISO15765_FRAME_PAD) {
+        memset(data + can.data.len, 0, sizeof(data) - can.data.len);
+        can.data.len = sizeof(data);
+    }
+    can.data.data = data;
+    return can_frame(&can, frame);
+}
+
+// into the driver's TX queue, waiting a little whenever the bulk share of it
+// is taken
+static void write_can(WriteRequest* req, WriteResponse* res) {
+    for (size_t i = 0; i < req->n_messages; i++) {
+        twai_message_t frame;
+        if (!can_frame(req->messages[i], &frame)) {
+            res->code = ERR_INVALID_MSG;
+            res->num = i;
+            return;
+        }
+        esp_err_t result;
+        TickType_t start = xTaskGetTickCount();
+        while ((result = omni_libcan_transmit_bulk(&frame, NULL)) == ESP_ERR_TIMEOUT && xTaskGetTickCount() - start < pdMS_TO_TICKS(CAN_WRITE_WAIT_MS)) {
+            vTaskDelay(1);
+        }
+        if (result != ESP_OK) {
+            res->code = ERR_BUFFER_FULL;
+            res->num = i;
+            return;
+        }
+    }
+    res->code = STATUS_NOERROR;
+    res->num = req->n_messages;
+}
+
 static struct mem process_write(uint8_t* inbuf, size_t insz) {
     assert(inbuf);
     struct WriteRequest* req = write_request__unpack(NULL, insz, inbuf);
@@ -314,7 +783,7 @@ static struct mem process_write(uint8_t* inbuf, size_t insz) {
     switch (req->channel) {
     case CH_CAN_1:
         if (channels[0]) {
-            res->code = ERR_NOT_SUPPORTED;
+            write_can(req, res);
         } else {
             res->code = ERR_INVALID_CHANNEL_ID;
         }
@@ -336,25 +805,66 @@ static struct mem process_write(uint8_t* inbuf, size_t insz) {
     PACK_AND_RETURN(write);
 }
 
+// Starting a message for an address that already has one on the channel
+// replaces it in place, under the same message ID. The scheduler keeps its
+// phase, so changing a keep-alive's interval or data neither doubles nor
+// skips a frame.
+static void start_periodic(StartPeriodicRequest* req, StartPeriodicResponse* res) {
+    twai_message_t frame;
+    bool iso = req->channel != CH_CAN_1;
+    if (!(iso ? iso_single_frame(req->message, &frame) : can_frame(req->message, &frame))) {
+        res->code = ERR_INVALID_MSG;
+        return;
+    }
+    uint32_t id = frame.identifier | (frame.extd ? 0x80000000 : 0);
+    int ext = (iso && (req->message->tx_flags & ISO15765_ADDR_TYPE)) ? req->message->data.data[4] : -1;
+    for (int i = 0; i < OMNI_LIBPERIODIC_MAX; i++) {
+        if (periodic_msgs[i].channel == req->channel && periodic_msgs[i].id == id && periodic_msgs[i].ext == ext) {
+            omni_libperiodic_update(i, &frame, req->interval * 1000);
+            res->code = STATUS_NOERROR;
+            res->message_id = i + 1;
+            return;
+        }
+    }
+    int index = omni_libperiodic_start(&frame, req->interval * 1000);
+    if (index < 0) {
+        res->code = ERR_EXCEEDED_LIMIT;
+        return;
+    }
+    periodic_msgs[index].channel = req->channel;
+    periodic_msgs[index].id = id;
+    periodic_msgs[index].ext = ext;
+    res->code = STATUS_NOERROR;
+    res->message_id = index + 1;
+}
+
 static struct mem process_start_periodic(uint8_t* inbuf, size_t insz) {
     assert(inbuf);
-    struct BaseRequest* req = base_request__unpack(NULL, insz, inbuf);
+    struct StartPeriodicRequest* req = start_periodic_request__unpack(NULL, insz, inbuf);
     assert(req);
     assert(req->call == CALL__StartPeriodic);
 
-    struct BaseResponse* res = malloc(sizeof(struct BaseResponse));
-    base_response__init(res);
+    struct StartPeriodicResponse* res = malloc(sizeof(struct StartPeriodicResponse));
+    start_periodic_response__init(res);
     res->id = req->id;
     res->call = CALL__StartPeriodic;
-    res->code = ERR_NOT_SUPPORTED;
-    base_request__free_unpacked(req, NULL);
+    if (!channel_open(req->channel)) {
+        res->code = ERR_INVALID_CHANNEL_ID;
+    } else if (!req->message) {
+        res->code = ERR_NULL_PARAMETER;
+    } else if (req->interval < 5 || req->interval > 65535) {
+        res->code = ERR_INVALID_TIME_INTERVAL;
+    } else {
+        start_periodic(req, res);
+    }
+    start_periodic_request__free_unpacked(req, NULL);
 
-    PACK_AND_RETURN(base);
+    PACK_AND_RETURN(start_periodic);
 }
 
 static struct mem process_stop_periodic(uint8_t* inbuf, size_t insz) {
     assert(inbuf);
-    struct BaseRequest* req = base_request__unpack(NULL, insz, inbuf);
+    struct StopPeriodicRequest* req = stop_periodic_request__unpack(NULL, insz, inbuf);
     assert(req);
     assert(req->call == CALL__StopPeriodic);
 
@@ -362,71 +872,156 @@ static struct mem process_stop_periodic(uint8_t* inbuf, size_t insz) {
     base_response__init(res);
     res->id = req->id;
     res->call = CALL__StopPeriodic;
-    res->code = ERR_NOT_SUPPORTED;
-    base_request__free_unpacked(req, NULL);
+    if (!channel_open(req->channel)) {
+        res->code = ERR_INVALID_CHANNEL_ID;
+    } else if (req->message_id - 1 < OMNI_LIBPERIODIC_MAX && periodic_msgs[req->message_id - 1].channel == req->channel) {
+        omni_libperiodic_stop(req->message_id - 1);
+        periodic_msgs[req->message_id - 1].channel = 0;
+        res->code = STATUS_NOERROR;
+    } else {
+        res->code = ERR_INVALID_MESSAGE_ID;
+    }
+    stop_periodic_request__free_unpacked(req, NULL);
 
     PACK_AND_RETURN(base);
 }
 
+// mask and pattern: 4-byte ID, then up to 8 data bytes to compare
 static void start_filter_can(StartFilterRequest* req, StartFilterResponse* res) {
-    (void)req;
-    (void)res;
-    switch (req->filter_type) {
-    case 1:
-        res->code = ERR_NOT_SUPPORTED;
-        break;
-    case 2:
-        res->code = ERR_NOT_SUPPORTED;
-        break;
-    default:
+    if (req->filter_type != CAN_FILTER_PASS && req->filter_type != CAN_FILTER_BLOCK) {
         res->code = ERR_INVALID_FILTER_ID;
+        return;
+    }
+    if (!req->mask || !req->pattern) {
+        res->code = ERR_NULL_PARAMETER;
+        return;
+    }
+    const Message* mask = req->mask;
+    const Message* pattern = req->pattern;
+    if (mask->data.len != pattern->data.len || mask->data.len < 4 || mask->data.len > 12 || ((mask->tx_flags ^ pattern->tx_flags) & CAN_29BIT_ID)) {
+        res->code = ERR_INVALID_MSG;
+        return;
     }
+    int index = -1;
+    for (int i = 0; i < CAN_FILTER_MAX; i++) {
+        if (can_filters[i].type == CAN_FILTER_UNUSED) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0) {
+        res->code = ERR_EXCEEDED_LIMIT;
+        return;
+    }
+    struct can_filter filter = {
+        .type = req->filter_type,
+        .extd = (mask->tx_flags & CAN_29BIT_ID) != 0,
+        .id_mask = ((uint32_t)mask->data.data[0] << 24) | (mask->data.data[1] << 16) | (mask->data.data[2] << 8) | mask->data.data[3],
+        .id_pattern = ((uint32_t)pattern->data.data[0] << 24) | (pattern->data.data[1] << 16) | (pattern->data.data[2] << 8) | pattern->data.data[3],
+        .data_len = mask->data.len - 4,
+    };
+    memcpy(filter.data_mask, mask->data.data + 4, filter.data_len);
+    memcpy(filter.data_pattern, pattern->data.data + 4, filter.data_len);
+    if (filter.type == CAN_FILTER_PASS && !can_filter_register(&filter)) {
+        // libcan is out of room for masks
+        res->code = ERR_EXCEEDED_LIMIT;
+        return;
+    }
+    can_filters[index] = filter;
+    can_filters_changed();
+    res->filter_id = index + 1;
+    res->code = STATUS_NOERROR;
 }
 
+// pattern and flow control: 4-byte ID, then the extended address with ISO15765_ADDR_TYPE
 static void start_filter_iso(StartFilterRequest* req, StartFilterResponse* res, uint32_t channel) {
-    (void)req;
-    (void)res;
-    if (req->filter_type == 3) {
-        bool valid = req->pattern->tx_flags == req->flow_control->tx_flags
-            && req->pattern->data.len == req->flow_control->data.len
-            && req->pattern->data.len == ((req->pattern->tx_flags & 128) ? 5 : 4);
-        if (valid) {
-            for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
-                if (!isotp_addr_pairs[i].active) {
-                    isotp_addr_pairs[i].active = true;
-                    isotp_addr_pairs[i].txid
-                        = (req->flow_control->data.data[0] << 24)
-                        | (req->flow_control->data.data[1] << 16)
-                        | (req->flow_control->data.data[2] << 8)
-                        | req->flow_control->data.data[3]
-                        | ((req->flow_control->tx_flags & 128) << 23)
-                        | 0x20000000; // enable padding
-                    isotp_addr_pairs[i].rxid
-                        = (req->pattern->data.data[0] << 24)
-                        | (req->pattern->data.data[1] << 16)
-                        | (req->pattern->data.data[2] << 8)
-                        | req->pattern->data.data[3]
-                        | ((req->pattern->tx_flags & 128) << 23)
-                        | 0x20000000; // enable padding
-                    isotp_addr_pairs[i].txext = (req->flow_control->tx_flags & 128) ? req->flow_control->data.data[4] : 0;
-                    isotp_addr_pairs[i].txpad = 0;
-                    isotp_addr_pairs[i].rxext = (req->pattern->tx_flags & 128) ? req->pattern->data.data[4] : 0;
-                    isotp_addr_pairs[i].rxpad = 0;
-                    isotp_addr_pairs[i].channel = channel;
-                    res->filter_id = i + 1;
-                    omni_libcan_add_filter(isotp_addr_pairs[i].rxid & 0x1FFFFFFF, (isotp_addr_pairs[i].rxid & 0x80000000) != 0);
-                    goto out;
-                }
-            }
-            res->code = ERR_EXCEEDED_LIMIT;
+    if (req->filter_type != 3) {
+        res->code = ERR_INVALID_FILTER_ID;
+        return;
+    }
+    if (!req->pattern || !req->flow_control) {
+        res->code = ERR_NULL_PARAMETER;
+        return;
+    }
+    const Message* pattern = req->pattern;
+    const Message* flow_control = req->flow_control;
+    bool ext = (pattern->tx_flags & ISO15765_ADDR_TYPE) != 0;
+    if (pattern->tx_flags != flow_control->tx_flags || pattern->data.len != flow_control->data.len || pattern->data.len != (ext ? 5 : 4)) {
+        res->code = ERR_INVALID_MSG;
+        return;
+    }
+    // see EVENT_RECONFIGURE_PAIRS; 0x20 in the ID enables padding
+    uint8_t record[ISOTP_PAIRS_V3_RECORD_SIZE] = {
+        flow_control->data.data[0] | (ext ? 0x60 : 0x20),
+        flow_control->data.data[1],
+        flow_control->data.data[2],
+        flow_control->data.data[3],
+        ext ? flow_control->data.data[4] : 0,
+        0,
+        pattern->data.data[0] | (ext ? 0x60 : 0x20),
+        pattern->data.data[1],
+        pattern->data.data[2],
+        pattern->data.data[3],
+        ext ? pattern->data.data[4] : 0,
+        0,
+        iso_flow[iso_flow_index(channel)].bs,
+        iso_flow[iso_flow_index(channel)].stmin,
+        0, // ReadMsgs only returns whole messages
+    };
+    int index = -1;
+    for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
+        if (!iso_filters[i].channel) {
+            index = (index < 0) ? i : index;
+        } else if (iso_filters[i].channel == channel && !memcmp(iso_filters[i].record, record, 5) && !memcmp(iso_filters[i].record + 6, record + 6, 5)) {
+            // the ISO-TP task would take it for the same pair
+            res->code = ERR_NOT_UNIQUE;
             return;
-        out:
-            res->code = STATUS_NOERROR;
-        } else {
-            res->code = ERR_INVALID_MSG;
         }
-    } else {
-        res->code = ERR_INVALID_FILTER_ID;
+    }
+    if (index < 0) {
+        res->code = ERR_EXCEEDED_LIMIT;
+        return;
+    }
+    if (!post_pairs(EVENT_ADD_PAIRS, channel, record, sizeof(record))) {
+        res->code = ERR_FAILED;
+        return;
+    }
+    iso_filters[index].channel = channel;
+    memcpy(iso_filters[index].record, record, sizeof(record));
+    uint32_t rxid = ((uint32_t)pattern->data.data[0] << 24) | (pattern->data.data[1] << 16) | (pattern->data.data[2] << 8) | pattern->data.data[3];
+    omni_libcan_filter_wait(rxid & 0x1FFFFFFF, 0x1FFFFFFF, (rxid & 0x80000000) != 0, pdMS_TO_TICKS(FILTER_LIVE_WAIT_MS));
+    res->filter_id = index + 1;
+    res->code = STATUS_NOERROR;
+}
+
+// sends the records of every filter on channel again, with the channel's BS and STmin
+static bool update_iso_filters(uint32_t channel) {
+    static uint8_t records[ISOTP_MAX_PAIRS * ISOTP_PAIRS_V3_RECORD_SIZE];
+    int flow = iso_flow_index(channel);
+    size_t size = 0;
+    for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
+        if (iso_filters[i].channel == channel) {
+            iso_filters[i].record[12] = iso_flow[flow].bs;
+            iso_filters[i].record[13] = iso_flow[flow].stmin;
+            memcpy(records + size, iso_filters[i].record, ISOTP_PAIRS_V3_RECORD_SIZE);
+            size += ISOTP_PAIRS_V3_RECORD_SIZE;
+        }
+    }
+    return !size || post_pairs(EVENT_UPDATE_PAIRS, channel, records, size);
+}
+
+static void clear_filters(uint32_t channel) {
+    if (channel == CH_CAN_1) {
+        for (int i = 0; i < CAN_FILTER_MAX; i++) {
+            release_can_filter(i);
+        }
+        can_filters_changed();
+        return;
+    }
+    for (int i = 0; i < ISOTP_MAX_PAIRS; i++) {
+        if (iso_filters[i].channel == channel) {
+            release_iso_filter(i);
+        }
     }
 }
 
@@ -469,13 +1064,18 @@ static struct mem process_stop_filter(uint8_t* inbuf, size_t insz) {
     res->call = CALL__StopFilter;
     switch (req->channel) {
     case CH_CAN_1:
-        res->code = ERR_INVALID_FILTER_ID;
+        if (req->filter_id - 1 < CAN_FILTER_MAX && can_filters[req->filter_id - 1].type != CAN_FILTER_UNUSED) {
+            release_can_filter(req->filter_id - 1);
+            can_filters_changed();
+            res->code = STATUS_NOERROR;
+        } else {
+            res->code = ERR_INVALID_FILTER_ID;
+        }
         break;
     case CH_ISO15765_1:
     case CH_ISO15765_2:
-        if (req->filter_id - 1 < ISOTP_MAX_PAIRS && isotp_addr_pairs[req->filter_id - 1].active) {
-            isotp_addr_pairs[req->filter_id - 1].active = false;
-            res->code = STATUS_NOERROR;
+        if (req->filter_id - 1 < ISOTP_MAX_PAIRS && iso_filters[req->filter_id - 1].channel == req->channel) {
+            res->code = release_iso_filter(req->filter_id - 1) ? STATUS_NOERROR : ERR_FAILED;
         } else {
             res->code = ERR_INVALID_FILTER_ID;
         }
@@ -563,8 +1163,17 @@ static struct mem process_ioctl_get_config(uint8_t* inbuf, size_t insz) {
     res->n_config = req->n_config;
     res->config = req->config;
 
+    int flow = iso_flow_index(req->channel);
     for (size_t i = 0; i < res->n_config; i++) {
         res->config[i]->value = 0;
+        if (flow >= 0 && res->config[i]->parameter == ISO15765_BS) {
+            res->config[i]->value = iso_flow[flow].bs;
+            continue;
+        }
+        if (flow >= 0 && res->config[i]->parameter == ISO15765_STMIN) {
+            res->config[i]->value = iso_flow[flow].stmin;
+            continue;
+        }
         for (int j = 0; j < sizeof(config) / sizeof(config[0]); j++) {
             if (config[j].active && res->config[i]->parameter == config[j].parameter) {
                 res->config[i]->value = config[j].value;
@@ -593,7 +1202,27 @@ static struct mem process_ioctl_set_config(uint8_t* inbuf, size_t insz) {
     assert(req->call == CALL__Ioctl);
     assert(req->ioctl == IOCTL_ID__SetConfig);
 
+    int code = STATUS_NOERROR;
+    int flow = iso_flow_index(req->channel);
     for (size_t i = 0; i < req->n_config; i++) {
+        uint32_t parameter = req->config[i]->parameter;
+        if (flow >= 0 && (parameter == ISO15765_BS || parameter == ISO15765_STMIN)) {
+            if (req->config[i]->value > 0xFF) {
+                code = ERR_INVALID_IOCTL_VALUE;
+                break;
+            }
+            if (parameter == ISO15765_BS) {
+                iso_flow[flow].bs = req->config[i]->value;
+            } else {
+                iso_flow[flow].stmin = req->config[i]->value;
+            }
+            // also for the pairs already set up
+            if (!update_iso_filters(req->channel)) {
+                code = ERR_FAILED;
+                break;
+            }
+            continue;
+        }
         for (int j = 0; j < sizeof(config) / sizeof(config[0]); j++) {
             if (!config[j].active || req->config[i]->parameter == config[j].parameter) {
                 config[j].active = true;
@@ -607,7 +1236,7 @@ static struct mem process_ioctl_set_config(uint8_t* inbuf, size_t insz) {
     ioctl_response__init(res);
     res->id = req->id;
     res->call = CALL__Ioctl;
-    res->code = STATUS_NOERROR;
+    res->code = code;
     res->ioctl = IOCTL_ID__SetConfig;
     ioctl_set_config_request__free_unpacked(req, NULL);
 
@@ -659,6 +1288,13 @@ static struct mem process_ioctl(uint8_t* inbuf, size_t insz) {
     res->id = req->id;
     res->call = CALL__Ioctl;
     res->code = ERR_INVALID_IOCTL_ID;
+    if (ioctl == IOCTL_ID__ClearPeriodic) {
+        res->code = channel_open(req->channel) ? STATUS_NOERROR : ERR_INVALID_CHANNEL_ID;
+        stop_periodics(req->channel);
+    } else if (ioctl == IOCTL_ID__ClearFilters) {
+        res->code = channel_open(req->channel) ? STATUS_NOERROR : ERR_INVALID_CHANNEL_ID;
+        clear_filters(req->channel);
+    }
     res->ioctl = req->ioctl;
     ioctl_request__free_unpacked(req, NULL);
 
@@ -703,31 +1339,171 @@ static struct mem process(uint8_t* inbuf, size_t insz) {
     return (struct mem) { 0 };
 }
 
+// a BaseResponse is a valid response to any call: the fields all responses
+// share come first and under the same numbers
+static struct mem reject(uint8_t* inbuf, size_t insz, uint32_t code) {
+    assert(inbuf);
+    struct BaseRequest* req = base_request__unpack(NULL, insz, inbuf);
+    if (!req) {
+        return (struct mem) { 0 };
+    }
+    struct BaseResponse* res = malloc(sizeof(struct BaseResponse));
+    base_response__init(res);
+    res->id = req->id;
+    res->call = req->call;
+    res->code = code;
+    base_request__free_unpacked(req, NULL);
+
+    PACK_AND_RETURN(base);
+}
+
+// the lane a ReadMsgs waits in, -1 for calls that go on the control worker
+static int read_lane(uint8_t* inbuf, size_t insz) {
+    struct BaseRequest* base = base_request__unpack(NULL, insz, inbuf);
+    if (!base) {
+        return -1;
+    }
+    Call call = base->call;
+    base_request__free_unpacked(base, NULL);
+    if (call != CALL__Read) {
+        return -1;
+    }
+    struct ReadRequest* req = read_request__unpack(NULL, insz, inbuf);
+    if (!req) {
+        return -1;
+    }
+    int lane = -1;
+    switch (req->channel) {
+    case CH_CAN_1:
+        lane = 0;
+        break;
+    case CH_ISO15765_1:
+        lane = 1;
+        break;
+    case CH_ISO15765_2:
+        lane = 2;
+        break;
+    default:
+        break;
+    }
+    read_request__free_unpacked(req, NULL);
+    return lane;
+}
+
 #ifdef CONFIG_OMNITRIX_ENABLE_BLE
+#include <host/ble_att.h>
 #include <host/ble_hs_mbuf.h>
 #include <os/os_mbuf.h>
 static const ble_uuid128_t gatt_svr_svc_uuid = CONFIG_OMNITRIX_J2534_SERVICE_UUID_INIT;
 static const ble_uuid128_t gatt_svr_chr_uuid = CONFIG_OMNITRIX_J2534_CHARACTERISTIC_UUID_INIT;
 static uint16_t gatt_svr_chr_val_handle;
 
+// Requests are copied off the NimBLE host task and handled by workers, so
+// nothing there blocks, allocates much or packs protobufs. The control
+// worker takes every call in order, except ReadMsgs, which it hands to a
+// lane per channel: a read may wait out its timeout there while other calls
+// and reads on other channels go ahead. Responses carry the request's id
+// and are notified as they are done, in whatever order that is.
+struct work {
+    uint16_t conn_handle;
+    uint16_t attr_handle;
+    size_t len;
+    uint8_t* buf;
+};
+
+#define WORK_QUEUE_LEN 16
+#define READ_LANES 3
+#define READ_LANE_QUEUE_LEN 4
+
+static struct work work_queue_storage[WORK_QUEUE_LEN];
+static StaticQueue_t work_queue_buffer;
+static QueueHandle_t work_queue_handle;
+
+static StackType_t control_worker_stack[4096];
+static StaticTask_t control_worker_buffer;
+
+static struct {
+    struct work queue_storage[READ_LANE_QUEUE_LEN];
+    StaticQueue_t queue_buffer;
+    QueueHandle_t queue_handle;
+    StackType_t stack[4096];
+    StaticTask_t task_buffer;
+} read_lanes[READ_LANES];
+
+static void notify(const struct work* work, struct mem outmem) {
+    if (outmem.buf) {
+        struct os_mbuf* om = ble_hs_mbuf_from_flat(outmem.buf, outmem.len);
+        assert(om);
+        free(outmem.buf);
+        ble_gatts_notify_custom(work->conn_handle, work->attr_handle, om);
+    }
+}
+
+static void read_worker(void* ptr) {
+    QueueHandle_t queue = ptr;
+    for (;;) {
+        struct work work;
+        if (xQueueReceive(queue, &work, portMAX_DELAY) == pdTRUE) {
+            if (queue == read_lanes[0].queue_handle) {
+                uint16_t mtu = ble_att_mtu(work.conn_handle);
+                if (mtu) {
+                    atomic_store(&can_read_mtu, mtu);
+                }
+            }
+            notify(&work, process(work.buf, work.len));
+            free(work.buf);
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+static void control_worker(void* ptr) {
+    (void)ptr;
+    for (;;) {
+        struct work work;
+        if (xQueueReceive(work_queue_handle, &work, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        int lane = read_lane(work.buf, work.len);
+        if (lane >= 0) {
+            if (xQueueSend(read_lanes[lane].queue_handle, &work, 0) != pdTRUE) {
+                notify(&work, reject(work.buf, work.len, ERR_FAILED));
+                free(work.buf);
+            }
+            continue;
+        }
+        notify(&work, process(work.buf, work.len));
+        free(work.buf);
+    }
+    vTaskDelete(NULL);
+}
+
+static void start_workers(void) {
+    work_queue_handle = xQueueCreateStatic(WORK_QUEUE_LEN, sizeof(struct work), (uint8_t*)work_queue_storage, &work_queue_buffer);
+    for (int i = 0; i < READ_LANES; i++) {
+        read_lanes[i].queue_handle = xQueueCreateStatic(READ_LANE_QUEUE_LEN, sizeof(struct work), (uint8_t*)read_lanes[i].queue_storage, &read_lanes[i].queue_buffer);
+        xTaskCreateStatic(read_worker, "j2534_read", sizeof(read_lanes[i].stack) / sizeof(read_lanes[i].stack[0]), read_lanes[i].queue_handle, 5, read_lanes[i].stack, &read_lanes[i].task_buffer);
+    }
+    xTaskCreateStatic(control_worker, "j2534_control", sizeof(control_worker_stack) / sizeof(control_worker_stack[0]), NULL, 5, control_worker_stack, &control_worker_buffer);
+}
+
 static int gatt_svr_chr_access_cb(uint16_t conn_handle, uint16_t attr_handle, struct ble_gatt_access_ctxt* ctxt, void* arg) {
-    struct Request* req;
-    static uint8_t buf[1024];
-    static uint16_t size;
     if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR) {
         size_t insz = OS_MBUF_PKTLEN(ctxt->om);
         if (insz) {
-            uint8_t* inbuf = malloc(insz);
-            assert(inbuf);
+            struct work work = {
+                .conn_handle = conn_handle,
+                .attr_handle = attr_handle,
+                .len = insz,
+                .buf = malloc(insz),
+            };
+            assert(work.buf);
             uint16_t unused;
-            assert(ble_hs_mbuf_to_flat(ctxt->om, inbuf, insz, &unused) == 0);
-            struct mem outmem = process(inbuf, insz);
-            free(inbuf);
-            if (outmem.buf) {
-                struct os_mbuf* om = ble_hs_mbuf_from_flat(outmem.buf, outmem.len);
-                assert(om);
-                free(outmem.buf);
-                ble_gatts_notify_custom(conn_handle, attr_handle, om);
+            assert(ble_hs_mbuf_to_flat(ctxt->om, work.buf, insz, &unused) == 0);
+            if (xQueueSend(work_queue_handle, &work, 0) != pdTRUE) {
+                // too much in flight already; only this one is answered here
+                notify(&work, reject(work.buf, work.len, ERR_FAILED));
+                free(work.buf);
             }
         }
     }
@@ -759,9 +1535,17 @@ const struct ble_gatt_svc_def omni_j2534_gatt_svr_svcs[] = {
 void omni_j2534_main(void) {
     omni_libcan_main();
     omni_libisotp_main();
-    omni_libisotp_add_incoming_handler(isotp_read_handler);
+    omni_libperiodic_main();
+    can_ready = xSemaphoreCreateBinaryStatic(&can_ready_buffer);
+    omni_libcan_add_incoming_handler(can_read_handler);
     isotp_msg_queue_handle = xQueueCreateStatic(8, sizeof(struct isotp_msg), (uint8_t*)isotp_msg_queue_storage, &isotp_msg_queue_buffer);
     isotp_ps_msg_queue_handle = xQueueCreateStatic(8, sizeof(struct isotp_msg), (uint8_t*)isotp_ps_msg_queue_storage, &isotp_ps_msg_queue_buffer);
+    // the room callbacks look at the queues
+    omni_libisotp_subscribe(isotp_read_handler, CH_ISO15765_1, isotp_room);
+    omni_libisotp_subscribe(isotp_ps_read_handler, CH_ISO15765_2, isotp_ps_room);
+#ifdef CONFIG_OMNITRIX_ENABLE_BLE
+    start_workers();
+#endif
 }
 
 #endif
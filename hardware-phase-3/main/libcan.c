@@ -1,11 +1,17 @@
+#include <assert.h>
 #include <driver/gpio.h>
 #include <driver/twai.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <omnitrix/libcan.h>
+#include <omnitrix/ring.h>
 
 static const char tag[] = "omni_libcan";
 
@@ -17,31 +23,412 @@ static StackType_t can_dispatcher_stack[4096];
 static StaticTask_t can_dispatcher_buffer;
 static TaskHandle_t can_dispatcher_handle;
 
-static struct twai_message_timestamp can_msg_queue_storage[256];
-static StaticQueue_t can_msg_queue_buffer;
-static QueueHandle_t can_msg_queue_handle;
+// frames are received straight into the ring and handed to the handlers
+// by pointer; can_reader is the only producer, can_dispatcher the only
+// consumer
+static struct twai_message_timestamp can_ring_storage[256];
+static struct omni_ring can_ring = OMNI_RING_INIT(can_ring_storage);
 
-static uint32_t filter = 0xFFFFFFFF;
-static uint32_t filters_or = 0;
-static uint32_t mask = 0xFFFFFFFF;
+// maximum number of frames handed to the handlers per ring drain
+#define CAN_DISPATCH_BATCH 32
 
-static omni_libcan_incoming_handler* handlers[2] = { NULL, NULL };
+// Software acceptance filter, checked for every received frame. 11-bit IDs
+// are a direct-indexed bitmap, 29-bit IDs live in an open-addressed hash set
+// (keyed with bit 31 set so that 0 marks an empty slot) and the few mask and
+// range rules are scanned linearly. Every entry is reference counted, so
+// several registrations may share an ID and be removed independently.
+#define FILTER_EXT_BITS 8
+#define FILTER_EXT_SLOTS (1 << FILTER_EXT_BITS)
+#define FILTER_RULES 8
+
+static struct {
+    uint32_t std_bitmap[0x800 / 32];
+    uint8_t std_refs[0x800];
+    struct {
+        uint32_t key;
+        uint16_t refs;
+    } ext[FILTER_EXT_SLOTS];
+    size_t ext_count;
+    struct {
+        // matches when (id & mask) lies within [first, last]
+        uint32_t first;
+        uint32_t last;
+        uint32_t mask;
+        uint16_t refs;
+    } rules[FILTER_RULES];
+    size_t rule_count;
+} filters = { 0 };
+static portMUX_TYPE filter_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Hardware acceptance filter. can_reader derives the best single or dual
+// TWAI filter from the software filter set and reinstalls the driver with
+// it, so the controller already drops most unrelated traffic and only the
+// remaining false positives reach filter_match. A reinstall loses whatever
+// arrives meanwhile, so a filter that still lets everything registered
+// through is kept: it is widened as soon as an entry needs it, but only
+// narrowed once the set has been left alone for HW_FILTER_SETTLE_US. Changes
+// are counted; can_reader looks at the count after every receive.
+#define HW_FILTER_MAX_ITEMS 128
+#define HW_FILTER_SETTLE_US 1000000
+#define CAN_READER_POLL_MS 10
+
+struct hw_item {
+    uint32_t code; // single filter register layout
+    uint32_t rel; // bits of code that have to match
+    uint16_t dual_code; // dual filter half layout
+    uint16_t dual_rel;
+    bool extd;
+};
+
+// written by can_reader under filter_lock
+static twai_filter_config_t filter_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+static struct hw_item hw_items[HW_FILTER_MAX_ITEMS];
+static atomic_uint hw_filter_requested = 0;
+
+// Nothing may call into the driver while can_reader reinstalls it. Senders
+// count themselves in tx_users around twai_transmit() and stay out while
+// tx_closed is set; can_reader sets it and waits for the count to drop.
+static atomic_int tx_users = 0;
+static atomic_bool tx_closed = false;
+
+static struct omni_libcan_stats stats = { 0 };
+
+// Incoming frame subscribers. A frame is handed to a subscriber if
+// ((id ^ sub.id) & sub.mask) == 0, with bit 31 of the ID set for extended
+// frames; a zero mask subscribes to everything.
+#define CAN_MAX_SUBSCRIBERS 8
+
+struct subscriber {
+    omni_libcan_incoming_handler* handler;
+    uint32_t id;
+    uint32_t mask;
+};
+
+static struct subscriber subscribers[CAN_MAX_SUBSCRIBERS];
+static size_t subscriber_count = 0;
+static portMUX_TYPE subscriber_lock = portMUX_INITIALIZER_UNLOCKED;
 static bool initialized = false;
 
+// hands up to max received frames to the interested subscribers in place
+static size_t can_drain(size_t max) {
+    size_t count = omni_ring_peek(&can_ring, max);
+    if (!count) {
+        return 0;
+    }
+    // snapshot, so handlers never run under the lock
+    struct subscriber subs[CAN_MAX_SUBSCRIBERS];
+    taskENTER_CRITICAL(&subscriber_lock);
+    size_t sub_count = subscriber_count;
+    memcpy(subs, subscribers, sub_count * sizeof(subs[0]));
+    taskEXIT_CRITICAL(&subscriber_lock);
+    for (size_t i = 0; i < count; i++) {
+        struct twai_message_timestamp* msg = omni_ring_at(&can_ring, i);
+        uint32_t id = msg->msg.identifier | (msg->msg.extd ? 0x80000000 : 0);
+        for (size_t j = 0; j < sub_count; j++) {
+            if (!((id ^ subs[j].id) & subs[j].mask)) {
+                subs[j].handler(msg);
+            }
+        }
+    }
+    omni_ring_release(&can_ring, count);
+    return count;
+}
+
 static void can_dispatcher(void* ptr) {
     (void)ptr;
     for (;;) {
-        struct twai_message_timestamp msg;
-        if (xQueueReceive(can_msg_queue_handle, &msg, portMAX_DELAY) == pdTRUE) {
-            if (handlers[0]) {
-                handlers[0](&msg);
+        size_t count = can_drain(CAN_DISPATCH_BATCH);
+        if (!count) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+static inline size_t filter_ext_hash(uint32_t key) {
+    return (key * 2654435761u) >> (32 - FILTER_EXT_BITS);
+}
+
+// returns the slot holding key, or the empty slot where it would go
+static size_t filter_ext_find(uint32_t key) {
+    size_t i = filter_ext_hash(key);
+    while (filters.ext[i].key && filters.ext[i].key != key) {
+        i = (i + 1) & (FILTER_EXT_SLOTS - 1);
+    }
+    return i;
+}
+
+// backward-shift deletion keeps probe chains intact without tombstones
+static void filter_ext_erase(size_t i) {
+    size_t j = i;
+    for (;;) {
+        filters.ext[i].key = 0;
+        filters.ext[i].refs = 0;
+        size_t home;
+        do {
+            j = (j + 1) & (FILTER_EXT_SLOTS - 1);
+            if (!filters.ext[j].key) {
+                return;
+            }
+            home = filter_ext_hash(filters.ext[j].key);
+        } while ((i <= j) ? (i < home && home <= j) : (i < home || home <= j));
+        filters.ext[i] = filters.ext[j];
+        i = j;
+    }
+}
+
+static bool filter_match(uint32_t id) {
+    bool match = false;
+    taskENTER_CRITICAL(&filter_lock);
+    if (id & 0x80000000) {
+        match = filters.ext[filter_ext_find(id)].key != 0;
+    } else {
+        match = (filters.std_bitmap[(id & 0x7FF) >> 5] >> (id & 0x1F)) & 1;
+    }
+    for (size_t i = 0; !match && i < filters.rule_count; i++) {
+        uint32_t masked = id & filters.rules[i].mask;
+        match = masked >= filters.rules[i].first && masked <= filters.rules[i].last;
+    }
+    taskEXIT_CRITICAL(&filter_lock);
+    return match;
+}
+
+static struct hw_item hw_item(uint32_t id, uint32_t id_rel, bool extd) {
+    struct hw_item item = { .extd = extd };
+    if (extd) {
+        id &= 0x1FFFFFFF;
+        id_rel &= 0x1FFFFFFF;
+        item.code = id << 3;
+        item.rel = id_rel << 3;
+        item.dual_code = id >> 13;
+        item.dual_rel = id_rel >> 13;
+    } else {
+        id &= 0x7FF;
+        id_rel &= 0x7FF;
+        item.code = id << 21;
+        item.rel = id_rel << 21;
+        item.dual_code = id << 5;
+        item.dual_rel = id_rel << 5;
+    }
+    return item;
+}
+
+// a range rule is approximated by the common prefix of its bounds
+static struct hw_item hw_rule_item(uint32_t first, uint32_t last, uint32_t rule_mask) {
+    uint32_t diff = first ^ last;
+    uint32_t rel = rule_mask;
+    if (diff) {
+        rel &= ~((2u << (31 - __builtin_clz(diff))) - 1);
+    }
+    return hw_item(first, rel, (first & 0x80000000) != 0);
+}
+
+struct hw_group {
+    uint32_t and_code;
+    uint32_t or_code;
+    uint32_t rel;
+    bool std;
+};
+
+#define HW_GROUP_INIT { .and_code = 0xFFFFFFFF, .or_code = 0, .rel = 0xFFFFFFFF, .std = false }
+
+static void hw_group_add(struct hw_group* group, uint32_t code, uint32_t rel, bool extd) {
+    group->and_code &= code;
+    group->or_code |= code;
+    group->rel &= rel;
+    group->std |= !extd;
+}
+
+// bits that are equal and relevant for every member of the group
+static uint32_t hw_group_fixed(const struct hw_group* group) {
+    return group->rel & ~(group->and_code ^ group->or_code);
+}
+
+// Approximate number of IDs a filter lets through, scaled to the 29-bit ID
+// space: a standard ID is worth 2^18 extended ones.
+static uint64_t hw_single_cost(uint32_t fixed) {
+    int std_free = 11 - __builtin_popcount(fixed & 0xFFE00000);
+    int ext_free = 29 - __builtin_popcount(fixed & 0xFFFFFFF8);
+    return (1ull << (std_free + 18)) + (1ull << ext_free);
+}
+
+static uint64_t hw_dual_cost(uint16_t fixed) {
+    int std_free = 11 - __builtin_popcount(fixed & 0xFFE0);
+    int ext_free = 16 - __builtin_popcount(fixed);
+    return (1ull << (std_free + 18)) + (1ull << (ext_free + 13));
+}
+
+static int hw_item_compare(const void* a, const void* b) {
+    const struct hw_item* x = a;
+    const struct hw_item* y = b;
+    if (x->extd != y->extd) {
+        return x->extd ? 1 : -1;
+    }
+    return (int)x->dual_code - (int)y->dual_code;
+}
+
+// In dual filter mode the low nibble of filter 2 doubles as the data nibble
+// of filter 1 for standard frames, so it can only be fixed if filter 1 holds
+// no standard IDs.
+static void hw_dual_config(const struct hw_group* first, size_t first_n, const struct hw_group* second, size_t second_n, uint32_t* code, uint32_t* fixed) {
+    uint16_t fixed1 = first_n ? hw_group_fixed(first) : 0xFFFF;
+    uint16_t fixed2 = second_n ? hw_group_fixed(second) : 0xFFFF;
+    uint16_t code1 = first_n ? first->and_code : 0xFFFF;
+    uint16_t code2 = second_n ? second->and_code : 0xFFFF;
+    if (first_n && first->std) {
+        fixed2 &= ~0xF;
+    }
+    *code = ((uint32_t)(code1 & fixed1) << 16) | (code2 & fixed2);
+    *fixed = ((uint32_t)fixed1 << 16) | fixed2;
+}
+
+static uint64_t hw_dual_config_cost(uint32_t fixed, size_t first_n, size_t second_n) {
+    return (first_n ? hw_dual_cost(fixed >> 16) : 0) + (second_n ? hw_dual_cost(fixed) : 0);
+}
+
+static void hw_filter_compute(twai_filter_config_t* config) {
+    size_t count = 0;
+    bool overflow = false;
+    struct hw_group single = HW_GROUP_INIT;
+
+#define HW_COLLECT(item_expr)                                       \
+    do {                                                            \
+        struct hw_item item = (item_expr);                          \
+        hw_group_add(&single, item.code, item.rel, item.extd);      \
+        if (count < HW_FILTER_MAX_ITEMS) {                          \
+            hw_items[count] = item;                                 \
+        } else {                                                    \
+            overflow = true;                                        \
+        }                                                           \
+        count++;                                                    \
+    } while (0)
+
+    taskENTER_CRITICAL(&filter_lock);
+    for (uint32_t word = 0; word < sizeof(filters.std_bitmap) / sizeof(filters.std_bitmap[0]); word++) {
+        for (uint32_t bits = filters.std_bitmap[word]; bits; bits &= bits - 1) {
+            HW_COLLECT(hw_item((word << 5) | __builtin_ctz(bits), 0x7FF, false));
+        }
+    }
+    for (size_t i = 0; i < FILTER_EXT_SLOTS; i++) {
+        if (filters.ext[i].key) {
+            HW_COLLECT(hw_item(filters.ext[i].key, 0x1FFFFFFF, true));
+        }
+    }
+    for (size_t i = 0; i < filters.rule_count; i++) {
+        HW_COLLECT(hw_rule_item(filters.rules[i].first, filters.rules[i].last, filters.rules[i].mask));
+    }
+    taskEXIT_CRITICAL(&filter_lock);
+#undef HW_COLLECT
+
+    if (!count) {
+        // nothing registered: only extended remote frames with ID 1FFFFFFF
+        // (or equally unlikely standard frames) get through
+        config->acceptance_code = 0xFFFFFFFF;
+        config->acceptance_mask = 0x00000003;
+        config->single_filter = true;
+        return;
+    }
+
+    uint32_t best_fixed = hw_group_fixed(&single);
+    uint32_t best_code = single.and_code & best_fixed;
+    uint64_t best_cost = hw_single_cost(best_fixed);
+    bool best_single = true;
+
+    if (!overflow) {
+        // try every split of the sorted items into two dual filter halves,
+        // in both orders because of the shared nibble
+        static struct hw_group suffix[HW_FILTER_MAX_ITEMS + 1];
+        qsort(hw_items, count, sizeof(hw_items[0]), hw_item_compare);
+        suffix[count] = (struct hw_group)HW_GROUP_INIT;
+        for (size_t i = count; i > 0; i--) {
+            suffix[i - 1] = suffix[i];
+            hw_group_add(&suffix[i - 1], hw_items[i - 1].dual_code, hw_items[i - 1].dual_rel, hw_items[i - 1].extd);
+        }
+        struct hw_group prefix = HW_GROUP_INIT;
+        for (size_t i = 0; i <= count; i++) {
+            if (i) {
+                hw_group_add(&prefix, hw_items[i - 1].dual_code, hw_items[i - 1].dual_rel, hw_items[i - 1].extd);
             }
-            if (handlers[1]) {
-                handlers[1](&msg);
+            for (int order = 0; order < 2; order++) {
+                const struct hw_group* first = order ? &suffix[i] : &prefix;
+                const struct hw_group* second = order ? &prefix : &suffix[i];
+                size_t first_n = order ? count - i : i;
+                size_t second_n = order ? i : count - i;
+                uint32_t code, fixed;
+                hw_dual_config(first, first_n, second, second_n, &code, &fixed);
+                uint64_t cost = hw_dual_config_cost(fixed, first_n, second_n);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_code = code;
+                    best_fixed = fixed;
+                    best_single = false;
+                }
             }
         }
     }
-    vTaskDelete(NULL);
+
+    config->acceptance_code = best_code;
+    config->acceptance_mask = ~best_fixed;
+    config->single_filter = best_single;
+}
+
+// whether a filter register value lets an item through, looking at bits only
+static bool hw_passes(uint32_t code, uint32_t mask, uint32_t item_code, uint32_t item_rel, uint32_t bits) {
+    return (~mask & bits & ~(item_rel & ~(item_code ^ code))) == 0;
+}
+
+static bool hw_filter_covers(const twai_filter_config_t* config, struct hw_item item) {
+    uint32_t code = config->acceptance_code;
+    uint32_t mask = config->acceptance_mask;
+    if (config->single_filter) {
+        return hw_passes(code, mask, item.code, item.rel, item.extd ? 0xFFFFFFFC : 0xFFFFFFFF);
+    }
+    uint32_t code1 = (uint32_t)item.dual_code << 16;
+    uint32_t rel1 = (uint32_t)item.dual_rel << 16;
+    if (item.extd) {
+        return hw_passes(code, mask, code1, rel1, 0xFFFF0000) || hw_passes(code, mask, item.dual_code, item.dual_rel, 0x0000FFFF);
+    }
+    return hw_passes(code, mask, code1, rel1, 0xFFFF000F) || hw_passes(code, mask, item.dual_code, item.dual_rel, 0x0000FFF0);
+}
+
+// whether the hardware filter lets through everything registered
+static bool hw_filter_covers_all(const twai_filter_config_t* config) {
+    bool covered = true;
+    taskENTER_CRITICAL(&filter_lock);
+    for (uint32_t word = 0; covered && word < sizeof(filters.std_bitmap) / sizeof(filters.std_bitmap[0]); word++) {
+        for (uint32_t bits = filters.std_bitmap[word]; covered && bits; bits &= bits - 1) {
+            covered = hw_filter_covers(config, hw_item((word << 5) | __builtin_ctz(bits), 0x7FF, false));
+        }
+    }
+    for (size_t i = 0; covered && i < FILTER_EXT_SLOTS; i++) {
+        if (filters.ext[i].key) {
+            covered = hw_filter_covers(config, hw_item(filters.ext[i].key, 0x1FFFFFFF, true));
+        }
+    }
+    for (size_t i = 0; covered && i < filters.rule_count; i++) {
+        covered = hw_filter_covers(config, hw_rule_item(filters.rules[i].first, filters.rules[i].last, filters.rules[i].mask));
+    }
+    taskEXIT_CRITICAL(&filter_lock);
+    return covered;
+}
+
+// Tells can_reader the filter set changed. Never waits, callers that need
+// the frames right away use omni_libcan_filter_wait().
+static void hw_filter_request(void) {
+    atomic_fetch_add(&hw_filter_requested, 1);
+}
+
+static bool tx_enter(void) {
+    atomic_fetch_add(&tx_users, 1);
+    if (atomic_load(&tx_closed)) {
+        atomic_fetch_sub(&tx_users, 1);
+        return false;
+    }
+    return true;
+}
+
+static void tx_exit(void) {
+    atomic_fetch_sub(&tx_users, 1);
 }
 
 // for extreme debugging only, potentially a major performance hit
@@ -50,45 +437,96 @@ static void can_dispatcher(void* ptr) {
 #define CAN_LOGI(...)
 #define CAN_LOGE(...)
 
-static void can_reader(void* ptr) {
-    (void)ptr;
-    for (;;) {
-        struct twai_message_timestamp msg;
-        CAN_LOGI(tag, "waiting for next incoming frame...");
-        esp_err_t result = twai_receive(&msg.msg, portMAX_DELAY);
-        switch (result) {
-        case ESP_OK: {
-            if (msg.msg.extd) {
-                CAN_LOGI(tag, "incoming frame received: ID=%08" PRIX32 ", DLC=%X, DATA=%02X%02X%02X%02X%02X%02X%02X%02X, EXTD=T", msg.msg.identifier, msg.msg.data_length_code, msg.msg.data[0], msg.msg.data[1], msg.msg.data[2], msg.msg.data[3], msg.msg.data[4], msg.msg.data[5], msg.msg.data[6], msg.msg.data[7]);
-            } else {
-                CAN_LOGI(tag, "incoming frame received: ID=%03" PRIX32 ", DLC=%X, DATA=%02X%02X%02X%02X%02X%02X%02X%02X, EXTD=F", msg.msg.identifier, msg.msg.data_length_code, msg.msg.data[0], msg.msg.data[1], msg.msg.data[2], msg.msg.data[3], msg.msg.data[4], msg.msg.data[5], msg.msg.data[6], msg.msg.data[7]);
+static esp_err_t receive_frame(TickType_t ticks) {
+    struct twai_message_timestamp overflow;
+    struct twai_message_timestamp* slot = omni_ring_acquire(&can_ring);
+    struct twai_message_timestamp* msg = slot ? slot : &overflow;
+    CAN_LOGI(tag, "waiting for next incoming frame...");
+    esp_err_t result = twai_receive(&msg->msg, ticks);
+    switch (result) {
+    case ESP_OK: {
+        // stamp before anything else, logging and filtering included
+        msg->time = esp_timer_get_time();
+        stats.hw_accepted++;
+        if (msg->msg.extd) {
+            CAN_LOGI(tag, "incoming frame received: ID=%08" PRIX32 ", DLC=%X, DATA=%02X%02X%02X%02X%02X%02X%02X%02X, EXTD=T", msg->msg.identifier, msg->msg.data_length_code, msg->msg.data[0], msg->msg.data[1], msg->msg.data[2], msg->msg.data[3], msg->msg.data[4], msg->msg.data[5], msg->msg.data[6], msg->msg.data[7]);
+        } else {
+            CAN_LOGI(tag, "incoming frame received: ID=%03" PRIX32 ", DLC=%X, DATA=%02X%02X%02X%02X%02X%02X%02X%02X, EXTD=F", msg->msg.identifier, msg->msg.data_length_code, msg->msg.data[0], msg->msg.data[1], msg->msg.data[2], msg->msg.data[3], msg->msg.data[4], msg->msg.data[5], msg->msg.data[6], msg->msg.data[7]);
+        }
+        uint32_t id = msg->msg.identifier | (msg->msg.extd ? 0x80000000 : 0);
+        if (filter_match(id)) {
+            CAN_LOGI(tag, "matched filter");
+            if (!slot) {
+                // the dispatcher may have caught up while we were blocked
+                slot = omni_ring_acquire(&can_ring);
+                if (slot) {
+                    *slot = overflow;
+                }
             }
-            uint32_t id = msg.msg.identifier | (msg.msg.extd ? 0x80000000 : 0);
-            if ((id & mask) == filter) {
-                CAN_LOGI(tag, "matched filter");
-                gettimeofday(&msg.time, NULL);
-                if (xQueueSend(can_msg_queue_handle, &msg, 0) == pdTRUE) {
-                    CAN_LOGI(tag, "queued incoming frame event");
-                } else {
-                    CAN_LOGE(tag, "event queue error (full?)");
+            if (slot) {
+                if (omni_ring_publish(&can_ring)) {
+                    xTaskNotifyGive(can_dispatcher_handle);
                 }
+                CAN_LOGI(tag, "queued incoming frame event");
             } else {
-                CAN_LOGI(tag, "unmatched filter");
+                stats.ring_overruns++;
+                CAN_LOGE(tag, "frame ring full, frame dropped");
             }
-            break;
+        } else {
+            stats.sw_rejected++;
+            CAN_LOGI(tag, "unmatched filter");
         }
-        case ESP_ERR_TIMEOUT:
-            CAN_LOGE(tag, "frame read failed: timeout");
-            break;
-        case ESP_ERR_INVALID_ARG:
-            CAN_LOGE(tag, "frame read failed: invalid argument");
-            break;
-        case ESP_ERR_INVALID_STATE:
-            CAN_LOGE(tag, "frame read failed: driver is not running or installed");
-            break;
-        default:
-            CAN_LOGE(tag, "frame read failed: unknown error");
-            break;
+        break;
+    }
+    case ESP_ERR_TIMEOUT:
+        CAN_LOGE(tag, "frame read failed: timeout");
+        break;
+    case ESP_ERR_INVALID_ARG:
+        CAN_LOGE(tag, "frame read failed: invalid argument");
+        break;
+    case ESP_ERR_INVALID_STATE:
+        CAN_LOGE(tag, "frame read failed: driver is not running or installed");
+        break;
+    default:
+        CAN_LOGE(tag, "frame read failed: unknown error");
+        break;
+    }
+    return result;
+}
+
+static void reinstall(void);
+
+// installs the tightest filter for the current set, if it differs
+static void hw_filter_apply(void) {
+    twai_filter_config_t config;
+    hw_filter_compute(&config);
+    if (config.acceptance_code == filter_config.acceptance_code && config.acceptance_mask == filter_config.acceptance_mask && config.single_filter == filter_config.single_filter) {
+        return;
+    }
+    taskENTER_CRITICAL(&filter_lock);
+    filter_config = config;
+    taskEXIT_CRITICAL(&filter_lock);
+    reinstall();
+}
+
+static void can_reader(void* ptr) {
+    (void)ptr;
+    unsigned seen = 0;
+    int64_t narrow_at = 0; // 0 while the hardware filter is as tight as it gets
+    for (;;) {
+        receive_frame(pdMS_TO_TICKS(CAN_READER_POLL_MS));
+        unsigned request = atomic_load(&hw_filter_requested);
+        if (request != seen) {
+            seen = request;
+            if (hw_filter_covers_all(&filter_config)) {
+                narrow_at = esp_timer_get_time() + HW_FILTER_SETTLE_US;
+            } else {
+                hw_filter_apply();
+                narrow_at = 0;
+            }
+        } else if (narrow_at && esp_timer_get_time() >= narrow_at) {
+            hw_filter_apply();
+            narrow_at = 0;
         }
     }
     vTaskDelete(NULL);
@@ -96,11 +534,41 @@ static void can_reader(void* ptr) {
 
 static twai_general_config_t general_config = TWAI_GENERAL_CONFIG_DEFAULT(GPIO_NUM_33, GPIO_NUM_34, TWAI_MODE_NORMAL);
 static twai_timing_config_t timing_config = TWAI_TIMING_CONFIG_500KBITS();
-static twai_filter_config_t filter_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+#define CAN_BIT_TIME_NS 2000 // must match timing_config
+
+// Bulk traffic may only fill this much of the driver's TX queue; the rest is
+// kept for periodic messages, which would otherwise queue up behind whole
+// ISO-TP transfers. 16 frames are under 4 ms on the bus, and still more than
+// the ISO-TP task needs to keep the queue from running dry between retries.
+#define CAN_BULK_TX_DEPTH 16
 
+// how long a reinstall waits for the TX queue to empty; a full queue takes
+// about 70 ms at 500 kbit/s
+#define REINSTALL_TX_WAIT_MS 100
+
+// Only called from can_reader, so nothing else is receiving. Senders are
+// shut out first and the TX queue goes onto the bus before the driver does;
+// frames still in the driver's RX queue are moved into the ring.
 static void reinstall(void) {
-    vTaskDelete(can_reader_handle);
+    atomic_store(&tx_closed, true);
+    while (atomic_load(&tx_users)) {
+        vTaskDelay(1);
+    }
+    TickType_t start = xTaskGetTickCount();
+    twai_status_info_t tx_status = { 0 };
+    while (twai_get_status_info(&tx_status) == ESP_OK && tx_status.msgs_to_tx && xTaskGetTickCount() - start < pdMS_TO_TICKS(REINSTALL_TX_WAIT_MS)) {
+        vTaskDelay(1);
+    }
+    if (tx_status.msgs_to_tx) {
+        // nobody acknowledges them, most likely
+        ESP_LOGW(tag, "reinstall: %" PRIu32 " frames left in the TX queue", tx_status.msgs_to_tx);
+    }
     twai_stop();
+    while (receive_frame(0) == ESP_OK) { }
+    twai_status_info_t status;
+    if (twai_get_status_info(&status) == ESP_OK) {
+        stats.rx_missed += status.rx_missed_count + status.rx_overrun_count;
+    }
     twai_driver_uninstall();
     if (twai_driver_install(&general_config, &timing_config, &filter_config) == ESP_OK) {
         ESP_LOGI(tag, "driver installed");
@@ -112,20 +580,16 @@ static void reinstall(void) {
     } else {
         ESP_LOGE(tag, "driver start failed");
     }
-    can_reader_handle = xTaskCreateStatic(
-        can_reader,
-        "can_reader",
-        sizeof(can_reader_stack) / sizeof(can_reader_stack[0]),
-        NULL,
-        10,
-        can_reader_stack,
-        &can_reader_buffer);
+    atomic_store(&tx_closed, false);
+    stats.hw_reinstalls++;
+    ESP_LOGI(tag, "hardware filter: code %08" PRIX32 ", mask %08" PRIX32 ", %s", filter_config.acceptance_code, filter_config.acceptance_mask, filter_config.single_filter ? "single" : "dual");
 }
 
 void omni_libcan_main(void) {
     if (!initialized) {
         general_config.tx_queue_len = 256;
         general_config.rx_queue_len = 256;
+        hw_filter_compute(&filter_config);
         if (twai_driver_install(&general_config, &timing_config, &filter_config) == ESP_OK) {
             ESP_LOGI(tag, "driver installed");
         } else {
@@ -136,19 +600,7 @@ void omni_libcan_main(void) {
         } else {
             ESP_LOGE(tag, "driver start failed");
         }
-        can_msg_queue_handle = xQueueCreateStatic(
-            sizeof(can_msg_queue_storage) / sizeof(can_msg_queue_storage[0]),
-            sizeof(can_msg_queue_storage[0]),
-            (uint8_t*)can_msg_queue_storage,
-            &can_msg_queue_buffer);
-        can_reader_handle = xTaskCreateStatic(
-            can_reader,
-            "can_reader",
-            sizeof(can_reader_stack) / sizeof(can_reader_stack[0]),
-            NULL,
-            10,
-            can_reader_stack,
-            &can_reader_buffer);
+        // the dispatcher must exist before the reader can notify it
         can_dispatcher_handle = xTaskCreateStatic(
             can_dispatcher,
             "can_dispatcher",
@@ -157,27 +609,244 @@ void omni_libcan_main(void) {
             5,
             can_dispatcher_stack,
             &can_dispatcher_buffer);
+        can_reader_handle = xTaskCreateStatic(
+            can_reader,
+            "can_reader",
+            sizeof(can_reader_stack) / sizeof(can_reader_stack[0]),
+            NULL,
+            10,
+            can_reader_stack,
+            &can_reader_buffer);
         initialized = true;
     }
 }
 
+bool omni_libcan_subscribe(omni_libcan_incoming_handler* handler, uint32_t id, uint32_t mask, bool extd) {
+    assert(handler);
+    bool ok = false;
+    taskENTER_CRITICAL(&subscriber_lock);
+    if (subscriber_count < CAN_MAX_SUBSCRIBERS) {
+        subscribers[subscriber_count].handler = handler;
+        subscribers[subscriber_count].id = id | (extd ? 0x80000000 : 0);
+        subscribers[subscriber_count].mask = mask;
+        subscriber_count++;
+        ok = true;
+    }
+    taskEXIT_CRITICAL(&subscriber_lock);
+    if (!ok) {
+        ESP_LOGE(tag, "too many incoming handlers");
+    }
+    return ok;
+}
+
+void omni_libcan_unsubscribe(omni_libcan_incoming_handler* handler) {
+    taskENTER_CRITICAL(&subscriber_lock);
+    for (size_t i = 0; i < subscriber_count;) {
+        if (subscribers[i].handler == handler) {
+            subscribers[i] = subscribers[--subscriber_count];
+        } else {
+            i++;
+        }
+    }
+    taskEXIT_CRITICAL(&subscriber_lock);
+}
+
 void omni_libcan_add_incoming_handler(omni_libcan_incoming_handler* handler) {
-    if (!handlers[0]) {
-        handlers[0] = handler;
-    } else if (!handlers[1]) {
-        handlers[1] = handler;
+    omni_libcan_subscribe(handler, 0, 0, false);
+}
+
+bool omni_libcan_add_filter(uint32_t id, bool extd) {
+    bool ok = true;
+    taskENTER_CRITICAL(&filter_lock);
+    if (extd) {
+        uint32_t key = (id & 0x1FFFFFFF) | 0x80000000;
+        size_t i = filter_ext_find(key);
+        if (filters.ext[i].key) {
+            filters.ext[i].refs++;
+        } else if (filters.ext_count < FILTER_EXT_SLOTS / 2) {
+            // keep the load factor at or below 1/2 so probes stay short
+            filters.ext[i].key = key;
+            filters.ext[i].refs = 1;
+            filters.ext_count++;
+        } else {
+            ok = false;
+        }
+    } else {
+        id &= 0x7FF;
+        assert(filters.std_refs[id] < UINT8_MAX);
+        filters.std_refs[id]++;
+        filters.std_bitmap[id >> 5] |= 1u << (id & 0x1F);
+    }
+    taskEXIT_CRITICAL(&filter_lock);
+    if (!ok) {
+        ESP_LOGE(tag, "filter: no room for %08" PRIX32, id);
+        return false;
+    }
+    hw_filter_request();
+    return true;
+}
+
+void omni_libcan_remove_filter(uint32_t id, bool extd) {
+    taskENTER_CRITICAL(&filter_lock);
+    if (extd) {
+        size_t i = filter_ext_find((id & 0x1FFFFFFF) | 0x80000000);
+        if (filters.ext[i].key && !--filters.ext[i].refs) {
+            filter_ext_erase(i);
+            filters.ext_count--;
+        }
+    } else {
+        id &= 0x7FF;
+        if (filters.std_refs[id] && !--filters.std_refs[id]) {
+            filters.std_bitmap[id >> 5] &= ~(1u << (id & 0x1F));
+        }
+    }
+    taskEXIT_CRITICAL(&filter_lock);
+    hw_filter_request();
+}
+
+static bool add_rule(uint32_t first, uint32_t last, uint32_t rule_mask) {
+    bool ok = false;
+    taskENTER_CRITICAL(&filter_lock);
+    for (size_t i = 0; i < filters.rule_count; i++) {
+        if (filters.rules[i].first == first && filters.rules[i].last == last && filters.rules[i].mask == rule_mask) {
+            filters.rules[i].refs++;
+            ok = true;
+            break;
+        }
+    }
+    if (!ok && filters.rule_count < FILTER_RULES) {
+        filters.rules[filters.rule_count].first = first;
+        filters.rules[filters.rule_count].last = last;
+        filters.rules[filters.rule_count].mask = rule_mask;
+        filters.rules[filters.rule_count].refs = 1;
+        filters.rule_count++;
+        ok = true;
+    }
+    taskEXIT_CRITICAL(&filter_lock);
+    if (!ok) {
+        ESP_LOGE(tag, "filter: no room for rule %08" PRIX32 "-%08" PRIX32 "/%08" PRIX32, first, last, rule_mask);
+        return false;
     }
+    hw_filter_request();
+    return true;
+}
+
+static void remove_rule(uint32_t first, uint32_t last, uint32_t rule_mask) {
+    taskENTER_CRITICAL(&filter_lock);
+    for (size_t i = 0; i < filters.rule_count; i++) {
+        if (filters.rules[i].first == first && filters.rules[i].last == last && filters.rules[i].mask == rule_mask) {
+            if (!--filters.rules[i].refs) {
+                filters.rules[i] = filters.rules[--filters.rule_count];
+            }
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&filter_lock);
+    hw_filter_request();
+}
+
+bool omni_libcan_add_filter_mask(uint32_t id, uint32_t id_mask, bool extd) {
+    uint32_t rule_mask = (id_mask & (extd ? 0x1FFFFFFF : 0x7FF)) | 0x80000000;
+    uint32_t code = (id | (extd ? 0x80000000 : 0)) & rule_mask;
+    return add_rule(code, code, rule_mask);
+}
+
+void omni_libcan_remove_filter_mask(uint32_t id, uint32_t id_mask, bool extd) {
+    uint32_t rule_mask = (id_mask & (extd ? 0x1FFFFFFF : 0x7FF)) | 0x80000000;
+    uint32_t code = (id | (extd ? 0x80000000 : 0)) & rule_mask;
+    remove_rule(code, code, rule_mask);
+}
+
+bool omni_libcan_add_filter_range(uint32_t first, uint32_t last, bool extd) {
+    uint32_t flag = extd ? 0x80000000 : 0;
+    return add_rule(first | flag, last | flag, 0xFFFFFFFF);
 }
 
-void omni_libcan_add_filter(uint32_t id, bool extd) {
-    filter &= id | (extd ? 0x80000000 : 0);
-    filters_or |= id | (extd ? 0x80000000 : 0);
-    mask = ~(filters_or & ~filter);
-    ESP_LOGI(tag, "filter: %08" PRIX32 ", mask: %08" PRIX32, filter, mask);
+void omni_libcan_remove_filter_range(uint32_t first, uint32_t last, bool extd) {
+    uint32_t flag = extd ? 0x80000000 : 0;
+    remove_rule(first | flag, last | flag, 0xFFFFFFFF);
 }
 
 void omni_libcan_clear_filter(void) {
-    filter = 0xFFFFFFFF;
-    filters_or = 0;
-    mask = 0xFFFFFFFF;
+    taskENTER_CRITICAL(&filter_lock);
+    memset(&filters, 0, sizeof(filters));
+    taskEXIT_CRITICAL(&filter_lock);
+    hw_filter_request();
+}
+
+bool omni_libcan_filter_wait(uint32_t id, uint32_t mask, bool extd, TickType_t timeout) {
+    struct hw_item item = hw_item(id, mask, extd);
+    TickType_t start = xTaskGetTickCount();
+    for (;;) {
+        taskENTER_CRITICAL(&filter_lock);
+        bool covered = hw_filter_covers(&filter_config, item);
+        taskEXIT_CRITICAL(&filter_lock);
+        if (covered) {
+            return true;
+        }
+        if (xTaskGetTickCount() - start >= timeout) {
+            return false;
+        }
+        vTaskDelay(1);
+    }
+}
+
+void omni_libcan_get_stats(struct omni_libcan_stats* out) {
+    assert(out);
+    *out = stats;
+    twai_status_info_t status;
+    if (tx_enter()) {
+        if (twai_get_status_info(&status) == ESP_OK) {
+            out->rx_missed += status.rx_missed_count + status.rx_overrun_count;
+        }
+        tx_exit();
+    }
+    taskENTER_CRITICAL(&filter_lock);
+    out->hw_filter_code = filter_config.acceptance_code;
+    out->hw_filter_mask = filter_config.acceptance_mask;
+    out->hw_filter_single = filter_config.single_filter;
+    taskEXIT_CRITICAL(&filter_lock);
+}
+
+esp_err_t omni_libcan_transmit(const twai_message_t* msg, TickType_t ticks) {
+    assert(msg);
+    TickType_t start = xTaskGetTickCount();
+    for (;;) {
+        // while the driver is being reinstalled it is as good as not running
+        esp_err_t result = ESP_ERR_INVALID_STATE;
+        if (tx_enter()) {
+            result = twai_transmit(msg, 0);
+            tx_exit();
+        }
+        if ((result != ESP_ERR_TIMEOUT && result != ESP_ERR_INVALID_STATE) || xTaskGetTickCount() - start >= ticks) {
+            return result;
+        }
+        vTaskDelay(1);
+    }
+}
+
+esp_err_t omni_libcan_transmit_bulk(const twai_message_t* msg, uint32_t* ahead) {
+    assert(msg);
+    if (!tx_enter()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    twai_status_info_t status = { 0 };
+    esp_err_t result = ESP_ERR_TIMEOUT;
+    if (twai_get_status_info(&status) != ESP_OK || status.msgs_to_tx < CAN_BULK_TX_DEPTH) {
+        result = twai_transmit(msg, 0);
+    }
+    tx_exit();
+    if (ahead) {
+        *ahead = status.msgs_to_tx;
+    }
+    return result;
+}
+
+uint32_t omni_libcan_frame_time_us(uint8_t dlc, bool extd) {
+    uint32_t data_bits = 8 * ((dlc > 8) ? 8 : dlc);
+    // SOF through CRC are subject to stuffing, at worst one bit in four after the first
+    uint32_t stuffed = (extd ? 54 : 34) + data_bits;
+    // CRC delimiter, ACK, EOF and the interframe space are not
+    uint32_t bits = stuffed + (stuffed - 1) / 4 + 13;
+    return (bits * CAN_BIT_TIME_NS + 999) / 1000;
 }
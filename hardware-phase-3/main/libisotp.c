@@ -1,7 +1,10 @@
+#include <assert.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 #include <freertos/task.h>
+#include <stdatomic.h>
 #include <string.h>
 
 #include <omnitrix/libcan.h>
@@ -10,6 +13,7 @@
 #include <omnitrix/led.h>
 
 #include "isotp.h"
+#include "isotp_pool.h"
 
 static const char tag[] = "omni_isotp";
 
@@ -17,10 +21,18 @@ static StackType_t isotp_task_stack[4096];
 static StaticTask_t isotp_task_buffer;
 static TaskHandle_t isotp_task_handle;
 
-static uint8_t isotp_event_queue_storage[sizeof(struct isotp_event) * 4];
+// the queue holds pointers; the events themselves are 32 bytes, down from 264
+// when the pairs and the whole TWAI frame were copied in
+static uint8_t isotp_event_queue_storage[sizeof(struct isotp_event*) * ISOTP_EVENT_POOL_COUNT];
 static StaticQueue_t isotp_event_queue_buffer;
 QueueHandle_t isotp_event_queue_handle;
 
+// esp_timer rather than a FreeRTOS timer: STmin goes down to 100 µs, far
+// below one tick. The hop from the esp_timer task to the ISO-TP task takes
+// some 10 µs, so the timer fires this much early and the rest is spun away.
+#define ISOTP_TIMER_SPIN_US 50
+static esp_timer_handle_t isotp_timer_handle;
+
 static uint8_t isotp_unmatched_frame_queue_storage[sizeof(struct twai_message_timestamp) * 4];
 static StaticQueue_t isotp_unmatched_frame_queue_buffer;
 static QueueHandle_t isotp_unmatched_frame_queue_handle;
@@ -37,20 +49,60 @@ static StackType_t isotp_dispatch_u_stack[4096];
 static StaticTask_t isotp_dispatch_u_buffer;
 static TaskHandle_t isotp_dispatch_u_handle;
 
-static omni_libisotp_incoming_handler* handlers[2] = { NULL, NULL };
-static omni_libisotp_unmatched_handler* u_handlers[2] = { NULL, NULL };
+// Message subscribers only get messages for their channel, unmatched frame
+// subscribers only frames matching their ID under mask (bit 31 marks
+// extended IDs).
+#define ISOTP_MAX_SUBSCRIBERS 8
+
+static struct {
+    omni_libisotp_incoming_handler* handler;
+    uint32_t channel;
+    omni_libisotp_room* room;
+} subscribers[ISOTP_MAX_SUBSCRIBERS];
+static size_t subscriber_count = 0;
+
+static struct {
+    omni_libisotp_unmatched_handler* handler;
+    uint32_t id;
+    uint32_t mask;
+} u_subscribers[ISOTP_MAX_SUBSCRIBERS];
+static size_t u_subscriber_count = 0;
+
+static portMUX_TYPE subscriber_lock = portMUX_INITIALIZER_UNLOCKED;
 static bool initialized = false;
 
-static void get_next_event(struct isotp_event* evt) {
-    assert(evt);
-    BaseType_t ret = xQueueReceive(isotp_event_queue_handle, evt, portMAX_DELAY);
+// each counter has a single writer: the ISO-TP task, the CAN dispatcher or
+// one of the two dispatch tasks
+static struct {
+    uint32_t frames_dropped;
+    uint32_t unmatched_dropped;
+    uint32_t msg_handler_dropped;
+    uint32_t unmatched_handler_dropped;
+} stats = { 0 };
+
+static struct isotp_event* get_next_event(void) {
+    struct isotp_event* evt;
+    BaseType_t ret = xQueueReceive(isotp_event_queue_handle, &evt, portMAX_DELAY);
     assert(ret == pdTRUE);
+    (void)ret;
+    return evt;
 }
 
-static void unmatched_frame(const uint8_t* frame) {
-    assert(frame);
-    // NOTE: if this queue is full the frame will be dropped!
-    xQueueSend(isotp_unmatched_frame_queue_handle, frame, 0);
+static void unmatched_frame(uint32_t id, uint8_t dlc, const uint8_t* data, int64_t time) {
+    assert(data);
+    struct twai_message_timestamp frame = {
+        .msg = {
+            .extd = (id & 0x80000000) != 0,
+            .identifier = id & 0x1FFFFFFF,
+            .data_length_code = dlc,
+        },
+        .time = time,
+    };
+    memcpy(frame.msg.data, data, (dlc < 8) ? dlc : 8);
+    // raw frames cannot be flow controlled, only counted
+    if (xQueueSend(isotp_unmatched_frame_queue_handle, &frame, 0) != pdTRUE) {
+        stats.unmatched_dropped++;
+    }
 }
 
 // for extreme debugging only, potentially a major performance hit
@@ -59,7 +111,7 @@ static void unmatched_frame(const uint8_t* frame) {
 #define CAN_LOGI(...)
 #define CAN_LOGE(...)
 
-static void write_frame(uint32_t id, uint8_t dlc, const uint8_t* data) {
+static int64_t write_frame(uint32_t id, uint8_t dlc, const uint8_t* data) {
     assert(data);
     omni_debug_log("ISOTP", "Writing frame - ID: 0x%lx, DLC: %d", (unsigned long)id, dlc);
     omni_led_data_transfer_start();  // Start LED indication
@@ -74,7 +126,15 @@ static void write_frame(uint32_t id, uint8_t dlc, const uint8_t* data) {
     } else {
         CAN_LOGI(tag, "about to write frame: ID=%03" PRIX32 ", DLC=%X, DATA=%02X%02X%02X%02X%02X%02X%02X%02X, EXTD=F", msg.identifier, msg.data_length_code, msg.data[0], msg.data[1], msg.data[2], msg.data[3], msg.data[4], msg.data[5], msg.data[6], msg.data[7]);
     }
-    esp_err_t result = twai_transmit(&msg, 0);
+    uint32_t ahead = 0;
+    esp_err_t result = omni_libcan_transmit_bulk(&msg, &ahead);
+    // The driver does not tell when a frame is done. It goes out after the
+    // frames queued before it, taken as 8 bytes long, which may be other
+    // transfers' or J2534 frames; STmin is counted from there.
+    int64_t time = -1;
+    if (result == ESP_OK) {
+        time = esp_timer_get_time() + ahead * omni_libcan_frame_time_us(8, msg.extd) + omni_libcan_frame_time_us(msg.data_length_code, msg.extd);
+    }
     switch (result) {
     case ESP_OK:
         CAN_LOGI(tag, "frame write successful");
@@ -99,38 +159,137 @@ static void write_frame(uint32_t id, uint8_t dlc, const uint8_t* data) {
         break;
     }
     omni_led_data_transfer_stop();  // Stop LED indication
+    return time;
 }
 
-static void read_message_cb(const uint8_t* data, size_t size, uint32_t channel) {
+static bool read_message_cb(const uint8_t* data, size_t size, const struct isotp_msg_info* info) {
     assert(data);
-    assert(size <= 256);
+    assert(size <= ISOTP_MAX_MSG_SIZE);
+    assert(info);
+    _Static_assert(OMNI_LIBISOTP_TX_DONE == ISOTP_MSG_TX_DONE, "message flags must match");
+    _Static_assert(OMNI_LIBISOTP_TX == ISOTP_MSG_TX, "message flags must match");
+    _Static_assert(OMNI_LIBISOTP_ABORTED == ISOTP_MSG_ABORTED, "message flags must match");
+    _Static_assert(OMNI_LIBISOTP_FRAGMENT == ISOTP_MSG_FRAGMENT, "message flags must match");
+    _Static_assert(OMNI_LIBISOTP_LAST_FRAGMENT == ISOTP_MSG_LAST_FRAGMENT, "message flags must match");
+    _Static_assert(OMNI_LIBISOTP_WINDOW_END == ISOTP_MSG_WINDOW_END, "message flags must match");
     struct isotp_msg msg = {
+        .channel = info->channel,
+        .flags = info->flags,
+        .time = info->time,
         .size = size,
+        .seq = info->seq,
+        .offset = info->offset,
+        .total = info->total,
     };
-    memcpy(msg.data, data, size);
-    // NOTE: if this queue is full the message will be dropped!
-    xQueueSend(isotp_msg_queue_handle, &msg, 0);
+    // messages are handed on by reference, indications point into buffers
+    // that are about to be reused and are copied
+    if (!(info->flags & (ISOTP_MSG_TX_DONE | ISOTP_MSG_ABORTED | ISOTP_MSG_WINDOW_END))) {
+        msg.data = isotp_pool_ref(data);
+    }
+    if (!msg.data) {
+        msg.data = isotp_pool_alloc(size);
+        if (!msg.data) {
+            ESP_LOGE(tag, "no buffer for incoming message, dropped");
+            return false;
+        }
+        memcpy(msg.data, data, size);
+    }
+    // the event loop must not block; rx_room() keeps this from happening to
+    // anything but single frames and indications
+    if (xQueueSend(isotp_msg_queue_handle, &msg, 0) != pdTRUE) {
+        isotp_pool_free(msg.data);
+        return false;
+    }
+    return true;
+}
+
+// the message the dispatch task took off its queue and is handing over
+static atomic_bool dispatching = false;
+
+// Room in the dispatch queue, and in each queue of the channel's
+// subscribers after the messages still on their way to it.
+static size_t rx_room(uint32_t channel) {
+    size_t room = uxQueueSpacesAvailable(isotp_msg_queue_handle);
+    size_t ahead = uxQueueMessagesWaiting(isotp_msg_queue_handle) + atomic_load(&dispatching);
+    for (size_t i = 0;; i++) {
+        taskENTER_CRITICAL(&subscriber_lock);
+        omni_libisotp_room* subscriber_room = NULL;
+        for (; i < subscriber_count; i++) {
+            if (subscribers[i].room && (subscribers[i].channel == channel || subscribers[i].channel == OMNI_LIBISOTP_ANY_CHANNEL)) {
+                subscriber_room = subscribers[i].room;
+                break;
+            }
+        }
+        taskEXIT_CRITICAL(&subscriber_lock);
+        if (!subscriber_room) {
+            break;
+        }
+        size_t space = subscriber_room();
+        space = (space > ahead) ? space - ahead : 0;
+        room = (space < room) ? space : room;
+    }
+    return room;
+}
+
+static bool post_timer_event(void) {
+    struct isotp_event* event = isotp_event_alloc();
+    if (!event) {
+        return false;
+    }
+    event->type = EVENT_TIMER;
+    event->timer.time = esp_timer_get_time();
+    if (xQueueSend(isotp_event_queue_handle, &event, 0) != pdTRUE) {
+        isotp_event_free(event);
+        return false;
+    }
+    return true;
+}
+
+static void isotp_timer_cb(void* arg) {
+    (void)arg;
+    if (!post_timer_event()) {
+        // the event loop is busy, it must not miss the timer though
+        esp_timer_start_once(isotp_timer_handle, ISOTP_TIMER_SPIN_US);
+    }
+}
+
+static void set_timer(int64_t deadline) {
+    int64_t delay = deadline - esp_timer_get_time();
+    if (delay <= ISOTP_TIMER_SPIN_US) {
+        // close enough to wait here, on the ISO-TP task
+        while (esp_timer_get_time() < deadline) { }
+        if (post_timer_event()) {
+            return;
+        }
+        delay = 0;
+    }
+    esp_timer_stop(isotp_timer_handle);
+    esp_timer_start_once(isotp_timer_handle, (delay > ISOTP_TIMER_SPIN_US) ? delay - ISOTP_TIMER_SPIN_US : 0);
 }
 
 static void isotp_task(void* ptr) {
     (void)ptr;
-    isotp_event_loop(get_next_event, unmatched_frame, write_frame, read_message_cb);
+    isotp_event_loop(get_next_event, unmatched_frame, write_frame, read_message_cb, rx_room, set_timer);
     vTaskDelete(NULL);
 }
 
 static void isotp_read_handler(struct twai_message_timestamp* msg) {
-    struct isotp_event event = {
-        .type = EVENT_INCOMING_CAN,
-        .can = {
-            .id = msg->msg.identifier | (msg->msg.extd << 31),
-            .dlc = msg->msg.data_length_code,
-        },
-    };
-    memcpy(event.can.data, msg->msg.data, (msg->msg.data_length_code < 8) ? msg->msg.data_length_code : 8);
-    memcpy(event.can.frame, msg, sizeof(*msg));
+    struct isotp_event* event = isotp_event_alloc();
+    if (!event) {
+        stats.frames_dropped++;
+        ESP_LOGE(tag, "no event for incoming frame, dropped");
+        return;
+    }
+    event->type = EVENT_INCOMING_CAN;
+    event->can.id = msg->msg.identifier | ((uint32_t)msg->msg.extd << 31);
+    event->can.dlc = msg->msg.data_length_code;
+    event->can.time = msg->time;
+    memcpy(event->can.data, msg->msg.data, (msg->msg.data_length_code < 8) ? msg->msg.data_length_code : 8);
     if (xQueueSend(isotp_event_queue_handle, &event, 0) == pdTRUE) {
-        ESP_LOGI(tag, "queued incoming frame event");
+        CAN_LOGI(tag, "queued incoming frame event");
     } else {
+        isotp_event_free(event);
+        stats.frames_dropped++;
         ESP_LOGE(tag, "event queue error (full?)");
     }
 }
@@ -140,15 +299,28 @@ static void isotp_dispatch(void* ptr) {
     for (;;) {
         struct isotp_msg msg;
         if (xQueueReceive(isotp_msg_queue_handle, &msg, portMAX_DELAY) == pdTRUE) {
+            atomic_store(&dispatching, true);
             omni_led_data_transfer_start();  // Start LED indication
-            if (handlers[0]) {
-                handlers[0](&msg);
-            }
-            if (handlers[1]) {
-                handlers[1](&msg);
+            for (size_t i = 0;; i++) {
+                taskENTER_CRITICAL(&subscriber_lock);
+                omni_libisotp_incoming_handler* handler = NULL;
+                for (; i < subscriber_count; i++) {
+                    if (subscribers[i].channel == msg.channel || subscribers[i].channel == OMNI_LIBISOTP_ANY_CHANNEL) {
+                        handler = subscribers[i].handler;
+                        break;
+                    }
+                }
+                taskEXIT_CRITICAL(&subscriber_lock);
+                if (!handler) {
+                    break;
+                }
+                if (!handler(&msg)) {
+                    stats.msg_handler_dropped++;
+                }
             }
+            isotp_pool_free(msg.data);
+            atomic_store(&dispatching, false);
             omni_led_data_transfer_stop();  // Stop LED indication
-        
         }
     }
     vTaskDelete(NULL);
@@ -160,13 +332,25 @@ static void isotp_dispatch_u(void* ptr) {
         struct twai_message_timestamp msg;
         if (xQueueReceive(isotp_unmatched_frame_queue_handle, &msg, portMAX_DELAY) == pdTRUE) {
             omni_led_data_transfer_start();  // Start LED indication
-            if (u_handlers[0]) {
-                u_handlers[0](&msg);
-            }
-            if (u_handlers[1]) {
-                u_handlers[1](&msg);
+            uint32_t id = msg.msg.identifier | (msg.msg.extd ? 0x80000000 : 0);
+            for (size_t i = 0;; i++) {
+                taskENTER_CRITICAL(&subscriber_lock);
+                omni_libisotp_unmatched_handler* handler = NULL;
+                for (; i < u_subscriber_count; i++) {
+                    if (!((id ^ u_subscribers[i].id) & u_subscribers[i].mask)) {
+                        handler = u_subscribers[i].handler;
+                        break;
+                    }
+                }
+                taskEXIT_CRITICAL(&subscriber_lock);
+                if (!handler) {
+                    break;
+                }
+                if (!handler(&msg)) {
+                    stats.unmatched_handler_dropped++;
+                }
             }
-            omni_led_data_transfer_start();  // Start LED indication
+            omni_led_data_transfer_stop();  // Stop LED indication
         }
     }
     vTaskDelete(NULL);
@@ -176,9 +360,15 @@ void omni_libisotp_main(void) {
     if (!initialized) {
         omni_libcan_main();
         omni_libcan_add_incoming_handler(isotp_read_handler);
-        isotp_event_queue_handle = xQueueCreateStatic(4, sizeof(struct isotp_event), isotp_event_queue_storage, &isotp_event_queue_buffer);
+        isotp_event_queue_handle = xQueueCreateStatic(ISOTP_EVENT_POOL_COUNT, sizeof(struct isotp_event*), isotp_event_queue_storage, &isotp_event_queue_buffer);
         isotp_unmatched_frame_queue_handle = xQueueCreateStatic(4, sizeof(struct twai_message_timestamp), isotp_unmatched_frame_queue_storage, &isotp_unmatched_frame_queue_buffer);
         isotp_msg_queue_handle = xQueueCreateStatic(4, sizeof(struct isotp_msg), isotp_msg_queue_storage, &isotp_msg_queue_buffer);
+        const esp_timer_create_args_t timer_args = {
+            .callback = isotp_timer_cb,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "isotp_timer",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &isotp_timer_handle));
         isotp_task_handle = xTaskCreateStatic(isotp_task, "isotp_task", sizeof(isotp_task_stack) / sizeof(isotp_task_stack[0]), NULL, 9, isotp_task_stack, &isotp_task_buffer);
         isotp_dispatch_handle = xTaskCreateStatic(isotp_dispatch, "isotp_dispatch", sizeof(isotp_dispatch_stack) / sizeof(isotp_dispatch_stack[0]), NULL, 5, isotp_dispatch_stack, &isotp_dispatch_buffer);
         isotp_dispatch_handle = xTaskCreateStatic(isotp_dispatch_u, "isotp_dispatch_u", sizeof(isotp_dispatch_u_stack) / sizeof(isotp_dispatch_u_stack[0]), NULL, 5, isotp_dispatch_u_stack, &isotp_dispatch_u_buffer);
@@ -186,18 +376,87 @@ void omni_libisotp_main(void) {
     }
 }
 
+bool omni_libisotp_subscribe(omni_libisotp_incoming_handler* handler, uint32_t channel, omni_libisotp_room* room) {
+    assert(handler);
+    bool ok = false;
+    taskENTER_CRITICAL(&subscriber_lock);
+    if (subscriber_count < ISOTP_MAX_SUBSCRIBERS) {
+        subscribers[subscriber_count].handler = handler;
+        subscribers[subscriber_count].channel = channel;
+        subscribers[subscriber_count].room = room;
+        subscriber_count++;
+        ok = true;
+    }
+    taskEXIT_CRITICAL(&subscriber_lock);
+    if (!ok) {
+        ESP_LOGE(tag, "too many incoming handlers");
+    }
+    return ok;
+}
+
+void omni_libisotp_unsubscribe(omni_libisotp_incoming_handler* handler, uint32_t channel) {
+    taskENTER_CRITICAL(&subscriber_lock);
+    for (size_t i = 0; i < subscriber_count;) {
+        if (subscribers[i].handler == handler && subscribers[i].channel == channel) {
+            subscribers[i] = subscribers[--subscriber_count];
+        } else {
+            i++;
+        }
+    }
+    taskEXIT_CRITICAL(&subscriber_lock);
+}
+
 void omni_libisotp_add_incoming_handler(omni_libisotp_incoming_handler* handler) {
-    if (!handlers[0]) {
-        handlers[0] = handler;
-    } else if (!handlers[1]) {
-        handlers[1] = handler;
+    omni_libisotp_subscribe(handler, OMNI_LIBISOTP_ANY_CHANNEL, NULL);
+}
+
+bool omni_libisotp_subscribe_unmatched(omni_libisotp_unmatched_handler* handler, uint32_t id, uint32_t mask, bool extd) {
+    assert(handler);
+    bool ok = false;
+    taskENTER_CRITICAL(&subscriber_lock);
+    if (u_subscriber_count < ISOTP_MAX_SUBSCRIBERS) {
+        u_subscribers[u_subscriber_count].handler = handler;
+        u_subscribers[u_subscriber_count].id = id | (extd ? 0x80000000 : 0);
+        u_subscribers[u_subscriber_count].mask = mask;
+        u_subscriber_count++;
+        ok = true;
+    }
+    taskEXIT_CRITICAL(&subscriber_lock);
+    if (!ok) {
+        ESP_LOGE(tag, "too many unmatched handlers");
     }
+    return ok;
 }
 
-void omni_libisotp_add_unmatched_handler(omni_libisotp_unmatched_handler* handler) {
-    if (!u_handlers[0]) {
-        u_handlers[0] = handler;
-    } else if (!u_handlers[1]) {
-        u_handlers[1] = handler;
+void omni_libisotp_unsubscribe_unmatched(omni_libisotp_unmatched_handler* handler) {
+    taskENTER_CRITICAL(&subscriber_lock);
+    for (size_t i = 0; i < u_subscriber_count;) {
+        if (u_subscribers[i].handler == handler) {
+            u_subscribers[i] = u_subscribers[--u_subscriber_count];
+        } else {
+            i++;
+        }
     }
+    taskEXIT_CRITICAL(&subscriber_lock);
+}
+
+void omni_libisotp_add_unmatched_handler(omni_libisotp_unmatched_handler* handler) {
+    omni_libisotp_subscribe_unmatched(handler, 0, 0, false);
+}
+
+void omni_libisotp_get_stats(struct omni_libisotp_stats* out) {
+    assert(out);
+    struct isotp_stats core;
+    isotp_get_stats(&core);
+    *out = (struct omni_libisotp_stats) {
+        .fc_wait = core.fc_wait,
+        .fc_overflow = core.fc_overflow,
+        .msg_dropped = core.msg_dropped,
+        .tx_dropped = core.tx_dropped,
+        .frames_dropped = stats.frames_dropped,
+        .unmatched_dropped = stats.unmatched_dropped,
+        .msg_handler_dropped = stats.msg_handler_dropped,
+        .unmatched_handler_dropped = stats.unmatched_handler_dropped,
+        .pair_rejected = core.pair_rejected,
+    };
 }
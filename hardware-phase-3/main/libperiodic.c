@@ -0,0 +1,240 @@
+#include <assert.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <omnitrix/libcan.h>
+#include <omnitrix/libperiodic.h>
+
+static const char tag[] = "omni_periodic";
+
+// Periodic frames go around every queue but the driver's own: an esp_timer
+// fires a little before the earliest frame is due, and its callback spins
+// the rest of the way and hands the frame to the driver. Bulk senders only
+// ever fill part of the TX queue (omni_libcan_transmit_bulk), so a periodic
+// frame waits behind a few frames at most.
+#define PERIODIC_SPIN_US 50
+
+struct account {
+    struct omni_libperiodic_stats stats;
+    uint64_t late_sum_us;
+};
+
+static struct {
+    bool active;
+    uint32_t generation; // counts starts, so results are not booked to a successor
+    twai_message_t frame;
+    uint32_t interval_us;
+    int64_t due;
+    struct account account;
+} periodics[OMNI_LIBPERIODIC_MAX];
+static struct account totals;
+static portMUX_TYPE periodic_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// only one caller at a time may stop and restart the timer, or it could end
+// up armed for a deadline that is no longer the earliest
+static StaticSemaphore_t arm_lock_buffer;
+static SemaphoreHandle_t arm_lock;
+
+static esp_timer_handle_t periodic_timer_handle;
+static bool initialized = false;
+
+// frames due on this run of the callback, in order
+static struct {
+    int index;
+    uint32_t generation;
+    int64_t due;
+    int64_t late;
+    bool sent;
+    twai_message_t frame;
+} batch[OMNI_LIBPERIODIC_MAX];
+
+static void account_add(struct account* account, int64_t late, bool sent) {
+    if (!sent) {
+        account->stats.dropped++;
+        return;
+    }
+    uint32_t late_us = (late < 0) ? 0 : (late > UINT32_MAX) ? UINT32_MAX : (uint32_t)late;
+    account->stats.sent++;
+    account->late_sum_us += late_us;
+    if (late_us > account->stats.late_max_us) {
+        account->stats.late_max_us = late_us;
+    }
+}
+
+static void account_stats(const struct account* account, struct omni_libperiodic_stats* stats) {
+    *stats = account->stats;
+    stats->late_avg_us = account->stats.sent ? account->late_sum_us / account->stats.sent : 0;
+}
+
+static void periodic_arm(void) {
+    xSemaphoreTake(arm_lock, portMAX_DELAY);
+    int64_t next = INT64_MAX;
+    taskENTER_CRITICAL(&periodic_lock);
+    for (int i = 0; i < OMNI_LIBPERIODIC_MAX; i++) {
+        if (periodics[i].active && periodics[i].due < next) {
+            next = periodics[i].due;
+        }
+    }
+    taskEXIT_CRITICAL(&periodic_lock);
+    esp_timer_stop(periodic_timer_handle);
+    if (next != INT64_MAX) {
+        int64_t delay = next - PERIODIC_SPIN_US - esp_timer_get_time();
+        esp_timer_start_once(periodic_timer_handle, (delay > 0) ? delay : 0);
+    }
+    xSemaphoreGive(arm_lock);
+}
+
+static void periodic_timer_cb(void* arg) {
+    (void)arg;
+    size_t count = 0;
+    int64_t now = esp_timer_get_time();
+    taskENTER_CRITICAL(&periodic_lock);
+    for (int i = 0; i < OMNI_LIBPERIODIC_MAX; i++) {
+        if (!periodics[i].active || periodics[i].due > now + PERIODIC_SPIN_US) {
+            continue;
+        }
+        size_t j = count++;
+        while (j && batch[j - 1].due > periodics[i].due) {
+            batch[j] = batch[j - 1];
+            j--;
+        }
+        batch[j].index = i;
+        batch[j].generation = periodics[i].generation;
+        batch[j].due = periodics[i].due;
+        batch[j].frame = periodics[i].frame;
+        periodics[i].due += periodics[i].interval_us;
+        if (periodics[i].due <= now) {
+            // behind by whole periods: skip them, but keep to the grid
+            uint32_t behind = (now - periodics[i].due) / periodics[i].interval_us + 1;
+            periodics[i].due += (int64_t)behind * periodics[i].interval_us;
+            periodics[i].account.stats.skipped += behind;
+            totals.stats.skipped += behind;
+        }
+    }
+    taskEXIT_CRITICAL(&periodic_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        while (esp_timer_get_time() < batch[i].due) { }
+        batch[i].late = esp_timer_get_time() - batch[i].due;
+        batch[i].sent = omni_libcan_transmit(&batch[i].frame, 0) == ESP_OK;
+    }
+
+    taskENTER_CRITICAL(&periodic_lock);
+    for (size_t i = 0; i < count; i++) {
+        account_add(&totals, batch[i].late, batch[i].sent);
+        if (periodics[batch[i].index].active && periodics[batch[i].index].generation == batch[i].generation) {
+            account_add(&periodics[batch[i].index].account, batch[i].late, batch[i].sent);
+        }
+    }
+    taskEXIT_CRITICAL(&periodic_lock);
+    periodic_arm();
+}
+
+void omni_libperiodic_main(void) {
+    if (!initialized) {
+        omni_libcan_main();
+        arm_lock = xSemaphoreCreateMutexStatic(&arm_lock_buffer);
+        const esp_timer_create_args_t timer_args = {
+            .callback = periodic_timer_cb,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "periodic_timer",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &periodic_timer_handle));
+        initialized = true;
+    }
+}
+
+int omni_libperiodic_start(const twai_message_t* frame, uint32_t interval_us) {
+    assert(frame);
+    assert(initialized);
+    if (!interval_us || frame->data_length_code > 8) {
+        return -1;
+    }
+    int id = -1;
+    taskENTER_CRITICAL(&periodic_lock);
+    for (int i = 0; i < OMNI_LIBPERIODIC_MAX; i++) {
+        if (!periodics[i].active) {
+            periodics[i].active = true;
+            periodics[i].generation++;
+            periodics[i].frame = *frame;
+            periodics[i].interval_us = interval_us;
+            periodics[i].due = esp_timer_get_time();
+            memset(&periodics[i].account, 0, sizeof(periodics[i].account));
+            id = i;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&periodic_lock);
+    if (id < 0) {
+        ESP_LOGE(tag, "too many periodic messages");
+        return -1;
+    }
+    periodic_arm();
+    return id;
+}
+
+bool omni_libperiodic_update(int id, const twai_message_t* frame, uint32_t interval_us) {
+    assert(frame);
+    if (id < 0 || id >= OMNI_LIBPERIODIC_MAX || !interval_us || frame->data_length_code > 8) {
+        return false;
+    }
+    bool ok = false;
+    taskENTER_CRITICAL(&periodic_lock);
+    if (periodics[id].active) {
+        int64_t now = esp_timer_get_time();
+        int64_t due = periodics[id].due - periodics[id].interval_us + interval_us;
+        periodics[id].frame = *frame;
+        periodics[id].interval_us = interval_us;
+        periodics[id].due = (due > now) ? due : now;
+        ok = true;
+    }
+    taskEXIT_CRITICAL(&periodic_lock);
+    if (ok) {
+        periodic_arm();
+    }
+    return ok;
+}
+
+void omni_libperiodic_stop(int id) {
+    if (id < 0 || id >= OMNI_LIBPERIODIC_MAX) {
+        return;
+    }
+    struct omni_libperiodic_stats stats = { 0 };
+    bool stopped = false;
+    taskENTER_CRITICAL(&periodic_lock);
+    if (periodics[id].active) {
+        periodics[id].active = false;
+        account_stats(&periodics[id].account, &stats);
+        stopped = true;
+    }
+    taskEXIT_CRITICAL(&periodic_lock);
+    if (stopped) {
+        ESP_LOGI(tag, "message %d stopped: %" PRIu32 " sent, %" PRIu32 " dropped, %" PRIu32 " skipped, late by %" PRIu32 " µs on average, %" PRIu32 " µs at most",
+            id, stats.sent, stats.dropped, stats.skipped, stats.late_avg_us, stats.late_max_us);
+        periodic_arm();
+    }
+}
+
+bool omni_libperiodic_get_stats(int id, struct omni_libperiodic_stats* stats) {
+    assert(stats);
+    if (id < -1 || id >= OMNI_LIBPERIODIC_MAX) {
+        return false;
+    }
+    bool ok = true;
+    taskENTER_CRITICAL(&periodic_lock);
+    if (id < 0) {
+        account_stats(&totals, stats);
+    } else if (periodics[id].active) {
+        account_stats(&periodics[id].account, stats);
+    } else {
+        ok = false;
+    }
+    taskEXIT_CRITICAL(&periodic_lock);
+    return ok;
+}
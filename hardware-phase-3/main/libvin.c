@@ -7,6 +7,8 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 
+#include <omnitrix/libcan.h>
+
 static const char tag[] = "omni_libvin";
 
 static bool initialized = false;
@@ -88,7 +90,7 @@ static void debug_log_vin(const char* text, const char* vin) {
 }
 
 #define can_receive(message) (twai_receive(message, pdMS_TO_TICKS(1000)) == ESP_OK)
-#define can_transmit(message) (twai_transmit(message, pdMS_TO_TICKS(1000)) == ESP_OK)
+#define can_transmit(message) (omni_libcan_transmit(message, pdMS_TO_TICKS(1000)) == ESP_OK)
 
 static bool generic_match(const twai_message_t* pattern, int data_len) {
     assert(pattern);
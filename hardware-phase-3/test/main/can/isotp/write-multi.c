@@ -178,7 +178,6 @@ static void sync_cb(void) {
 }
 
 TEST_CASE("CAN ISO-TP endpoint - write multi", "[ble][can][isotp]") {
-    TEST_IGNORE_MESSAGE("multi-frame writes are not yet implemented");
     memset(actual, 0, sizeof(actual));
     start_handle = 0;
     end_handle = 0;
@@ -0,0 +1,264 @@
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <driver/twai.h>
+#include <esp_timer.h>
+#include <host/ble_gap.h>
+#include <host/ble_gatt.h>
+#include <host/ble_hs.h>
+#include <host/ble_hs_adv.h>
+#include <host/ble_hs_id.h>
+#include <host/ble_hs_mbuf.h>
+#include <host/ble_store.h>
+#include <host/util/util.h>
+#include <nimble/nimble_port.h>
+#include <services/gap/ble_svc_gap.h>
+#include <unity.h>
+
+static const ble_uuid128_t hello_svc = BLE_UUID128_INIT(0x46, 0x9a, 0x1b, 0xa2, 0xe8, 0xb6, 0xf6, 0x93, 0x33, 0x43, 0x3d, 0x4e, 0xa8, 0x1b, 0x94, 0x49);
+static const ble_uuid128_t isotp_pairs_chr = BLE_UUID128_INIT(0x39, 0x9d, 0x8e, 0x6a, 0x12, 0x6e, 0x8b, 0xb1, 0x57, 0x4d, 0xd7, 0xdf, 0x1d, 0x80, 0x31, 0x7e);
+static const ble_uuid128_t isotp_msg_chr = BLE_UUID128_INIT(0x1e, 0x9a, 0x7a, 0x3f, 0x3f, 0x9e, 0x6f, 0x87, 0x3a, 0x42, 0x2b, 0xb9, 0xe1, 0xd4, 0x13, 0x28);
+
+static const uint8_t pairs[] = {
+    0x20, 0x00, 0x07, 0xE8, 0x00, 0xCC, 0x20, 0x00, 0x07, 0xE0, 0x00, 0xCC,
+    0x20, 0x00, 0x07, 0xE9, 0x00, 0xCC, 0x20, 0x00, 0x07, 0xE1, 0x00, 0xCC,
+};
+// 6 bytes in the first frame, 56 in 8 consecutive frames
+static uint8_t message[4 + 62] = { 0x00, 0x00, 0x07, 0xE8 };
+// sent at the same time, without STmin, so its consecutive frames keep the
+// TX queue busy: 6 bytes in the first frame, 168 in 24 consecutive frames
+static uint8_t other_message[4 + 174] = { 0x00, 0x00, 0x07, 0xE9 };
+#define OTHER_CFS 24
+// STmin 300 µs, far below one FreeRTOS tick
+#define STMIN_US 300
+static const twai_message_t flow_control = { .identifier = 0x7E0, .data_length_code = 8, .data = { 0x30, 0x00, 0xF3, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC } };
+static const twai_message_t other_flow_control = { .identifier = 0x7E1, .data_length_code = 8, .data = { 0x30, 0x00, 0x00, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC } };
+// an 8 byte standard frame takes 222 to 270 µs at 500 kbit/s, depending on stuff bits
+#define FRAME_MIN_US 222
+#define FRAME_MAX_US 270
+// frames of the other transfer that can be queued ahead of one of ours
+#define QUEUED_AHEAD 16
+// allowed pacing error, and jitter of the receive timestamps taken here
+#define TOLERANCE_US 50
+#define JITTER_US 30
+static twai_message_t actual[9] = { 0 };
+static int64_t times[9] = { 0 };
+static jmp_buf out;
+
+static int write3_cb(uint16_t conn_handle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg) {
+    static int count = 0;
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    TEST_ASSERT_EQUAL_HEX(0, error->status);
+    longjmp(out, 1);
+    return 0;
+}
+
+static int write2_cb(uint16_t conn_handle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg) {
+    static int count = 0;
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    TEST_ASSERT_EQUAL_HEX(0, error->status);
+    TEST_ASSERT_EQUAL_HEX(0, ble_gattc_write_flat(conn_handle, attr->handle, &other_message, sizeof(other_message), write3_cb, NULL));
+    return 0;
+}
+
+static int chr2_cb(uint16_t conn_handle, const struct ble_gatt_error* error, const struct ble_gatt_chr* chr, void* arg) {
+    static int count = 0;
+    if (count && error->status == 0xe) {
+        return 0;
+    }
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    TEST_ASSERT_EQUAL_HEX(0, error->status);
+    TEST_ASSERT(chr);
+    TEST_ASSERT_EQUAL_HEX(0, ble_gattc_write_flat(conn_handle, chr->val_handle, &message, sizeof(message), write2_cb, NULL));
+    return 0;
+}
+
+static uint16_t start_handle = 0;
+static uint16_t end_handle = 0;
+
+static int write_cb(uint16_t conn_handle, const struct ble_gatt_error* error, struct ble_gatt_attr* attr, void* arg) {
+    static int count = 0;
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    TEST_ASSERT_EQUAL_HEX(0, error->status);
+    TEST_ASSERT_EQUAL_HEX(0, ble_gattc_disc_chrs_by_uuid(conn_handle, start_handle, end_handle, &isotp_msg_chr.u, chr2_cb, NULL));
+    return 0;
+}
+
+static int chr_cb(uint16_t conn_handle, const struct ble_gatt_error* error, const struct ble_gatt_chr* chr, void* arg) {
+    static int count = 0;
+    if (count && error->status == 0xe) {
+        return 0;
+    }
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    TEST_ASSERT_EQUAL_HEX(0, error->status);
+    TEST_ASSERT(chr);
+    TEST_ASSERT_EQUAL_HEX(0, ble_gattc_write_flat(conn_handle, chr->val_handle, &pairs, sizeof(pairs), write_cb, NULL));
+    return 0;
+}
+
+static int svc_cb(uint16_t conn_handle, const struct ble_gatt_error* error, const struct ble_gatt_svc* service, void* arg) {
+    static int count = 0;
+    if (count && error->status == 0xe) {
+        return 0;
+    }
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    TEST_ASSERT_EQUAL_HEX(0, error->status);
+    TEST_ASSERT(service);
+    start_handle = service->start_handle;
+    end_handle = service->end_handle;
+    TEST_ASSERT_EQUAL_HEX(0, ble_gattc_disc_chrs_by_uuid(conn_handle, service->start_handle, service->end_handle, &isotp_pairs_chr.u, chr_cb, NULL));
+    return 0;
+}
+
+static int mtu_cb(uint16_t conn_handle, const struct ble_gatt_error* error, uint16_t mtu, void* arg) {
+    static int count = 0;
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    TEST_ASSERT_EQUAL_HEX(0, error->status);
+    TEST_ASSERT_EQUAL_HEX(0, ble_gattc_disc_svc_by_uuid(conn_handle, &hello_svc.u, svc_cb, NULL));
+    return 0;
+}
+
+static int connect_cb(struct ble_gap_event* event, void* arg) {
+    static int count = 0;
+    switch (event->type) {
+    case BLE_GAP_EVENT_CONNECT:
+        TEST_ASSERT_EQUAL(0, count);
+        count++;
+        TEST_ASSERT_EQUAL_HEX(0, event->connect.status);
+        struct ble_gap_conn_desc desc;
+        TEST_ASSERT_EQUAL_HEX(0, ble_gap_conn_find(event->connect.conn_handle, &desc));
+        int rc = ble_gattc_exchange_mtu(event->connect.conn_handle, mtu_cb, NULL);
+        if (rc != 0xe) {
+            TEST_ASSERT_EQUAL_HEX(0, rc);
+        }
+        break;
+    case BLE_GAP_EVENT_MTU:
+        break;
+    default:
+        TEST_FAIL_MESSAGE("unexpected connect CB");
+        break;
+    }
+
+    return 0;
+}
+
+static int scan_cb(struct ble_gap_event* event, void* arg) {
+    static int count = 0;
+    struct ble_hs_adv_fields fields;
+    switch (event->type) {
+    case BLE_GAP_EVENT_DISC:
+        TEST_ASSERT_EQUAL_HEX(0, ble_hs_adv_parse_fields(&fields, event->disc.data, event->disc.length_data));
+        if (fields.name_len > 0 && !strncmp((const char*)fields.name, "BlinkCar v1.0", fields.name_len)) {
+            TEST_ASSERT_EQUAL(0, count);
+            count++;
+            TEST_ASSERT_EQUAL_HEX(0, ble_gap_disc_cancel());
+            uint8_t own_addr_type;
+            TEST_ASSERT_EQUAL_HEX(0, ble_hs_id_infer_auto(0, &own_addr_type));
+            TEST_ASSERT_EQUAL_HEX(0, ble_gap_connect(own_addr_type, &event->disc.addr, 30000, NULL, connect_cb, NULL));
+        }
+        break;
+    case BLE_GAP_EVENT_DISC_COMPLETE:
+        TEST_FAIL_MESSAGE("scan timeout");
+        break;
+    default:
+        TEST_FAIL_MESSAGE("unexpected scan CB");
+        break;
+    }
+
+    return 0;
+}
+
+static void scan(void) {
+    static int count = 0;
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    uint8_t own_addr_type;
+    TEST_ASSERT_EQUAL_HEX(0, ble_hs_id_infer_auto(0, &own_addr_type));
+
+    struct ble_gap_disc_params params = {
+        .filter_duplicates = 1,
+        .passive = 1,
+    };
+    TEST_ASSERT_EQUAL_HEX(0, ble_gap_disc(own_addr_type, 30000, &params, scan_cb, NULL));
+}
+
+static void reset_cb(int reason) {
+    TEST_FAIL_MESSAGE("unexpected BLE reset");
+}
+
+static void sync_cb(void) {
+    static int count = 0;
+    TEST_ASSERT_EQUAL(0, count);
+    count++;
+    TEST_ASSERT_EQUAL_HEX(0, ble_hs_util_ensure_addr(0));
+    scan();
+}
+
+TEST_CASE("CAN ISO-TP endpoint - write STmin", "[ble][can][isotp]") {
+    memset(actual, 0, sizeof(actual));
+    for (size_t i = 4; i < sizeof(message); i++) {
+        message[i] = i;
+    }
+    for (size_t i = 4; i < sizeof(other_message); i++) {
+        other_message[i] = ~i;
+    }
+    start_handle = 0;
+    end_handle = 0;
+
+    ble_hs_cfg.reset_cb = reset_cb;
+    ble_hs_cfg.sync_cb = sync_cb;
+    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+
+    void ble_store_config_init(void);
+    ble_store_config_init();
+
+    if (!setjmp(out)) {
+        nimble_port_run();
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, twai_receive(actual, pdMS_TO_TICKS(30000)));
+    TEST_ASSERT_EQUAL_HEX(0x7E8, actual[0].identifier);
+    TEST_ASSERT_EQUAL_HEX8(0x10, actual[0].data[0]);
+    twai_message_t frame;
+    TEST_ASSERT_EQUAL(ESP_OK, twai_receive(&frame, pdMS_TO_TICKS(30000)));
+    TEST_ASSERT_EQUAL_HEX(0x7E9, frame.identifier);
+    TEST_ASSERT_EQUAL_HEX8(0x10, frame.data[0]);
+    // the other transfer fills the TX queue first
+    TEST_ASSERT_EQUAL(ESP_OK, twai_transmit(&other_flow_control, pdMS_TO_TICKS(30000)));
+    TEST_ASSERT_EQUAL(ESP_OK, twai_transmit(&flow_control, pdMS_TO_TICKS(30000)));
+    int other = 0;
+    for (int i = 1; i < 9;) {
+        TEST_ASSERT_EQUAL(ESP_OK, twai_receive(&frame, pdMS_TO_TICKS(30000)));
+        if (frame.identifier == 0x7E9) {
+            TEST_ASSERT_EQUAL_HEX8(0x20 | ((other + 1) & 0xF), frame.data[0]);
+            other++;
+            continue;
+        }
+        actual[i] = frame;
+        times[i] = esp_timer_get_time();
+        TEST_ASSERT_EQUAL_HEX8(0x20 | i, actual[i].data[0]);
+        i++;
+    }
+    while (other < OTHER_CFS) {
+        TEST_ASSERT_EQUAL(ESP_OK, twai_receive(&frame, pdMS_TO_TICKS(30000)));
+        TEST_ASSERT_EQUAL_HEX(0x7E9, frame.identifier);
+        other++;
+    }
+    // From the end of one consecutive frame to the end of the next: STmin
+    // plus the second frame, never less, however many frames of the other
+    // transfer were queued ahead of it. Those come on top.
+    for (int i = 2; i < 9; i++) {
+        int64_t gap = times[i] - times[i - 1];
+        printf("gap %d: %lld us\n", i - 1, (long long)gap);
+        TEST_ASSERT_GREATER_OR_EQUAL(STMIN_US + FRAME_MIN_US - JITTER_US, gap);
+        TEST_ASSERT_LESS_OR_EQUAL(STMIN_US + (QUEUED_AHEAD + 1) * FRAME_MAX_US + TOLERANCE_US + JITTER_US, gap);
+    }
+}
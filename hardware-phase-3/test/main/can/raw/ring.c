@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <driver/twai.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <omnitrix/ring.h>
+#include <unity.h>
+
+#define FRAMES 100000
+#define BATCH 32
+
+// same layout as the firmware's struct twai_message_timestamp
+struct frame {
+    twai_message_t msg;
+    int64_t time;
+};
+
+static struct frame queue_storage[256];
+static StaticQueue_t queue_buffer;
+static QueueHandle_t queue_handle;
+
+static struct frame ring_storage[256];
+static struct omni_ring ring = OMNI_RING_INIT(ring_storage);
+
+static TaskHandle_t consumer_handle;
+static TaskHandle_t main_handle;
+static volatile uint32_t checksum;
+
+static void queue_consumer(void* ptr) {
+    (void)ptr;
+    uint32_t sum = 0;
+    for (int i = 0; i < FRAMES; i++) {
+        struct frame frame;
+        xQueueReceive(queue_handle, &frame, portMAX_DELAY);
+        sum += frame.msg.identifier;
+    }
+    checksum = sum;
+    xTaskNotifyGive(main_handle);
+    vTaskDelete(NULL);
+}
+
+static void ring_consumer(void* ptr) {
+    (void)ptr;
+    uint32_t sum = 0;
+    for (int i = 0; i < FRAMES;) {
+        size_t count = omni_ring_peek(&ring, BATCH);
+        if (!count) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        for (size_t j = 0; j < count; j++) {
+            const struct frame* frame = omni_ring_at(&ring, j);
+            sum += frame->msg.identifier;
+        }
+        omni_ring_release(&ring, count);
+        i += count;
+    }
+    checksum = sum;
+    xTaskNotifyGive(main_handle);
+    vTaskDelete(NULL);
+}
+
+static uint32_t expected_checksum(void) {
+    uint32_t sum = 0;
+    for (int i = 0; i < FRAMES; i++) {
+        sum += i & 0x7FF;
+    }
+    return sum;
+}
+
+static int64_t bench_queue(void) {
+    queue_handle = xQueueCreateStatic(256, sizeof(struct frame), (uint8_t*)queue_storage, &queue_buffer);
+    TEST_ASSERT(queue_handle);
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreatePinnedToCore(queue_consumer, "queue_consumer", 4096, NULL, 5, &consumer_handle, 1));
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < FRAMES; i++) {
+        struct frame frame = { .msg = { .identifier = i & 0x7FF, .data_length_code = 8 } };
+        frame.time = esp_timer_get_time();
+        TEST_ASSERT_EQUAL(pdTRUE, xQueueSend(queue_handle, &frame, portMAX_DELAY));
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int64_t elapsed = esp_timer_get_time() - start;
+    vQueueDelete(queue_handle);
+    TEST_ASSERT_EQUAL_UINT32(expected_checksum(), checksum);
+    return elapsed;
+}
+
+static int64_t bench_ring(void) {
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreatePinnedToCore(ring_consumer, "ring_consumer", 4096, NULL, 5, &consumer_handle, 1));
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < FRAMES; i++) {
+        struct frame* frame;
+        while (!(frame = omni_ring_acquire(&ring))) {
+            taskYIELD();
+        }
+        memset(&frame->msg, 0, sizeof(frame->msg));
+        frame->msg.identifier = i & 0x7FF;
+        frame->msg.data_length_code = 8;
+        frame->time = esp_timer_get_time();
+        if (omni_ring_publish(&ring)) {
+            xTaskNotifyGive(consumer_handle);
+        }
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int64_t elapsed = esp_timer_get_time() - start;
+    TEST_ASSERT_EQUAL_UINT32(expected_checksum(), checksum);
+    return elapsed;
+}
+
+TEST_CASE("CAN raw - ring vs queue frame throughput", "[can][raw][bench]") {
+    main_handle = xTaskGetCurrentTaskHandle();
+    int64_t queue_us = bench_queue();
+    int64_t ring_us = bench_ring();
+    ESP_LOGI("omnitest", "queue: %d frames in %lld us (%lld frames/s)", FRAMES, queue_us, FRAMES * 1000000LL / queue_us);
+    ESP_LOGI("omnitest", "ring: %d frames in %lld us (%lld frames/s)", FRAMES, ring_us, FRAMES * 1000000LL / ring_us);
+    TEST_ASSERT_MESSAGE(ring_us < queue_us, "ring should beat the queue");
+}